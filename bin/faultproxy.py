@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+"""A TCP proxy that makes a memcached misbehave, for tests and benchmarks
+
+usage: faultproxy.py LISTEN_PORT UPSTREAM_HOST:PORT [FAULTS]
+
+FAULTS is a comma-separated list of name=value pairs:
+
+  delay=MS        delay every response by MS milliseconds
+  jitter=MS       and by up to MS more, uniformly at random
+  stall=P         stall a response with probability P ...
+  stall_time=MS   ... for MS milliseconds (default 1000)
+  drop=P          drop the connection instead of forwarding a request with
+                  probability P
+
+Responses on a connection stay in order, so a delayed response holds up the
+ones behind it the way a slow server does.
+"""
+
+import sys
+import random
+import asyncio
+import logging
+import threading
+
+logger = logging.getLogger('pylibmc.faultproxy')
+
+fault_names = ('delay', 'jitter', 'stall', 'stall_time', 'drop')
+
+
+def parse_faults(spec):
+    "Parse 'delay=20,jitter=5' into a dict of floats"
+    faults = {}
+    for item in filter(None, spec.split(',')):
+        name, _, value = item.partition('=')
+        if name not in fault_names:
+            raise ValueError(f'unknown fault {name!r}')
+        faults[name] = float(value)
+    return faults
+
+
+class FaultProxy:
+    """Proxy connections on *port* to *upstream*, injecting *faults*
+
+    Runs its own event loop in a daemon thread between start() and stop().
+    Port 0 picks a free port, available as the port attribute once started.
+    """
+
+    def __init__(self, upstream, faults=None, port=0, host='127.0.0.1'):
+        self.upstream_host, _, upstream_port = upstream.rpartition(':')
+        self.upstream_port = int(upstream_port)
+        self.faults = dict(faults or {})
+        self.host = host
+        self.port = port
+        self.random = random.Random()
+        self.loop = None
+        self.server = None
+        self.thread = None
+
+    @property
+    def address(self):
+        return f'{self.host}:{self.port}'
+
+    def response_delay(self):
+        f = self.faults
+        delay = f.get('delay', 0.0) + self.random.uniform(0, f.get('jitter', 0.0))
+        if self.random.random() < f.get('stall', 0.0):
+            delay += f.get('stall_time', 1000.0)
+        return delay / 1000.0
+
+    async def forward_requests(self, reader, writer):
+        while True:
+            data = await reader.read(65536)
+            if not data:
+                break
+            if self.random.random() < self.faults.get('drop', 0.0):
+                raise ConnectionResetError('dropped by fault injection')
+            writer.write(data)
+            await writer.drain()
+
+    async def forward_responses(self, reader, writer):
+        while True:
+            data = await reader.read(65536)
+            if not data:
+                break
+            delay = self.response_delay()
+            if delay:
+                await asyncio.sleep(delay)
+            writer.write(data)
+            await writer.drain()
+
+    async def handle(self, client_reader, client_writer):
+        try:
+            server_reader, server_writer = await asyncio.open_connection(
+                self.upstream_host, self.upstream_port)
+        except OSError as e:
+            logger.warning('cannot reach %s:%d: %s', self.upstream_host,
+                           self.upstream_port, e)
+            client_writer.close()
+            return
+        tasks = [asyncio.ensure_future(self.forward_requests(client_reader,
+                                                             server_writer)),
+                 asyncio.ensure_future(self.forward_responses(server_reader,
+                                                              client_writer))]
+        try:
+            done, _ = await asyncio.wait(tasks,
+                                         return_when=asyncio.FIRST_COMPLETED)
+        except asyncio.CancelledError:
+            # The proxy is stopping.
+            done = ()
+        reset = any(not t.cancelled() and isinstance(t.exception(), OSError)
+                    for t in done)
+        for task in tasks:
+            task.cancel()
+        for writer in (client_writer, server_writer):
+            if reset:
+                # Pass resets on rather than closing cleanly.
+                writer.transport.abort()
+            else:
+                writer.close()
+
+    def start(self):
+        started = threading.Event()
+
+        def run():
+            self.loop = asyncio.new_event_loop()
+            asyncio.set_event_loop(self.loop)
+            self.server = self.loop.run_until_complete(asyncio.start_server(
+                self.handle, self.host, self.port))
+            self.port = self.server.sockets[0].getsockname()[1]
+            started.set()
+            self.loop.run_forever()
+            self.server.close()
+            tasks = asyncio.all_tasks(self.loop)
+            for task in tasks:
+                task.cancel()
+            self.loop.run_until_complete(
+                asyncio.gather(*tasks, return_exceptions=True))
+            self.loop.close()
+
+        self.thread = threading.Thread(target=run, daemon=True)
+        self.thread.start()
+        started.wait()
+        logger.info('proxying %s to %s:%d with %r', self.address,
+                    self.upstream_host, self.upstream_port, self.faults)
+        return self
+
+    def stop(self):
+        self.loop.call_soon_threadsafe(self.loop.stop)
+        self.thread.join()
+
+    def __enter__(self):
+        return self.start()
+
+    def __exit__(self, *exc_info):
+        self.stop()
+
+
+def main(argv=sys.argv[1:]):
+    if len(argv) not in (2, 3):
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+    faults = parse_faults(argv[2] if len(argv) > 2 else '')
+    proxy = FaultProxy(argv[1], faults, port=int(argv[0])).start()
+    try:
+        proxy.thread.join()
+    except KeyboardInterrupt:
+        proxy.stop()
+    return 0
+
+
+if __name__ == '__main__':
+    logging.basicConfig(level=logging.INFO)
+    sys.exit(main())
@@ -1,247 +1,450 @@
-#!/usr/bin/env python
-"""Run benchmarks with build/lib.* in sys.path"""
+#!/usr/bin/env python3
+"""Run benchmarks with build/lib.* in sys.path
 
+usages:
+  runbench.py run [options]        -- run the scenarios, optionally saving JSON
+  runbench.py compare OLD NEW      -- compare two saved runs
+  runbench.py list                 -- list the scenarios
+  runbench.py distribution         -- compare the key distributions
+  runbench.py clone                -- time clones and their memory
 
+Servers are taken from --servers, then MEMCACHED_SERVERS, which
+bin/with-memcached sets, so a fleet of four local memcached instances is:
+
+  MEMCACHED_INSTANCES=4 bin/with-memcached bin/runbench.py run -o new.json
+
+Scenarios with faults put bin/faultproxy.py in front of the first server, so
+the fleet should have more than one for them to tell anything.
+"""
+
+
+import os
 import sys
-import math
+import json
 import time
+import random
+import fnmatch
 import logging
-from functools import wraps
+import argparse
+import platform
+import threading
+import subprocess
 from collections import namedtuple
-from contextlib import contextmanager
 
 
 logger = logging.getLogger('pylibmc.bench')
 
-Benchmark = namedtuple('Benchmark', 'name f args kwargs')
-Participant = namedtuple('Participant', 'name connect')
+Scenario = namedtuple('Scenario', 'name op value_size nkeys hit_ratio compress'
+                                   ' faults behaviors', defaults=(None, None))
+Participant = namedtuple('Participant', 'name binary behaviors')
 
 
 def build_lib_dirname():
     from setuptools import Distribution
-    from setuptools.command import build
-    build_cmd = build(Distribution({"ext_modules": True}))
+    try:
+        from setuptools.command.build import build
+    except ImportError:
+        from distutils.command.build import build
+    build_cmd = build(Distribution({"ext_modules": ["_pylibmc"]}))
     build_cmd.finalize_options()
     return build_cmd.build_lib
 
 
-class Stopwatch:
-    "A stopwatch that never stops"
-
-    def __init__(self):
-        self.t0 = time.clock()
-        self.laps = []
-
-    def __unicode__(self):
-        mean, diff = self.interval()
-        return f"{mean:.3g} ± {diff:.3g} secs"
-
-    def mean(self):
-        return sum(self.laps) / len(self.laps)
-
-    def stddev(self, mean=None):
-        mean = self.mean() if mean is None else mean
-        sqsum = sum((lap - mean)**2 for lap in self.laps)
-        return math.sqrt(sqsum / len(self.laps))
-
-    def interval(self, alpha=0.05):
-        "Confidence interval of 1 - alpha probability"
-        from scipy.stats import norm
-        mean = self.mean()
-        sigma = self.stddev(mean=mean)
-        diff = norm(0, sigma).ppf(1 - alpha/2)
-        return mean, diff
-
-    def total(self):
-        return time.clock() - self.t0
-
-    @contextmanager
-    def timing(self):
-        t0 = time.clock()
-        try:
-            yield
-        finally:
-            te = time.clock()
-            self.laps.append(te - t0)
-
-
-def benchmark_method(f):
-    "decorator to turn f into a factory of benchmarks"
-    @wraps(f)
-    def inner(name, *args, **kwargs):
-        return Benchmark(name, f, args, kwargs)
-    return inner
-
-
-@benchmark_method
-def bench_get_set(mc, key, data):
-    if not mc.set(key, data, min_compress_len=4001):
-        logger.warning('set(%r, ...) fail', key)
-    if mc.get(key) != data:
-        logger.warning('get(%r) fail', key)
-
-
-@benchmark_method
-def bench_get_set_multi(mc, keys, pairs):
-    fails = mc.set_multi(pairs)
-    if fails:
-        logger.warning('set_multi(%r) fail', fails)
-    if len(mc.get_multi(keys)) != len(pairs):
-        logger.warning('get_multi() incomplete')
-
+def percentile(sorted_laps, p):
+    "Nearest-rank percentile of an already sorted list"
+    rank = max(1, int(p / 100.0 * len(sorted_laps) + 0.5))
+    return sorted_laps[min(rank, len(sorted_laps)) - 1]
+
+
+def value_of(size, compress):
+    "A value of *size* bytes, compressible or not"
+    if compress:
+        return (b'all work no play jack is a dull boy ' * (size // 36 + 1))[:size]
+    if not size:
+        return b''
+    return random.Random(size).getrandbits(8 * size).to_bytes(size, 'little')
+
+
+def scenarios():
+    "The default suite: each dimension varied on its own from a small base"
+    yield Scenario('get', 'get', 32, 1000, 1.0, False)
+    yield Scenario('get-miss', 'get', 32, 1000, 0.0, False)
+    yield Scenario('get-half', 'get', 32, 1000, 0.5, False)
+    yield Scenario('set', 'set', 32, 1000, 1.0, False)
+    yield Scenario('incr', 'incr', 0, 1000, 1.0, False)
+    for size in (4096, 102400):
+        yield Scenario(f'get-{size}', 'get', size, 100, 1.0, False)
+        yield Scenario(f'set-{size}', 'set', size, 100, 1.0, False)
+        yield Scenario(f'set-{size}-compressed', 'set', size, 100, 1.0, True)
+        yield Scenario(f'get-{size}-compressed', 'get', size, 100, 1.0, True)
+    for nkeys in (10, 100):
+        yield Scenario(f'get_multi-{nkeys}', 'get_multi', 32, nkeys, 1.0, False)
+        yield Scenario(f'get_multi-{nkeys}-half', 'get_multi', 32, nkeys, 0.5, False)
+        yield Scenario(f'set_multi-{nkeys}', 'set_multi', 32, nkeys, 1.0, False)
+    yield Scenario('get_multi-10-4096', 'get_multi', 4096, 10, 1.0, False)
+
+    # One slow or failing server; timeouts are in milliseconds except
+    # receive_timeout, which libmemcached takes in microseconds.
+    slow = {'delay': 5, 'jitter': 5}
+    yield Scenario('get-slow', 'get', 32, 1000, 1.0, False, faults=slow)
+    yield Scenario('get_multi-100-slow', 'get_multi', 32, 100, 1.0, False,
+                   faults=slow)
+    yield Scenario('get-stalls-timeout', 'get', 32, 1000, 1.0, False,
+                   faults={'stall': 0.01, 'stall_time': 500},
+                   behaviors={'receive_timeout': 100000, 'retry_timeout': 1})
+    yield Scenario('get_multi-100-stalls-timeout', 'get_multi', 32, 100, 1.0,
+                   False, faults={'stall': 0.01, 'stall_time': 500},
+                   behaviors={'receive_timeout': 100000, 'retry_timeout': 1})
+    yield Scenario('get-drops-failover', 'get', 32, 1000, 1.0, False,
+                   faults={'drop': 0.001},
+                   behaviors={'remove_failed': 1, 'retry_timeout': 1,
+                              'connect_timeout': 100})
+    yield Scenario('get_multi-100-drops-failover', 'get_multi', 32, 100, 1.0,
+                   False, faults={'drop': 0.001},
+                   behaviors={'remove_failed': 1, 'retry_timeout': 1,
+                              'connect_timeout': 100})
 
-@benchmark_method
-def bench_incr_decr(mc, key):
-    mc.set(key, 0)
-    mc.incr(key)
-    mc.incr(key, 2)
-    mc.decr(key, 10)
-    if mc.get(key) != 0:
-        logger.warning('key not zero')
-
-
-def multi_pairs(n, *keys):
-    d = {b'%s%d' % (k, i): b'data%s%d' % (k, i)
-         for i in range(n)
-         for k in keys}
-    return (d.keys(), d)
-
-
-complex_data_type = ([], {}, __import__('fractions').Fraction(3, 4))
-
-benchmarks = [
-    bench_get_set('Small I/O', b'abc', b'all work no play jack is a dull boy'),
-    bench_get_set_multi('Multi I/O', *multi_pairs(10, b'abc', b'def', b'ghi', b'kjl')),
-    bench_get_set('4k uncompressed I/O', b'abc' * 8, b'defb' * 1000),
-    bench_get_set('4k compressed I/O', b'abc' * 8, b'a' + 'defb' * 1000),
-    bench_get_set('Complex data I/O', b'abc', complex_data_type),
-    bench_incr_decr('Incr/decr I/O', b'abc'),
-]
 
 participants = [
-
-    Participant(name='pylibmc',
-               connect=lambda: __import__('pylibmc.test').test.make_test_client()),
-
-    Participant(name='nonblock',
-               connect=lambda: __import__('pylibmc.test').test.make_test_client(
-        behaviors={'tcp_nodelay':  True,
-                   'verify_keys':  False,
-                   'hash':         'crc',
-                   'no_block':     True})),
-
-    Participant(name='binary',
-               connect=lambda: __import__('pylibmc.test').test.make_test_client(
-        binary=True,
-        behaviors={'tcp_nodelay': True,
-                   'hash':        'crc'})),
-
-    Participant(name='python-memcache',
-               connect=lambda: __import__('memcache').Client(['127.0.0.1:11211'])),
-
+    Participant(name='pylibmc', binary=False,
+                behaviors={}),
+    Participant(name='nonblock', binary=False,
+                behaviors={'tcp_nodelay': True, 'verify_keys': False,
+                           'hash': 'crc', 'no_block': True}),
+    Participant(name='binary', binary=True,
+                behaviors={'tcp_nodelay': True, 'hash': 'crc'}),
 ]
 
 
-class Workout:
-    """Do you even lift?"""
-
-    # Confidence level in plot
-    plot_alpha = 0.1
-
-    def __init__(self, timings=None,
-                 participants=participants, benchmarks=benchmarks,
-                 bench_time=10.0):
-        self.timings = timings
-        self.participants = participants
-        self.benchmarks = benchmarks
-        self.bench_time = bench_time
-
-    def bench(self):
-        self.mcs = [p.connect() for p in self.participants]
-        self.timings = [list(self._time(*b)) for b in self.benchmarks]
-
-    def _time(self, name, f, args, kwargs):
-        "Perform a benchmark for all participants and time it"
-        logger.info('Benchmark %s', name)
-        for participant, mc in zip(self.participants, self.mcs):
-            sw = Stopwatch()
-            while sw.total() < self.bench_time:
-                with sw.timing():
-                    f(mc, *args, **kwargs)
-            logger.info('%s: %s', participant.name, sw)
-            yield sw
-
-    def print_stats(self, file=sys.stdout):
-        for i, timings in enumerate(self.timings):
-            print(self.benchmarks[i].name, file=file)
-            for participant, timing in zip(self.participants, timings):
-                print(f' - {participant.name}: {timing}', file=file)
-
-    def plot(self, filename):
-        from matplotlib import pyplot as plt
-
-        # Find how many rows and columns the benchmark plots can be laid out on
-        # while still "filling the rectangle" by the greatest divisor of the
-        # number of benchmarks.
-        n = len(self.benchmarks)
-        rows = next(i for i in range(n - 1, 0, -1) if i*(n/i) == n)
-        cols = n/rows
-        assert cols*rows == n
-
-        plt.figure(figsize=(6*cols, 2.5*rows))
-
-        for i, (name, f, args, kwargs) in enumerate(self.benchmarks):
-            plt.subplot(rows, cols, 1+i)
-            plt.title(name)
-            plt.boxplot([timing.laps for timing in self.timings[i]],
-                        labels=[p.name for p in self.participants])
-
-        plt.tight_layout()
-        plt.savefig(filename)
-
-
-def main(args=sys.argv[1:]):
+class Workload:
+    "One scenario prepared against one client: keys populated, calls ready"
+
+    def __init__(self, mc, scenario):
+        self.scenario = s = scenario
+        self.value = value_of(s.value_size, s.compress)
+        self.min_compress_len = 1 if s.compress else 0
+        prefix = f'bench:{s.name}:'
+        self.keys = [f'{prefix}{i}' for i in range(s.nkeys)]
+        nhits = int(round(s.nkeys * s.hit_ratio))
+        mc.delete_multi(self.keys)
+        if s.op == 'incr':
+            mc.set_multi(dict.fromkeys(self.keys[:nhits], 0))
+        else:
+            mc.set_multi(dict.fromkeys(self.keys[:nhits], self.value),
+                         min_compress_len=self.min_compress_len)
+        # Interleave hits and misses.
+        random.Random(s.name).shuffle(self.keys)
+        self.mapping = dict.fromkeys(self.keys, self.value)
+
+    def call(self, mc, i):
+        "Perform call *i* of the workload, returning the keys it touched"
+        s = self.scenario
+        if s.op == 'get':
+            mc.get(self.keys[i % s.nkeys])
+        elif s.op == 'set':
+            mc.set(self.keys[i % s.nkeys], self.value,
+                   min_compress_len=self.min_compress_len)
+        elif s.op == 'incr':
+            mc.incr(self.keys[i % s.nkeys])
+        elif s.op == 'get_multi':
+            mc.get_multi(self.keys)
+            return s.nkeys
+        elif s.op == 'set_multi':
+            mc.set_multi(self.mapping, min_compress_len=self.min_compress_len)
+            return s.nkeys
+        else:
+            raise ValueError(f'unknown op {s.op!r}')
+        return 1
+
+
+def run_scenario(make_client, scenario, threads, bench_time):
+    "Run *scenario* on *threads* clients at once for about *bench_time* secs"
+    import pylibmc
+    mcs = [make_client() for _ in range(threads)]
+    workload = Workload(mcs[0], scenario)
+    laps = [[] for _ in mcs]
+    nkeys = [0] * threads
+    errors = [0] * threads
+    barrier = threading.Barrier(threads + 1)
+    clock = time.perf_counter_ns
+
+    def worker(n):
+        mc, mylaps, i = mcs[n], laps[n], n
+        barrier.wait()
+        t_end = clock() + int(bench_time * 1e9)
+        t0 = clock()
+        while t0 < t_end:
+            try:
+                nkeys[n] += workload.call(mc, i)
+            except pylibmc.NotFound:
+                nkeys[n] += 1
+            except pylibmc.Error:
+                errors[n] += 1
+            t1 = clock()
+            mylaps.append(t1 - t0)
+            t0 = t1
+            i += threads
+
+    workers = [threading.Thread(target=worker, args=(n,))
+               for n in range(threads)]
+    for w in workers:
+        w.start()
+    barrier.wait()
+    t0 = clock()
+    for w in workers:
+        w.join()
+    elapsed = (clock() - t0) / 1e9
+
+    all_laps = sorted(lap for mylaps in laps for lap in mylaps)
+    return {
+        'calls': len(all_laps),
+        'calls_per_sec': len(all_laps) / elapsed,
+        'keys_per_sec': sum(nkeys) / elapsed,
+        'errors': sum(errors),
+        'p50_us': percentile(all_laps, 50) / 1e3,
+        'p99_us': percentile(all_laps, 99) / 1e3,
+        'p999_us': percentile(all_laps, 99.9) / 1e3,
+    }
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', 'HEAD'],
+                                       cwd=os.path.dirname(__file__) or '.',
+                                       stderr=subprocess.DEVNULL,
+                                       text=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def select(items, patterns):
+    if not patterns:
+        return list(items)
+    return [item for item in items
+            if any(fnmatch.fnmatchcase(item.name, p) for p in patterns)]
+
+
+def run(args):
+    import pylibmc
+    logger.info('Loaded %s', pylibmc.build_info())
+
+    servers = args.servers.split(',')
+    ss = select(scenarios(), args.scenario)
+    ps = select(participants, args.participant)
+    threads = [int(n) for n in args.threads.split(',')]
+    logger.info('%d participants in %d scenarios on %d servers',
+                len(ps), len(ss), len(servers))
+
+    results = []
+    for s in ss:
+        proxy = None
+        s_servers = servers
+        if s.faults:
+            from faultproxy import FaultProxy
+            proxy = FaultProxy(servers[0], s.faults).start()
+            s_servers = [proxy.address] + servers[1:]
+        try:
+            for p in ps:
+                behaviors = dict(p.behaviors, **(s.behaviors or {}))
+                def make_client(p=p, behaviors=behaviors):
+                    return pylibmc.Client(s_servers, binary=p.binary,
+                                          behaviors=behaviors)
+                for n in threads:
+                    r = run_scenario(make_client, s, n, args.time)
+                    r.update(scenario=s.name, participant=p.name, threads=n)
+                    results.append(r)
+                    print(f"{s.name:28} {p.name:10} {n:3}t "
+                          f"{r['calls_per_sec']:10.0f} calls/s "
+                          f"{r['keys_per_sec']:10.0f} keys/s "
+                          f"p50 {r['p50_us']:8.1f} p99 {r['p99_us']:8.1f} "
+                          f"p999 {r['p999_us']:8.1f} us "
+                          f"{r['errors']} errors")
+        finally:
+            if proxy is not None:
+                proxy.stop()
+
+    if args.output:
+        run_info = {
+            'build_info': pylibmc.build_info(),
+            'revision': git_revision(),
+            'python': platform.python_version(),
+            'platform': platform.platform(),
+            'date': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+            'servers': servers,
+            'bench_time': args.time,
+            'results': results,
+        }
+        with open(args.output, 'w') as f:
+            json.dump(run_info, f, indent=2)
+        logger.info('Wrote %s', args.output)
+
+
+def compare(args):
+    "Print the change of each result in *new* from *old*; fail on regressions"
+    def load(fn):
+        with open(fn) as f:
+            run_info = json.load(f)
+        return run_info, {(r['scenario'], r['participant'], r['threads']): r
+                          for r in run_info['results']}
+
+    old_info, old = load(args.old)
+    new_info, new = load(args.new)
+    print(f"old: {old_info.get('revision')} {old_info['build_info']}")
+    print(f"new: {new_info.get('revision')} {new_info['build_info']}")
+
+    regressions = 0
+    for key in sorted(old.keys() & new.keys()):
+        o, n = old[key], new[key]
+        calls = 100.0 * (n['calls_per_sec'] / o['calls_per_sec'] - 1)
+        p99 = 100.0 * (n['p99_us'] / o['p99_us'] - 1)
+        flag = ''
+        if calls < -args.threshold or p99 > args.threshold:
+            flag = '  <-- regression'
+            regressions += 1
+        print(f"{key[0]:28} {key[1]:10} {key[2]:3}t "
+              f"calls/s {calls:+6.1f}% p99 {p99:+6.1f}%{flag}")
+    for key in sorted(old.keys() ^ new.keys()):
+        print(f"{key[0]:28} {key[1]:10} {key[2]:3}t only in "
+              f"{'old' if key in old else 'new'}")
+    return 1 if regressions else 0
+
+
+def distribution(args):
+    """Balance, churn and lookup rate of each distribution, with no servers
+    involved: keys are only routed, never sent."""
+    import pylibmc
+    addresses = [f'10.0.{i // 256}.{i % 256}:11211'
+                 for i in range(args.nservers)]
+    keys = [f'key:{i}' for i in range(args.nkeys)]
+    distributions = [('modula', {}),
+                     ('ketama', {'ketama': True}),
+                     ('jump', {'distribution': 'jump'}),
+                     ('rendezvous', {'distribution': 'rendezvous'})]
+
+    def routes(servers, behaviors):
+        mc = pylibmc.Client(servers, behaviors=behaviors)
+        return [servers[i] for i in mc.route_multi(keys)], mc
+
+    def moved(before, after):
+        return sum(a != b for a, b in zip(before, after)) / len(keys)
+
+    print(f"{'':12} {'max/mean':>9} {'moved +1':>9} {'moved -1':>9} "
+          f"{'keys/s':>12}")
+    for name, behaviors in distributions:
+        base, mc = routes(addresses, behaviors)
+        counts = [base.count(a) for a in addresses]
+        balance = max(counts) / (len(keys) / len(addresses))
+        grown, _ = routes(addresses + ['10.1.0.0:11211'], behaviors)
+        shrunk, _ = routes(addresses[:len(addresses) // 2]
+                           + addresses[len(addresses) // 2 + 1:], behaviors)
+        n = 0
+        t0 = time.perf_counter()
+        while time.perf_counter() - t0 < args.time:
+            mc.route_multi(keys)
+            n += len(keys)
+        rate = n / (time.perf_counter() - t0)
+        print(f"{name:12} {balance:9.3f} {moved(base, grown):9.3f} "
+              f"{moved(base, shrunk):9.3f} {rate:12.0f}")
+
+
+def resident_bytes():
+    "The resident set size of this process, or None where unknown"
+    try:
+        with open('/proc/self/statm') as f:
+            return int(f.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+    except (OSError, ValueError):
+        return None
+
+
+def clone(args):
+    """Time making clones, as pools do, and the memory each one takes up,
+    with no servers involved: the clones never connect."""
+    import gc
+    import pylibmc
+    addresses = [f'10.0.{i // 256}.{i % 256}:11211'
+                 for i in range(args.nservers)]
+    configs = [('modula', {}),
+               ('ketama', {'ketama': True}),
+               ('jump', {'distribution': 'jump'}),
+               ('stats', {'ketama': True, 'latency_histograms': True,
+                          'key_sampling': 100})]
+
+    print(f"{'':8} {'clones/s':>10} {'us/clone':>9} {'KiB/clone':>10}")
+    for name, behaviors in configs:
+        mc = pylibmc.Client(addresses, behaviors=behaviors)
+        gc.collect()
+        rss = resident_bytes()
+        t0 = time.perf_counter()
+        clones = [mc.clone() for _ in range(args.nclones)]
+        elapsed = time.perf_counter() - t0
+        per_clone = ((resident_bytes() - rss) / len(clones) / 1024
+                     if rss is not None else float('nan'))
+        print(f"{name:8} {len(clones) / elapsed:10.0f} "
+              f"{elapsed / len(clones) * 1e6:9.1f} {per_clone:10.1f}")
+        del clones
+
+
+def list_scenarios(args):
+    for s in scenarios():
+        print(f"{s.name:28} op={s.op} value_size={s.value_size} "
+              f"nkeys={s.nkeys} hit_ratio={s.hit_ratio} compress={s.compress}"
+              f" faults={s.faults} behaviors={s.behaviors}")
+
+
+def main(argv=sys.argv[1:]):
     sys.path.insert(0, build_lib_dirname())
-    from pylibmc import build_info
-    logger.info('Loaded %s', build_info())
-
-    ps = participants
-    bs = benchmarks
-
-    logger.info('%d participants in %d benchmarks', len(ps), len(bs))
-
-    import pickle
-
-    # usages:
-    #   runbench.py bench -- run benchmark once
-    #   runbench.py dump [stats] -- run benchmark and write stats to file
-    #   runbench.py plot [stats] [plot] -- load stats and write a plot to file
-
-    def bench():
-        workout = Workout(participants=ps, benchmarks=bs)
-        workout.bench()
-        workout.print_stats()
-        return workout
-
-    def dump(fn='tmp/timings.pickle'):
-        workout = bench()
-        with open(fn, 'wb') as f:
-            pickle.dump(workout.timings, f)
-
-    def plot(fn='tmp/timings.pickle', out='tmp/timing_plot.svg'):
-        with open(fn, 'rb') as f:
-            workout = Workout(timings=pickle.load(f))
-        workout.print_stats()
-        workout.plot(filename=out)
 
-    if args:
-        fs = (bench, dump, plot)
-        f = {f.__name__: f for f in fs}[args[0]]
-        f(*args[1:])
-    else:
-        bench()
+    parser = argparse.ArgumentParser(description='pylibmc benchmarks')
+    commands = parser.add_subparsers(dest='command')
+
+    p = commands.add_parser('run', help='run the benchmarks')
+    p.add_argument('--servers', default=os.environ.get('MEMCACHED_SERVERS',
+                                                       '127.0.0.1:11211'),
+                   help='comma-separated memcached servers')
+    p.add_argument('-s', '--scenario', action='append',
+                   help='run only scenarios matching this glob')
+    p.add_argument('-p', '--participant', action='append',
+                   help='run only participants matching this glob')
+    p.add_argument('-t', '--threads', default='1',
+                   help='comma-separated thread counts, e.g. 1,4')
+    p.add_argument('--time', type=float, default=2.0,
+                   help='seconds to run each benchmark for')
+    p.add_argument('-o', '--output', help='write results as JSON here')
+    p.set_defaults(f=run)
+
+    p = commands.add_parser('compare', help='compare two JSON results')
+    p.add_argument('old')
+    p.add_argument('new')
+    p.add_argument('--threshold', type=float, default=5.0,
+                   help='percent slowdown counted as a regression')
+    p.set_defaults(f=compare)
+
+    p = commands.add_parser('distribution',
+                            help='compare the key distributions')
+    p.add_argument('-n', '--nservers', type=int, default=10,
+                   help='number of servers to distribute over')
+    p.add_argument('-k', '--nkeys', type=int, default=100000,
+                   help='number of keys to route')
+    p.add_argument('--time', type=float, default=1.0,
+                   help='seconds to measure lookups for')
+    p.set_defaults(f=distribution)
+
+    p = commands.add_parser('clone', help='time clones and their memory')
+    p.add_argument('-n', '--nservers', type=int, default=10,
+                   help='number of servers in the cloned client')
+    p.add_argument('-c', '--nclones', type=int, default=1000,
+                   help='number of clones to make')
+    p.set_defaults(f=clone)
+
+    p = commands.add_parser('list', help='list the scenarios')
+    p.set_defaults(f=list_scenarios)
+
+    args = parser.parse_args(argv)
+    if args.command is None:
+        args = parser.parse_args(['run'] + argv)
+    return args.f(args)
 
 
 if __name__ == "__main__":
-    logging.basicConfig(level=logging.DEBUG)
-    main()
+    logging.basicConfig(level=logging.INFO)
+    sys.exit(main())
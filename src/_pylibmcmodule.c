@@ -79,6 +79,7 @@ static PylibMC_Client *PylibMC_ClientType_new(PyTypeObject *type,
     if (self != NULL) {
         self->mc = memcached_create(NULL);
         self->sasl_set = false;
+        self->forks = PylibMC_forks;
     }
 
     return self;
@@ -107,7 +108,8 @@ static int _PylibMC_method_is_overridden(PylibMC_Client *self, const char *metho
 }
 
 static void PylibMC_ClientType_dealloc(PylibMC_Client *self) {
-    if (self->mc != NULL) {
+    /* See _PylibMC_ForkReset for why a client from before a fork leaks. */
+    if (self->mc != NULL && self->forks == PylibMC_forks) {
 #if LIBMEMCACHED_WITH_SASL_SUPPORT
         if (self->sasl_set) {
             memcached_destroy_sasl_auth_data(self->mc);
@@ -116,14 +118,22 @@ static void PylibMC_ClientType_dealloc(PylibMC_Client *self) {
         memcached_free(self->mc);
     }
 
+    PyMem_Free(self->latency);
+    PyMem_Free(self->counters);
+    PyMem_Free(self->sampler);
+    PyMem_Free(self->timings);
+    _PylibMC_MetaReset(self);
+    _PylibMC_BucketsRelease(self->buckets);
+    Py_XDECREF(self->weights);
+    Py_XDECREF(self->meta_auth);
     Py_TYPE(self)->tp_free(self);
 }
 /* }}} */
 
 static int PylibMC_Client_init(PylibMC_Client *self, PyObject *args,
         PyObject *kwds) {
-    PyObject *srvs, *srvs_it, *c_srv;
-    unsigned char set_stype = 0, bin = 0, got_server = 0;
+    PyObject *srvs, *srvs_it;
+    unsigned char bin = 0;
     const char *user = NULL, *pass = NULL;
     PyObject *behaviors = NULL;
     memcached_return rc;
@@ -167,6 +177,12 @@ static int PylibMC_Client_init(PylibMC_Client *self, PyObject *args,
          * breaks in libmemcached 0.43 and potentially earlier. */
         self->sasl_set = true;
 
+        /* The meta protocol is text only, and logs in the text way. */
+        if ((self->meta_auth = PyBytes_FromFormat("%s %s", user, pass))
+                == NULL) {
+            goto error;
+        }
+
 #else
         PyErr_SetString(PyExc_TypeError, "libmemcached does not support SASL");
         goto error;
@@ -198,6 +214,33 @@ static int PylibMC_Client_init(PylibMC_Client *self, PyObject *args,
     }
     self->native_deserialization = (uint8_t) native_deserialization;
 
+    Py_XSETREF(self->weights, PyDict_New());
+    if (self->weights == NULL) {
+        goto error;
+    }
+    if (_PylibMC_AddServers(self, self->mc, srvs_it, self->weights) == -1) {
+        goto error;
+    }
+    if (!_PylibMC_BucketsUpdate(self)) {
+        goto error;
+    }
+
+    Py_DECREF(srvs_it);
+    return 0;
+error:
+    Py_DECREF(srvs_it);
+    return -1;
+}
+
+/* Add the servers `srvs_it` yields, translated as by
+ * pylibmc.client.translate_server_specs, to those of `mc`, noting those
+ * weighing other than 1 in the dict `weights`. */
+static int _PylibMC_AddServers(PylibMC_Client *self, memcached_st *mc,
+                               PyObject *srvs_it, PyObject *weights) {
+    PyObject *c_srv;
+    unsigned char set_stype = 0, got_server = 0;
+    memcached_return rc;
+
     while ((c_srv = PyIter_Next(srvs_it)) != NULL) {
         unsigned char stype;
         char *hostname;
@@ -214,26 +257,26 @@ static int PylibMC_Client_init(PylibMC_Client *self, PyObject *args,
             if (list == NULL) {
                 PyErr_SetString(PylibMCExc_Error,
                         "memcached_servers_parse returned NULL");
-                goto it_error;
+                goto error;
             }
 
-            rc = memcached_server_push(self->mc, list);
+            rc = memcached_server_push(mc, list);
             memcached_server_list_free(list);
             if (rc != MEMCACHED_SUCCESS) {
                 PylibMC_ErrFromMemcached(self, "memcached_server_push", rc);
-                goto it_error;
+                goto error;
             }
         } else if (PyArg_ParseTuple(c_srv, "Bs|HH", &stype, &hostname, &port, &weight)) {
             if (set_stype && set_stype != stype) {
                 PyErr_SetString(PyExc_ValueError, "can't mix transport types");
-                goto it_error;
+                goto error;
             } else {
                 set_stype = stype;
                 if (stype == PYLIBMC_SERVER_UDP) {
-                    rc = memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_USE_UDP, 1);
+                    rc = memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_USE_UDP, 1);
                     if (rc != MEMCACHED_SUCCESS) {
                         PyErr_SetString(PyExc_RuntimeError, "udp behavior set failed");
-                        goto it_error;
+                        goto error;
                     }
                 }
             }
@@ -241,47 +284,269 @@ static int PylibMC_Client_init(PylibMC_Client *self, PyObject *args,
             switch (stype) {
                 case PYLIBMC_SERVER_UDP:
 #if LIBMEMCACHED_VERSION_HEX <= 0x00053000
-                    rc = memcached_server_add_udp_with_weight(self->mc, hostname, port, weight);
+                    rc = memcached_server_add_udp_with_weight(mc, hostname, port, weight);
                     break;
 #endif
                 case PYLIBMC_SERVER_TCP:
-                    rc = memcached_server_add_with_weight(self->mc, hostname, port, weight);
+                    rc = memcached_server_add_with_weight(mc, hostname, port, weight);
                     break;
                 case PYLIBMC_SERVER_UNIX:
                     if (port) {
                         PyErr_SetString(PyExc_ValueError,
                                 "can't set port on unix sockets");
-                        goto it_error;
+                        goto error;
                     }
-                    rc = memcached_server_add_unix_socket_with_weight(self->mc, hostname, weight);
+                    rc = memcached_server_add_unix_socket_with_weight(mc, hostname, weight);
                     break;
                 default:
                     PyErr_Format(PyExc_ValueError, "bad type: %u", stype);
-                    goto it_error;
+                    goto error;
             }
             if (rc != MEMCACHED_SUCCESS) {
                 PylibMC_ErrFromMemcached(self, "memcached_server_add_*", rc);
-                goto it_error;
+                goto error;
+            }
+            if (weight != 1) {
+                /* Named as _PylibMC_ServerName names it. */
+                PyObject *name = PyUnicode_FromFormat("%s:%d", hostname,
+                        stype == PYLIBMC_SERVER_UNIX || port ? (int)port
+                                                       : MEMCACHED_DEFAULT_PORT);
+                PyObject *w = PyLong_FromLong(weight);
+                int set = name != NULL && w != NULL
+                          ? PyDict_SetItem(weights, name, w) : -1;
+
+                Py_XDECREF(name);
+                Py_XDECREF(w);
+                if (set == -1) {
+                    goto error;
+                }
             }
         }
         Py_DECREF(c_srv);
         continue;
 
-it_error:
+error:
         Py_DECREF(c_srv);
-        goto error;
+        return -1;
     }
 
-    if (!got_server) {
+    if (PyErr_Occurred()) {
+        return -1;
+    } else if (!got_server) {
         PyErr_SetString(PylibMCExc_Error, "empty server list");
-        goto error;
+        return -1;
     }
-
-    Py_DECREF(srvs_it);
     return 0;
-error:
+}
+
+static PyObject *PylibMC_Client_update_servers(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    PyObject *srvs, *srvs_it, *weights, *positions = NULL;
+    memcached_st *mc;
+    int append = 0, rc;
+    static char *kws[] = { "servers", "append", NULL };
+
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p:update_servers", kws,
+                                     &srvs, &append)) {
+        return NULL;
+    }
+    if ((srvs_it = PyObject_GetIter(srvs)) == NULL) {
+        return NULL;
+    }
+
+    if (append) {
+        /* Adding servers keeps the connections to the others. The weights
+         * may be shared with clones, so they are copied first. */
+        if ((weights = PyDict_Copy(self->weights)) == NULL) {
+            Py_DECREF(srvs_it);
+            return NULL;
+        }
+        Py_SETREF(self->weights, weights);
+        rc = _PylibMC_AddServers(self, self->mc, srvs_it, self->weights);
+        Py_DECREF(srvs_it);
+        if (rc == -1 || !_PylibMC_BucketsUpdate(self)) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+
+    /* libmemcached can't take servers away or hand a connection from one
+     * memcached_st to another, so build the new list on a clone of
+     * everything else and swap it in once complete; its connections are all
+     * made anew. What pylibmc keeps per server follows the servers that
+     * stay, by name. */
+    Py_BEGIN_ALLOW_THREADS;
+    mc = memcached_clone(NULL, self->mc);
+    Py_END_ALLOW_THREADS;
+    if (mc == NULL) {
+        Py_DECREF(srvs_it);
+        return PyErr_NoMemory();
+    }
+    memcached_servers_reset(mc);
+    if ((weights = PyDict_New()) == NULL) {
+        rc = -1;
+    } else {
+        rc = _PylibMC_AddServers(self, mc, srvs_it, weights);
+    }
     Py_DECREF(srvs_it);
-    return -1;
+    if (rc == -1 || (positions = _PylibMC_ServerPositions(self)) == NULL) {
+        Py_XDECREF(weights);
+        memcached_free(mc);
+        return NULL;
+    }
+    Py_SETREF(self->weights, weights);
+
+    Py_BEGIN_ALLOW_THREADS;
+#if LIBMEMCACHED_WITH_SASL_SUPPORT
+    if (self->sasl_set) {
+        memcached_destroy_sasl_auth_data(self->mc);
+    }
+#endif
+    memcached_free(self->mc);
+    Py_END_ALLOW_THREADS;
+    self->mc = mc;
+
+    rc = _PylibMC_ServersCarry(self, positions) ? 0 : -1;
+    Py_DECREF(positions);
+    if (rc == -1 || !_PylibMC_BucketsUpdate(self)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* The position of each server, by the name _PylibMC_ServerName gives it;
+ * the first of a server listed twice stands for it. */
+static PyObject *_PylibMC_ServerPositions(PylibMC_Client *self) {
+    PyObject *positions, *name, *pos;
+    uint32_t i, nservers = memcached_server_count(self->mc);
+    int rc;
+
+    if ((positions = PyDict_New()) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < nservers; i++) {
+        if ((name = _PylibMC_ServerName(self, i)) == NULL) {
+            Py_DECREF(positions);
+            return NULL;
+        }
+        rc = PyDict_Contains(positions, name);
+        if (rc == 0) {
+            if ((pos = PyLong_FromUnsignedLong(i)) == NULL) {
+                rc = -1;
+            } else {
+                rc = PyDict_SetItem(positions, name, pos);
+                Py_DECREF(pos);
+            }
+        }
+        Py_DECREF(name);
+        if (rc == -1) {
+            Py_DECREF(positions);
+            return NULL;
+        }
+    }
+    return positions;
+}
+
+/* Per-server state goes by position. Once the server list is replaced, move
+ * the meta connections, counters and timings of the servers still in it
+ * from where `positions`, of _PylibMC_ServerPositions, had them, and drop
+ * the rest. On failure, drops all of it. Call with the GIL held. */
+static bool _PylibMC_ServersCarry(PylibMC_Client *self, PyObject *positions) {
+    uint32_t i, old, nservers = memcached_server_count(self->mc);
+    uint32_t *from = NULL;
+    pylibmc_meta_conn *meta = NULL;
+    pylibmc_server_counters *counters = NULL;
+    pylibmc_server_timing *timings = NULL;
+    PyObject *name, *pos;
+    bool ok = false;
+
+    if ((from = PyMem_New(uint32_t, nservers ? nservers : 1)) == NULL
+            || (self->nmeta && (meta = PyMem_New(pylibmc_meta_conn,
+                                                 nservers)) == NULL)
+            || (self->ncounters && (counters = PyMem_New(
+                    pylibmc_server_counters, nservers)) == NULL)
+            || (self->ntimings && (timings = PyMem_New(
+                    pylibmc_server_timing, nservers)) == NULL)) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    /* Old position + 1, or 0 for a server new to the list. A server listed
+     * twice keeps its state in the first place only. */
+    for (i = 0; i < nservers; i++) {
+        if ((name = _PylibMC_ServerName(self, i)) == NULL) {
+            goto cleanup;
+        }
+        from[i] = 0;
+        if ((pos = PyDict_GetItemWithError(positions, name)) != NULL) {
+            from[i] = (uint32_t)PyLong_AsUnsignedLong(pos) + 1;
+            if (PyDict_DelItem(positions, name) == -1) {
+                Py_DECREF(name);
+                goto cleanup;
+            }
+        }
+        Py_DECREF(name);
+        if (PyErr_Occurred()) {
+            goto cleanup;
+        }
+    }
+
+    for (i = 0; i < nservers; i++) {
+        old = from[i] - 1;
+        if (meta != NULL) {
+            if (from[i] && old < self->nmeta) {
+                meta[i] = self->meta[old];
+                self->meta[old].fd = -1;
+            } else {
+                meta[i].fd = -1;
+                meta[i].failures = 0;
+                meta[i].retry_at = 0;
+            }
+        }
+        if (counters != NULL) {
+            if (from[i] && old < self->ncounters) {
+                counters[i] = self->counters[old];
+            } else {
+                memset(&counters[i], 0, sizeof(counters[i]));
+            }
+        }
+        if (timings != NULL) {
+            if (from[i] && old < self->ntimings) {
+                timings[i] = self->timings[old];
+            } else {
+                memset(&timings[i], 0, sizeof(timings[i]));
+            }
+        }
+    }
+    ok = true;
+
+cleanup:
+    PyMem_Free(from);
+    /* Closes the connections of the servers that are gone. */
+    _PylibMC_MetaReset(self);
+    PyMem_Free(self->counters);
+    PyMem_Free(self->timings);
+    if (ok) {
+        self->meta = meta;
+        self->nmeta = meta != NULL ? nservers : 0;
+        self->counters = counters;
+        self->ncounters = counters != NULL ? nservers : 0;
+        self->timings = timings;
+        self->ntimings = timings != NULL ? nservers : 0;
+    } else {
+        PyMem_Free(meta);
+        PyMem_Free(counters);
+        PyMem_Free(timings);
+        self->counters = NULL;
+        self->ncounters = 0;
+        self->timings = NULL;
+        self->ntimings = 0;
+    }
+    return ok;
 }
 
 /* {{{ Compression helpers */
@@ -462,61 +727,217 @@ error:
 #endif
 /* }}} */
 
-/* Helper for multiset / multiget:
-   1. Take the iterable `keys` and build a map of UTF-8 encoded bytestrings
-      to Unicode keys.
-   2. If `key_array` and `nkeys` are not NULL, additionally copy *new*
-      references to everything in the iterable into `key_array`. Store
-      the actual number of items in `nkeys`.
+/* Helper for multiget / multidelete / multiincr / route_multi:
+   Normalize every key in the sequence `keys` in one pass, without creating
+   any new objects (see _key_normalized_buf). Stores a new array of
+   pylibmc_key in *out, each holding a new reference to the key as given.
+   When verify_keys applies, keys that memcached would reject (taking the
+   prefix into account) get a NULL `key`. With a prefix, the keys are then
+   prefixed in `prefixed`, which the caller frees, and mapped as a whole.
+
+   Returns the number of keys, or -1 with an exception set.
 */
-static PyObject *_PylibMC_map_str_keys(PyObject *keys, PyObject **key_array, Py_ssize_t *nkeys) {
-    PyObject *key_str_map = NULL;
-    PyObject *iter = NULL;
-    PyObject *key = NULL;
-    PyObject *key_bytes = NULL;
-    Py_ssize_t i = 0;
+static Py_ssize_t _PylibMC_NormalizeKeys(PylibMC_Client *self, PyObject *keys,
+                                         const char *prefix, Py_ssize_t prefix_len,
+                                         pylibmc_key **out,
+                                         pylibmc_keybuf *prefixed) {
+    PyObject *seq;
+    PyObject **items;
+    pylibmc_key *result;
+    Py_ssize_t i, nkeys, prefixed_size = 0;
+    int verify, prefix_ok;
+
+    if ((seq = PySequence_Fast(keys, "keys must be a sequence")) == NULL)
+        return -1;
 
-    key_str_map = PyDict_New();
-    if (key_str_map == NULL)
-        goto cleanup;
+    nkeys = PySequence_Fast_GET_SIZE(seq);
+    items = PySequence_Fast_ITEMS(seq);
 
-    if ((iter = PyObject_GetIter(keys)) == NULL)
-        goto cleanup;
+    if ((result = PyMem_New(pylibmc_key, nkeys ? nkeys : 1)) == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
 
-    while ((key = PyIter_Next(iter)) != NULL) {
-        if (PyUnicode_Check(key)) {
-            key_bytes = PyUnicode_AsUTF8String(key);
-            if (key_bytes == NULL)
-                goto cleanup;
-            PyDict_SetItem(key_str_map, key_bytes, key);
-            Py_DECREF(key_bytes);
+    verify = _PylibMC_verify_keys(self);
+    prefix_ok = !verify || _key_verified_str(prefix, prefix_len);
+
+    for (i = 0; i < nkeys; i++) {
+        pylibmc_key *k = &result[i];
+
+        if (!_key_normalized_buf(self, items[i], prefix_len,
+                                 &k->key, &k->key_len, &k->hashed)) {
+            _PylibMC_FreeKeys(result, i);
+            Py_DECREF(seq);
+            return -1;
         }
-        /* stash our owned reference to `key` in this array: */
-        if (key_array != NULL && i < *nkeys) {
-            key_array[i++] = key;
-        } else {
-            Py_DECREF(key);
+
+        if (verify && !(prefix_ok && _key_verified_str(k->key, k->key_len))) {
+            k->key = NULL;
         }
+
+        Py_INCREF(items[i]);
+        k->obj = items[i];
+        prefixed_size += prefix_len + k->key_len;
     }
-    if (nkeys != NULL) {
-        *nkeys = i;
+
+    Py_DECREF(seq);
+
+    /* Empty prefixes are ignored. */
+    if (prefix_len) {
+        if (!_PylibMC_KeyBufInit(prefixed, prefixed_size)) {
+            goto error;
+        }
+        for (i = 0; i < nkeys; i++) {
+            pylibmc_key *k = &result[i];
+
+            if (k->key != NULL
+                    && !_PylibMC_KeyBufPrefixMapped(self, prefixed,
+                                                    prefix, prefix_len,
+                                                    &k->key, &k->key_len,
+                                                    &k->hashed)) {
+                goto error;
+            }
+        }
     }
 
-    Py_DECREF(iter);
-    return key_str_map;
+    *out = result;
+    return nkeys;
 
-cleanup:
-    if (key_array != NULL) {
-        for (Py_ssize_t j = 0; j < i; j++) {
-            Py_DECREF(key_array[j]);
+error:
+    _PylibMC_KeyBufFree(prefixed);
+    _PylibMC_FreeKeys(result, nkeys);
+    return -1;
+}
+
+static void _PylibMC_FreeKeys(pylibmc_key *keys, Py_ssize_t nkeys) {
+    if (keys == NULL)
+        return;
+    for (Py_ssize_t i = 0; i < nkeys; i++) {
+        Py_DECREF(keys[i].obj);
+        Py_XDECREF(keys[i].hashed);
+    }
+    PyMem_Free(keys);
+}
+
+/* Helper for multiget: index the normalized keys so that keys coming back
+   from memcached map to the objects the caller gave, without a round trip
+   through a dict. Empty and rejected keys are left out.
+*/
+static uint64_t _PylibMC_KeyHash(const char *key, Py_ssize_t key_len) {
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (Py_ssize_t i = 0; i < key_len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int _PylibMC_KeyIndexInit(pylibmc_keyindex *index,
+                                 pylibmc_key *keys, Py_ssize_t nkeys) {
+    size_t size = 8;
+
+    while (size < (size_t)nkeys * 2) {
+        size <<= 1;
+    }
+
+    if ((index->slots = PyMem_New(Py_ssize_t, size)) == NULL) {
+        PyErr_NoMemory();
+        return false;
+    }
+    memset(index->slots, 0, size * sizeof(Py_ssize_t));
+    index->mask = size - 1;
+
+    for (Py_ssize_t i = 0; i < nkeys; i++) {
+        size_t slot;
+
+        if (keys[i].key == NULL || !keys[i].key_len) {
+            continue;
+        }
+
+        slot = _PylibMC_KeyHash(keys[i].key, keys[i].key_len) & index->mask;
+        while (index->slots[slot]) {
+            slot = (slot + 1) & index->mask;
+        }
+        /* Positions are stored off by one so that zero marks a free slot. */
+        index->slots[slot] = i + 1;
+    }
+
+    return true;
+}
+
+static pylibmc_key *_PylibMC_KeyIndexLookup(pylibmc_keyindex *index,
+                                            pylibmc_key *keys,
+                                            const char *key, Py_ssize_t key_len) {
+    size_t slot = _PylibMC_KeyHash(key, key_len) & index->mask;
+
+    for (; index->slots[slot]; slot = (slot + 1) & index->mask) {
+        pylibmc_key *k = &keys[index->slots[slot] - 1];
+        if (k->key_len == key_len && !memcmp(k->key, key, key_len)) {
+            return k;
         }
     }
-    Py_XDECREF(key);
-    Py_XDECREF(iter);
-    Py_XDECREF(key_str_map);
+
     return NULL;
 }
 
+static void _PylibMC_KeyIndexFree(pylibmc_keyindex *index) {
+    PyMem_Free(index->slots);
+    index->slots = NULL;
+}
+
+/* Helpers for multi operations with a key prefix:
+   The caller sums up the final length of every prefixed key, sets up the
+   buffer with _PylibMC_KeyBufInit and then assembles each key in place with
+   _PylibMC_KeyBufPrefix. Keys are not NUL-terminated, so NUL bytes in keys
+   survive. The buffer never moves, so the returned pointers stay valid until
+   _PylibMC_KeyBufFree.
+*/
+static int _PylibMC_KeyBufInit(pylibmc_keybuf *kb, Py_ssize_t size) {
+    kb->used = 0;
+    kb->size = size;
+    if ((kb->buf = PyMem_New(char, size ? size : 1)) == NULL) {
+        PyErr_NoMemory();
+        return false;
+    }
+    return true;
+}
+
+static char *_PylibMC_KeyBufPrefix(pylibmc_keybuf *kb,
+                                   const char *prefix, Py_ssize_t prefix_len,
+                                   const char *key, Py_ssize_t key_len) {
+    char *dest = kb->buf + kb->used;
+
+    assert(kb->used + prefix_len + key_len <= kb->size);
+    memcpy(dest, prefix, prefix_len);
+    memcpy(dest + prefix_len, key, key_len);
+    kb->used += prefix_len + key_len;
+
+    return dest;
+}
+
+/* Prefix *key in `kb` as _PylibMC_KeyBufPrefix does, then normalize the
+   result, so that under hash_long_keys a key that only gets too long with
+   its prefix is mapped just as the same key given whole would be. *hashed
+   then holds the mapped key. */
+static int _PylibMC_KeyBufPrefixMapped(PylibMC_Client *self, pylibmc_keybuf *kb,
+                                       const char *prefix, Py_ssize_t prefix_len,
+                                       char **key, Py_ssize_t *key_len,
+                                       PyObject **hashed) {
+    assert(*hashed == NULL);
+
+    *key = _PylibMC_KeyBufPrefix(kb, prefix, prefix_len, *key, *key_len);
+    *key_len += prefix_len;
+
+    return _key_mapped_str(self, key, key_len, hashed);
+}
+
+static void _PylibMC_KeyBufFree(pylibmc_keybuf *kb) {
+    PyMem_Free(kb->buf);
+    kb->buf = NULL;
+    kb->used = kb->size = 0;
+}
+
 /* }}} */
 
 static PyObject *_PylibMC_parse_memcached_value(PylibMC_Client *self,
@@ -663,6 +1084,14 @@ static PyObject *PylibMC_Client_deserialize(PylibMC_Client *self, PyObject *args
 }
 
 static PyObject *_PylibMC_parse_memcached_result(PylibMC_Client *self, memcached_result_st *res) {
+        if (memcached_result_flags(res) & PYLIBMC_FLAG_CHUNKED) {
+            return _PylibMC_GetChunked(self,
+                                       memcached_result_key_value(res),
+                                       memcached_result_key_length(res),
+                                       memcached_result_value(res),
+                                       memcached_result_length(res),
+                                       memcached_result_flags(res));
+        }
         return _PylibMC_parse_memcached_value(
                                               self,
                                               (char *)memcached_result_value(res),
@@ -670,6 +1099,134 @@ static PyObject *_PylibMC_parse_memcached_result(PylibMC_Client *self, memcached
                                               memcached_result_flags(res));
 }
 
+/* Read back a value stored by _PylibMC_SetChunked, given its manifest:
+   fetch every chunk in one go, check that they add up to the value the
+   manifest describes, and parse that as usual. A manifest that doesn't
+   parse, a missing chunk or a digest mismatch are all cache misses.
+*/
+static PyObject *_PylibMC_GetChunked(PylibMC_Client *self,
+        const char *key, Py_ssize_t key_len,
+        const char *manifest, Py_ssize_t manifest_len, uint32_t flags) {
+    char buf[PYLIBMC_CHUNK_MANIFEST_MAX];
+    char digest[33], check[32];
+    unsigned int chunk_size;
+    Py_ssize_t nchunks, total, found = 0, common_len, i;
+    char *keys_buf = NULL, **keys = NULL, *dest;
+    size_t *key_lens = NULL;
+    PyObject *value = NULL, *retval = NULL;
+    pylibmc_mget_req req = { 0 };
+    pylibmc_mget_res res = { 0 };
+
+    if (manifest_len >= (Py_ssize_t)sizeof(buf)) {
+        goto miss;
+    }
+    memcpy(buf, manifest, manifest_len);
+    buf[manifest_len] = '\0';
+
+    if (sscanf(buf, "%zd %u %zd %32[0-9a-f]",
+               &nchunks, &chunk_size, &total, digest) != 4
+            || strlen(digest) != 32 || !chunk_size || total <= 0
+            || nchunks != (total + chunk_size - 1) / chunk_size
+            || nchunks > INT_MAX / MEMCACHED_MAX_KEY) {
+        goto miss;
+    }
+
+    keys_buf = PyMem_New(char, nchunks * MEMCACHED_MAX_KEY);
+    keys = PyMem_New(char *, nchunks);
+    key_lens = PyMem_New(size_t, nchunks);
+    if (keys_buf == NULL || keys == NULL || key_lens == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    if ((value = PyBytes_FromStringAndSize(NULL, total)) == NULL) {
+        goto cleanup;
+    }
+    dest = PyBytes_AS_STRING(value);
+
+    for (i = 0; i < nchunks; i++) {
+        keys[i] = keys_buf + i * MEMCACHED_MAX_KEY;
+        key_lens[i] = _PylibMC_ChunkKey(keys[i], key, key_len, digest,
+                                        (unsigned int)i);
+    }
+
+    req.keys = keys;
+    req.nkeys = (ssize_t)nchunks;
+    req.key_lens = key_lens;
+    req.instrumented = _PylibMC_Instrumented(self);
+    req.counters = req.instrumented ? _PylibMC_Counters(self) : NULL;
+    req.deadline = 0;
+
+    Py_BEGIN_ALLOW_THREADS;
+    res = _fetch_multi(self, req);
+    Py_END_ALLOW_THREADS;
+
+    if (res.rc != MEMCACHED_SUCCESS) {
+        PylibMC_ErrFromMemcached(self, res.err_func, res.rc);
+        goto cleanup;
+    }
+
+    /* Chunk keys differ only in the index at the end; the key of chunk 0
+     * without its single digit is what they have in common. */
+    common_len = key_lens[0] - 1;
+
+    for (i = 0; i < res.nresults; i++) {
+        memcached_result_st *result = &res.results[i];
+        const char *rkey = memcached_result_key_value(result);
+        Py_ssize_t rkey_len = memcached_result_key_length(result);
+        Py_ssize_t idx = 0, expected, j;
+
+        if (rkey_len <= common_len || memcmp(rkey, keys[0], common_len)) {
+            continue;
+        }
+        for (j = common_len; j < rkey_len && idx < nchunks; j++) {
+            if (rkey[j] < '0' || rkey[j] > '9') {
+                break;
+            }
+            idx = idx * 10 + (rkey[j] - '0');
+        }
+        if (j < rkey_len || idx >= nchunks
+                || (size_t)rkey_len != key_lens[idx]
+                || memcmp(rkey, keys[idx], rkey_len)) {
+            continue;
+        }
+
+        expected = idx + 1 < nchunks ? chunk_size : total - idx * chunk_size;
+        if ((Py_ssize_t)memcached_result_length(result) != expected) {
+            goto miss;
+        }
+
+        memcpy(dest + idx * chunk_size, memcached_result_value(result), expected);
+        found++;
+    }
+
+    if (found != nchunks) {
+        goto miss;
+    }
+
+    _key_digest_hex(dest, total, check);
+    if (memcmp(check, digest, 32)) {
+        goto miss;
+    }
+
+    retval = _PylibMC_parse_memcached_value(self, dest, total,
+                                            flags & ~PYLIBMC_FLAG_CHUNKED);
+    goto cleanup;
+
+miss:
+    PyErr_SetNone(PylibMCExc_CacheMiss);
+
+cleanup:
+    PyMem_RawFree(res.failed);
+    _free_multi_result(res);
+    Py_XDECREF(value);
+    PyMem_Free(key_lens);
+    PyMem_Free(keys);
+    PyMem_Free(keys_buf);
+
+    return retval;
+}
+
 /* Helper to call after _PylibMC_parse_memcached_value;
    determines whether the deserialized value should be ignored
    and treated as a miss.
@@ -692,28 +1249,69 @@ static PyObject *PylibMC_Client_get(PylibMC_Client *self, PyObject *args) {
        at this point, so borrow a reference to Py_None as well for parity. */
     PyObject *default_value = Py_None;
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &default_value)) {
         return NULL;
     }
 
-    if (!_key_normalized_obj(&key)) {
+    if (!_key_normalized_obj(self, &key)) {
         return NULL;
     } else if (!PySequence_Length(key)) {
+        Py_DECREF(key);
         Py_INCREF(default_value);
         return default_value;
     }
 
+    bool instrumented = _PylibMC_Instrumented(self);
+    pylibmc_server_counters *c = NULL;
+    pylibmc_server_timing *t = NULL;
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        c = _PylibMC_CounterFor(self, _PylibMC_Counters(self),
+                PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+        t = _PylibMC_TimeoutFor(self, _PylibMC_Timings(self),
+                PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_GET, 1,
+                PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+        _PylibMC_CountSent(c, PyBytes_GET_SIZE(key));
+    }
     Py_BEGIN_ALLOW_THREADS;
     mc_val = memcached_get(self->mc,
             PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key),
             &val_size, &flags, &error);
     Py_END_ALLOW_THREADS;
-
-    Py_DECREF(key);
+    if (instrumented) {
+        _PylibMC_TimeoutDone(self, t, error);
+        _PylibMC_CountDone(c, error, error == MEMCACHED_SUCCESS
+                ? PyBytes_GET_SIZE(key) + (Py_ssize_t)val_size : 0);
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_GET, started);
+        _PylibMC_TraceEnd(self, span, error, PyBytes_GET_SIZE(key),
+                          error == MEMCACHED_SUCCESS ? (Py_ssize_t)val_size : 0);
+        _PylibMC_SampleKey(self, PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+        if (error == MEMCACHED_SUCCESS) {
+            _PylibMC_SampleValue(self, PyBytes_AS_STRING(key),
+                                 PyBytes_GET_SIZE(key), val_size);
+        }
+    }
 
     if (error == MEMCACHED_SUCCESS) {
         /* note that mc_val can and is NULL for zero-length values. */
-        PyObject *r = _PylibMC_parse_memcached_value(self, mc_val, val_size, flags);
+        PyObject *r;
+
+        if (flags & PYLIBMC_FLAG_CHUNKED) {
+            r = _PylibMC_GetChunked(self,
+                                    PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key),
+                                    mc_val, val_size, flags);
+        } else {
+            r = _PylibMC_parse_memcached_value(self, mc_val, val_size, flags);
+        }
+
+        Py_DECREF(key);
 
         if (mc_val != NULL) {
             free(mc_val);
@@ -728,13 +1326,16 @@ static PyObject *PylibMC_Client_get(PylibMC_Client *self, PyObject *args) {
     }
 
     if (error == MEMCACHED_NOTFOUND) {
+        Py_DECREF(key);
         Py_INCREF(default_value);
         return default_value;
     }
 
-    return PylibMC_ErrFromMemcachedWithKey(self, "memcached_get", error,
-                                           PyBytes_AS_STRING(key),
-                                           PyBytes_GET_SIZE(key));
+    PylibMC_ErrFromMemcachedWithKey(self, "memcached_get", error,
+                                    PyBytes_AS_STRING(key),
+                                    PyBytes_GET_SIZE(key));
+    Py_DECREF(key);
+    return NULL;
 }
 
 static PyObject *PylibMC_Client_gets(PylibMC_Client *self, PyObject *arg) {
@@ -742,13 +1343,20 @@ static PyObject *PylibMC_Client_gets(PylibMC_Client *self, PyObject *arg) {
     size_t keylengths[2];
     memcached_result_st *res = NULL;
     memcached_return rc;
+    bool drained = true;
     PyObject* ret = NULL;
 
-    if (!_key_normalized_obj(&arg)) {
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    if (!_key_normalized_obj(self, &arg)) {
         return NULL;
     } else if (!PySequence_Length(arg)) {
+        Py_DECREF(arg);
         return Py_BuildValue("(OO)", Py_None, Py_None);
     } else if (!memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_SUPPORT_CAS)) {
+        Py_DECREF(arg);
         PyErr_SetString(PyExc_ValueError, "gets without cas behavior");
         return NULL;
     }
@@ -759,19 +1367,65 @@ static PyObject *PylibMC_Client_gets(PylibMC_Client *self, PyObject *arg) {
     *keys = PyBytes_AS_STRING(arg);
     *keylengths = (size_t)PyBytes_GET_SIZE(arg);
 
-    Py_DECREF(arg);
-
+    bool instrumented = _PylibMC_Instrumented(self);
+    pylibmc_server_counters *c = NULL;
+    pylibmc_server_timing *t = NULL;
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        c = _PylibMC_CounterFor(self, _PylibMC_Counters(self),
+                                *keys, *keylengths);
+        t = _PylibMC_TimeoutFor(self, _PylibMC_Timings(self),
+                                *keys, *keylengths);
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_GETS, 1,
+                                   *keys, *keylengths);
+        _PylibMC_CountSent(c, *keylengths);
+    }
     Py_BEGIN_ALLOW_THREADS;
 
     rc = memcached_mget(self->mc, keys, keylengths, 1);
     if (rc == MEMCACHED_SUCCESS)
         res = memcached_fetch_result(self->mc, res, &rc);
 
+    /* Fetch the end of the mget cursor before the value is parsed, as
+     * reading a chunked value runs an mget of its own. */
+    if (rc == MEMCACHED_SUCCESS && res != NULL) {
+        memcached_return end_rc;
+        memcached_result_st *extra = memcached_fetch_result(self->mc, NULL,
+                                                            &end_rc);
+        if (extra != NULL) {
+            memcached_result_free(extra);
+            memcached_quit(self->mc);
+            drained = false;
+        }
+    }
+
     Py_END_ALLOW_THREADS;
+    if (instrumented) {
+        _PylibMC_TimeoutDone(self, t, rc);
+        _PylibMC_CountDone(c, rc, res != NULL && rc == MEMCACHED_SUCCESS
+                ? *keylengths + memcached_result_length(res) : 0);
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_GETS, started);
+        _PylibMC_TraceEnd(self, span, rc, *keylengths,
+                          res != NULL && rc == MEMCACHED_SUCCESS
+                          ? (Py_ssize_t)memcached_result_length(res) : 0);
+        _PylibMC_SampleKey(self, *keys, *keylengths);
+        if (res != NULL && rc == MEMCACHED_SUCCESS) {
+            _PylibMC_SampleValue(self, *keys, *keylengths,
+                                 memcached_result_length(res));
+        }
+    }
+
+    /* keys point into arg, which may be a normalized copy */
+    Py_DECREF(arg);
 
     int miss = 0;
     int fail = 0;
-    if (rc == MEMCACHED_SUCCESS && res != NULL) {
+    if (rc == MEMCACHED_SUCCESS && res != NULL && !drained) {
+        fail = 1;
+        PyErr_SetString(PyExc_RuntimeError, "fetch not done");
+    } else if (rc == MEMCACHED_SUCCESS && res != NULL) {
         PyObject *val = _PylibMC_parse_memcached_result(self, res);
         if (_PylibMC_cache_miss_simulated(val)) {
             miss = 1;
@@ -780,15 +1434,6 @@ static PyObject *PylibMC_Client_gets(PylibMC_Client *self, PyObject *arg) {
                                 val,
                                 memcached_result_cas(res));
         }
-
-        /* we have to fetch the last result from the mget cursor */
-        if (NULL != memcached_fetch_result(self->mc, NULL, &rc)) {
-            memcached_quit(self->mc);
-            Py_DECREF(ret);
-            ret = NULL;
-            fail = 1;
-            PyErr_SetString(PyExc_RuntimeError, "fetch not done");
-        }
     } else if (rc == MEMCACHED_END || rc == MEMCACHED_NOTFOUND) {
         miss = 1;
     } else {
@@ -812,11 +1457,22 @@ static PyObject *PylibMC_Client_hash(PylibMC_Client *self, PyObject *args, PyObj
     Py_ssize_t key_len = 0;
     uint32_t h;
 
+    PyObject *hashed = NULL;
+
     if (!PyArg_ParseTuple(args, "s#:hash", &key, &key_len)) {
         return NULL;
     }
 
-    h = memcached_generate_hash(self->mc, key, (Py_ssize_t)key_len);
+    /* Hash long keys the way they are stored, but leave others as they are;
+     * hash() never rejected any key. */
+    if (self->hash_long_keys && key_len >= MEMCACHED_MAX_KEY) {
+        if (!_key_mapped_str(self, &key, &key_len, &hashed)) {
+            return NULL;
+        }
+    }
+
+    h = memcached_generate_hash(self->mc, key, key_len);
+    Py_XDECREF(hashed);
 
     return PyLong_FromLong((long)h);
 }
@@ -837,9 +1493,14 @@ static PyObject *_PylibMC_RunSetCommandSingle(PylibMC_Client *self,
     unsigned int time = 0; /* this will be turned into a time_t */
     unsigned int min_compress = 0;
     int compress_level = -1;
+    memcached_return rc;
 
     bool success = false;
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     /*
      * "s#" specifies that (Unicode) text objects will be encoded
      * to UTF-8 byte strings for use as keys, and this seems to be
@@ -875,14 +1536,28 @@ static PyObject *_PylibMC_RunSetCommandSingle(PylibMC_Client *self,
      */
     key = PyBytes_FromStringAndSize(key_raw, keylen);
 
-    success = _PylibMC_SerializeValue(self, key, NULL, value, time, &serialized);
+    success = _PylibMC_SerializeValue(self, key, 0, value, time, &serialized);
 
     if (!success)
         goto cleanup;
 
-    success = _PylibMC_RunSetCommand(self, f, fname,
-                                     &serialized, 1,
-                                     min_compress, compress_level);
+    bool instrumented = _PylibMC_Instrumented(self);
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_SET, 1,
+                                   serialized.key, serialized.key_len);
+    }
+    rc = _PylibMC_RunSetCommand(self, f, fname,
+                                &serialized, 1,
+                                min_compress, compress_level);
+    success = rc == MEMCACHED_SUCCESS;
+    if (instrumented) {
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_SET, started);
+        _PylibMC_TraceEnd(self, span, rc,
+                          _PylibMC_MsetBytes(&serialized, 1), 0);
+    }
 
 cleanup:
     _PylibMC_FreeMset(&serialized);
@@ -904,23 +1579,29 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client *self,
     PyObject *keys = NULL;
     const char *key_prefix_raw = NULL;
     Py_ssize_t key_prefix_len = 0;
-    PyObject *key_prefix = NULL;
     unsigned int time = 0;
     unsigned int min_compress = 0;
     int compress_level = -1;
+    memcached_return rc;
     PyObject *failed = NULL;
     Py_ssize_t idx = 0;
     PyObject *curr_key, *curr_value;
-    PyObject *key_str_map = NULL;
     Py_ssize_t i;
     Py_ssize_t nkeys;
+    Py_ssize_t prefixed_size = 0;
     pylibmc_mset* serialized = NULL;
+    pylibmc_keybuf prefixed = { NULL };
     bool allsuccess;
+    int verify, prefix_ok;
 
     static char *kws[] = { "keys", "time", "key_prefix",
                            "min_compress_len", "compress_level",
                            NULL };
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|Is#Ii", kws,
                                      &PyDict_Type, &keys,
                                      &time, &key_prefix_raw, &key_prefix_len,
@@ -944,53 +1625,89 @@ static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client *self,
 
     nkeys = (Py_ssize_t)PyDict_Size(keys);
 
-    key_str_map = _PylibMC_map_str_keys(keys, NULL, NULL);
-    if (key_str_map == NULL) {
-        goto cleanup;
-    }
-
     serialized = PyMem_New(pylibmc_mset, nkeys);
     if (serialized == NULL) {
         goto cleanup;
     }
 
-    if (key_prefix_raw != NULL) {
-        key_prefix = PyBytes_FromStringAndSize(key_prefix_raw, key_prefix_len);
-    }
+    verify = _PylibMC_verify_keys(self);
+    prefix_ok = !verify || _key_verified_str(key_prefix_raw, key_prefix_len);
 
     for (i = 0, idx = 0; PyDict_Next(keys, &i, &curr_key, &curr_value); idx++) {
-        int success = _PylibMC_SerializeValue(self, curr_key, key_prefix,
+        pylibmc_mset *mset = &serialized[idx];
+        int success = _PylibMC_SerializeValue(self, curr_key,
+                                              key_prefix_len,
                                               curr_value, time,
-                                              &serialized[idx]);
+                                              mset);
 
         if (!success || PyErr_Occurred() != NULL) {
             nkeys = idx + 1;
             goto cleanup;
         }
+
+        /* _PylibMC_RunSetCommand reports keys memcached would reject as
+         * not stored. */
+        if (verify && !(prefix_ok && _key_verified_str(mset->key, mset->key_len))) {
+            mset->key = NULL;
+        }
+
+        prefixed_size += key_prefix_len + mset->key_len;
+    }
+
+    /* Point each mset at its prefixed key, assembled in one scratch buffer.
+     * Empty prefixes are ignored. */
+    if (key_prefix_len) {
+        if (!_PylibMC_KeyBufInit(&prefixed, prefixed_size)) {
+            goto cleanup;
+        }
+
+        for (idx = 0; idx < nkeys; idx++) {
+            pylibmc_mset *mset = &serialized[idx];
+
+            if (mset->key == NULL) {
+                continue;
+            }
+
+            if (!_PylibMC_KeyBufPrefixMapped(self, &prefixed,
+                                             key_prefix_raw, key_prefix_len,
+                                             &mset->key, &mset->key_len,
+                                             &mset->hashed_key_obj)) {
+                goto cleanup;
+            }
+        }
     }
 
-    allsuccess = _PylibMC_RunSetCommand(self, f, fname,
-                                        serialized, nkeys,
-                                        min_compress, compress_level);
+    bool instrumented = _PylibMC_Instrumented(self);
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_SET_MULTI, nkeys,
+                                   NULL, 0);
+    }
+    rc = _PylibMC_RunSetCommand(self, f, fname,
+                                serialized, nkeys,
+                                min_compress, compress_level);
+    allsuccess = rc == MEMCACHED_SUCCESS;
+    if (instrumented) {
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_SET_MULTI, started);
+        _PylibMC_TraceEnd(self, span, rc,
+                span != NULL ? _PylibMC_MsetBytes(serialized, nkeys) : 0, 0);
+    }
 
     if (PyErr_Occurred() != NULL) {
         goto cleanup;
     }
 
     if ((failed = PyList_New(0)) == NULL)
-        return PyErr_NoMemory();
+        goto cleanup;
 
     for (idx = 0; !allsuccess && idx < nkeys; idx++) {
-        PyObject *key_obj;
-
         if (serialized[idx].success)
             continue;
 
-        key_obj = serialized[idx].key_obj;
-        if (PyDict_Contains(key_str_map, key_obj)) {
-            key_obj = PyDict_GetItem(key_str_map, key_obj);
-        }
-        if (PyList_Append(failed, key_obj) != 0) {
+        /* key_obj is the key as given, so str keys are reported as such */
+        if (PyList_Append(failed, serialized[idx].key_obj) != 0) {
             Py_DECREF(failed);
             failed = PyErr_NoMemory();
             goto cleanup;
@@ -1004,8 +1721,7 @@ cleanup:
         }
         PyMem_Free(serialized);
     }
-    Py_XDECREF(key_prefix);
-    Py_XDECREF(key_str_map);
+    _PylibMC_KeyBufFree(&prefixed);
 
     return failed;
 }
@@ -1025,6 +1741,10 @@ static PyObject *_PylibMC_RunCasCommand(PylibMC_Client *self,
     memcached_return rc;
     pylibmc_mset mset = { NULL };
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#OL|I", kws,
                                      &key_raw, &key_len, &value, &cas,
                                      &time)) {
@@ -1040,18 +1760,41 @@ static PyObject *_PylibMC_RunCasCommand(PylibMC_Client *self,
 
     /* TODO: because it's RunSetCommand that does the zlib
        compression, cas can't currently use compressed values. */
-    success = _PylibMC_SerializeValue(self, key, NULL, value, time, &mset);
+    success = _PylibMC_SerializeValue(self, key, 0, value, time, &mset);
 
     if (!success || PyErr_Occurred() != NULL) {
         goto cleanup;
     }
 
+    bool instrumented = _PylibMC_Instrumented(self);
+    pylibmc_server_counters *c = NULL;
+    pylibmc_server_timing *t = NULL;
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        c = _PylibMC_CounterFor(self, _PylibMC_Counters(self),
+                                mset.key, mset.key_len);
+        t = _PylibMC_TimeoutFor(self, _PylibMC_Timings(self),
+                                mset.key, mset.key_len);
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_CAS, 1,
+                                   mset.key, mset.key_len);
+        _PylibMC_CountSent(c, mset.key_len + mset.value_len);
+    }
     Py_BEGIN_ALLOW_THREADS;
     rc = memcached_cas(self->mc,
                        mset.key, mset.key_len,
                        mset.value, mset.value_len,
                        mset.time, mset.flags, cas);
     Py_END_ALLOW_THREADS;
+    if (instrumented) {
+        _PylibMC_TimeoutDone(self, t, rc);
+        _PylibMC_CountDone(c, rc, 0);
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_CAS, started);
+        _PylibMC_TraceEnd(self, span, rc, _PylibMC_MsetBytes(&mset, 1), 0);
+        _PylibMC_SampleKey(self, mset.key, mset.key_len);
+        _PylibMC_SampleValue(self, mset.key, mset.key_len, mset.value_len);
+    }
 
     switch(rc) {
         case MEMCACHED_SUCCESS:
@@ -1077,9 +1820,8 @@ cleanup:
 static void _PylibMC_FreeMset(pylibmc_mset *mset) {
     Py_XDECREF(mset->key_obj);
     mset->key_obj = NULL;
-
-    Py_XDECREF(mset->prefixed_key_obj);
-    mset->prefixed_key_obj = NULL;
+    Py_XDECREF(mset->hashed_key_obj);
+    mset->hashed_key_obj = NULL;
 
     /* Either a ref we own, or a ref passed to us which we borrowed. */
     Py_XDECREF(mset->value_obj);
@@ -1088,7 +1830,7 @@ static void _PylibMC_FreeMset(pylibmc_mset *mset) {
 
 static int _PylibMC_SerializeValue(PylibMC_Client *self,
                                    PyObject* key_obj,
-                                   PyObject* key_prefix,
+                                   Py_ssize_t prefix_len,
                                    PyObject* value_obj,
                                    time_t time,
                                    pylibmc_mset* serialized) {
@@ -1100,58 +1842,17 @@ static int _PylibMC_SerializeValue(PylibMC_Client *self,
     serialized->success = false;
     serialized->value_obj = NULL;
 
-    if (!_key_normalized_obj(&key_obj)) {
+    if (!_key_normalized_buf(self, key_obj, prefix_len, &serialized->key,
+                             &serialized->key_len,
+                             &serialized->hashed_key_obj)) {
         return false;
     }
 
+    /* serialized->key points into key_obj (or hashed_key_obj), so hold on
+     * to it */
+    Py_INCREF(key_obj);
     serialized->key_obj = key_obj;
 
-    if (PyBytes_AsStringAndSize(key_obj,
-                                &serialized->key,
-                                &serialized->key_len) == -1) {
-        Py_DECREF(key_obj);
-        return false;
-    }
-
-    /* Check the key_prefix */
-    if (key_prefix != NULL) {
-        if (!_key_normalized_obj(&key_prefix)) {
-            return false;
-        }
-
-        /* Ignore empty prefixes */
-        if (!PyBytes_Size(key_prefix)) {
-            Py_DECREF(key_prefix);
-            key_prefix = NULL;
-        }
-    }
-
-    /* Make the prefixed key if appropriate */
-    if (key_prefix != NULL) {
-        PyObject* prefixed_key_obj = NULL; /* freed by _PylibMC_FreeMset */
-
-        prefixed_key_obj = PyBytes_FromFormat("%s%s",
-                PyBytes_AS_STRING(key_prefix),
-                PyBytes_AS_STRING(key_obj));
-
-        Py_DECREF(key_prefix);
-        key_prefix = NULL;
-
-        if (prefixed_key_obj == NULL) {
-            return false;
-        }
-
-        /* check the key and overwrite the C string */
-        if(!_key_normalized_obj(&prefixed_key_obj)
-           || PyBytes_AsStringAndSize(prefixed_key_obj,
-                                       &serialized->key,
-                                       &serialized->key_len) == -1) {
-            return false;
-        }
-
-        serialized->prefixed_key_obj = prefixed_key_obj;
-    }
-
     int success;
     /* Build serialized->value_obj, a Python str/bytes object. */
     if (self->native_serialization) {
@@ -1259,17 +1960,29 @@ static PyObject *PylibMC_Client_serialize(PylibMC_Client *self, PyObject *value_
 }
 
 /* {{{ Set commands (set, replace, add, prepend, append) */
-static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
+/* Store `msets`, setting the success of each. Returns MEMCACHED_SUCCESS if
+ * all were stored, or else the error that stopped the batch, or the last
+ * key to fail; raises for the errors that stop it. */
+static memcached_return _PylibMC_RunSetCommand(PylibMC_Client* self,
                                    _PylibMC_SetCommand f, char *fname,
                                    pylibmc_mset* msets, Py_ssize_t nkeys,
                                    Py_ssize_t min_compress,
                                    int compress_level) {
     memcached_st *mc = self->mc;
-    memcached_return rc = MEMCACHED_SUCCESS;
+    memcached_return rc = MEMCACHED_SUCCESS, failed = MEMCACHED_SUCCESS;
+    Py_ssize_t chunk_size = self->chunk_size;
+    bool instrumented = _PylibMC_Instrumented(self);
+    pylibmc_server_counters *counters = NULL;
+    pylibmc_server_timing *timings = NULL;
     bool softerrors = false,
          harderrors = false;
     int i;
 
+    if (instrumented) {
+        counters = _PylibMC_Counters(self);
+        timings = _PylibMC_Timings(self);
+    }
+
     Py_BEGIN_ALLOW_THREADS;
 
     for (i = 0; i < nkeys && !harderrors; i++) {
@@ -1298,11 +2011,33 @@ static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
         }
 #endif
 
-        if (mset->key_len == 0) {
+        if (mset->key == NULL || mset->key_len == 0) {
             rc = MEMCACHED_NOTSTORED;
         } else {
-            rc = f(mc, mset->key, mset->key_len,
-                   value, value_len, mset->time, flags);
+            pylibmc_server_counters *c = NULL;
+            pylibmc_server_timing *t = NULL;
+
+            if (instrumented) {
+                c = _PylibMC_CounterFor(self, counters,
+                                        mset->key, mset->key_len);
+                t = _PylibMC_TimeoutFor(self, timings,
+                                        mset->key, mset->key_len);
+                _PylibMC_CountSent(c, mset->key_len + value_len);
+            }
+            if (chunk_size && value_len > chunk_size
+                    && (f == memcached_set || f == memcached_add
+                        || f == memcached_replace)) {
+                rc = _PylibMC_SetChunked(mc, f, mset->key, mset->key_len,
+                                         value, value_len, mset->time, flags,
+                                         chunk_size);
+            } else {
+                rc = f(mc, mset->key, mset->key_len,
+                       value, value_len, mset->time, flags);
+            }
+            if (instrumented) {
+                _PylibMC_TimeoutDone(self, t, rc);
+                _PylibMC_CountDone(c, rc, 0);
+            }
         }
 
 #ifdef USE_ZLIB
@@ -1311,6 +2046,10 @@ static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
         }
 #endif
 
+        if (rc != MEMCACHED_SUCCESS) {
+            failed = rc;
+        }
+
         switch (rc) {
 
             /* Successful case */
@@ -1338,11 +2077,103 @@ static bool _PylibMC_RunSetCommand(PylibMC_Client* self,
 
     Py_END_ALLOW_THREADS;
 
+    /* Sampled with the GIL back, as _PylibMC_SampleKey needs. */
+    if (instrumented && self->sampler != NULL) {
+        for (i = 0; i < nkeys; i++) {
+            if (msets[i].key != NULL && msets[i].key_len) {
+                _PylibMC_SampleKey(self, msets[i].key, msets[i].key_len);
+                _PylibMC_SampleValue(self, msets[i].key, msets[i].key_len,
+                                     msets[i].value_len);
+            }
+        }
+    }
+
     if (harderrors) {
         PylibMC_ErrFromMemcached(self, fname, rc);
     }
 
-    return !softerrors;
+    return softerrors ? failed : MEMCACHED_SUCCESS;
+}
+
+/* Derive the key of chunk `i` of a value with hex digest `digest` stored
+ * under `key`: the key, or its hashed form if it is too long to take the
+ * suffix, then ":chunk:<first 16 digest digits>:<i>". Naming chunks after
+ * the value keeps writers of different values from mixing their chunks.
+ * `dest` needs room for MEMCACHED_MAX_KEY bytes. Returns the key length.
+ */
+static Py_ssize_t _PylibMC_ChunkKey(char *dest, const char *key,
+                                    Py_ssize_t key_len, const char *digest,
+                                    unsigned int i) {
+    Py_ssize_t len;
+
+    if (key_len + (Py_ssize_t)PYLIBMC_CHUNK_KEY_SUFFIX_MAX < MEMCACHED_MAX_KEY) {
+        memcpy(dest, key, key_len);
+        len = key_len;
+    } else {
+        _key_hashed_str(dest, key, key_len);
+        len = PYLIBMC_LONG_KEY_LEN;
+    }
+
+    len += snprintf(dest + len, MEMCACHED_MAX_KEY - len,
+                    ":chunk:%.16s:%u", digest, i);
+    return len;
+}
+
+/* Store a value too large for chunk_size: first the chunks, one at a time
+ * so that each is known to be stored, then the manifest under the key itself
+ * using `f`, so that the manifest never points at chunks the server refused.
+ * A chunk evicted later is caught by the digest in the manifest, and makes
+ * the value read as a miss. With buffer_requests, the chunks still wait for
+ * their replies; the manifest is buffered as the caller asked.
+ *
+ * Called with the GIL released.
+ */
+static memcached_return _PylibMC_SetChunked(memcached_st *mc,
+        _PylibMC_SetCommand f, const char *key, Py_ssize_t key_len,
+        const char *value, Py_ssize_t value_len, time_t time,
+        uint32_t flags, uint32_t chunk_size) {
+    char chunk_key[MEMCACHED_MAX_KEY];
+    char manifest[PYLIBMC_CHUNK_MANIFEST_MAX];
+    char digest[33];
+    unsigned int i, nchunks = (unsigned int)((value_len + chunk_size - 1) / chunk_size);
+    uint64_t buffered = memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS);
+    memcached_return rc = MEMCACHED_SUCCESS;
+    int manifest_len;
+
+    _key_digest_hex(value, value_len, digest);
+    digest[32] = '\0';
+
+    if (buffered) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 0);
+    }
+
+    for (i = 0; i < nchunks; i++) {
+        Py_ssize_t offset = (Py_ssize_t)i * chunk_size;
+        Py_ssize_t len = value_len - offset;
+        Py_ssize_t chunk_key_len = _PylibMC_ChunkKey(chunk_key, key, key_len,
+                                                     digest, i);
+
+        rc = memcached_set(mc, chunk_key, chunk_key_len,
+                           value + offset, len < chunk_size ? len : chunk_size,
+                           time, 0);
+        if (rc != MEMCACHED_SUCCESS) {
+            break;
+        }
+    }
+
+    if (buffered) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+    }
+
+    if (rc != MEMCACHED_SUCCESS) {
+        return rc;
+    }
+
+    manifest_len = snprintf(manifest, sizeof(manifest), "%u %u %zd %s",
+                            nchunks, chunk_size, value_len, digest);
+
+    return f(mc, key, key_len, manifest, manifest_len, time,
+             flags | PYLIBMC_FLAG_CHUNKED);
 }
 
 /* These all just call _PylibMC_RunSetCommand with the appropriate
@@ -1387,28 +2218,60 @@ static PyObject *PylibMC_Client_cas(PylibMC_Client *self, PyObject *args,
 static PyObject *PylibMC_Client_delete(PylibMC_Client *self, PyObject *args) {
     char *key;
     Py_ssize_t key_len = 0;
+    PyObject *hashed = NULL;
+    PyObject *ret = NULL;
     memcached_return rc;
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     if (PyArg_ParseTuple(args, "s#:delete", &key, &key_len)
-            && _key_normalized_str(&key, &key_len)) {
+            && _key_mapped_str(self, &key, &key_len, &hashed)) {
+        bool instrumented = _PylibMC_Instrumented(self);
+        pylibmc_server_counters *c = NULL;
+        pylibmc_server_timing *t = NULL;
+        uint64_t started = 0;
+        PyObject *span = NULL;
+        if (instrumented) {
+            c = _PylibMC_CounterFor(self, _PylibMC_Counters(self),
+                                    key, key_len);
+            t = _PylibMC_TimeoutFor(self, _PylibMC_Timings(self),
+                                    key, key_len);
+            started = _PylibMC_LatencyStart(self);
+            span = _PylibMC_TraceStart(self, PYLIBMC_OP_DELETE, 1,
+                                       key, key_len);
+            _PylibMC_CountSent(c, key_len);
+        }
         Py_BEGIN_ALLOW_THREADS;
         rc = memcached_delete(self->mc, key, key_len, 0);
         Py_END_ALLOW_THREADS;
+        if (instrumented) {
+            _PylibMC_TimeoutDone(self, t, rc);
+            _PylibMC_CountDone(c, rc, 0);
+            _PylibMC_LatencyRecord(self, PYLIBMC_OP_DELETE, started);
+            _PylibMC_TraceEnd(self, span, rc, key_len, 0);
+        }
         switch (rc) {
             case MEMCACHED_SUCCESS:
-                Py_RETURN_TRUE;
+                ret = Py_True;
+                Py_INCREF(ret);
+                break;
             case MEMCACHED_FAILURE:
             case MEMCACHED_NOTFOUND:
             case MEMCACHED_NO_KEY_PROVIDED:
             case MEMCACHED_BAD_KEY_PROVIDED:
-                Py_RETURN_FALSE;
+                ret = Py_False;
+                Py_INCREF(ret);
+                break;
             default:
-                return PylibMC_ErrFromMemcachedWithKey(self, "memcached_delete",
-                                                       rc, key, key_len);
+                ret = PylibMC_ErrFromMemcachedWithKey(self, "memcached_delete",
+                                                      rc, key, key_len);
         }
+        Py_XDECREF(hashed);
     }
 
-    return NULL;
+    return ret;
 }
 
 static PyObject *PylibMC_Client_touch(PylibMC_Client *self, PyObject *args) {
@@ -1416,29 +2279,61 @@ static PyObject *PylibMC_Client_touch(PylibMC_Client *self, PyObject *args) {
     char *key;
     long seconds;
     Py_ssize_t key_len;
+    PyObject *hashed = NULL;
+    PyObject *ret = NULL;
     memcached_return rc;
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     if(PyArg_ParseTuple(args, "s#k", &key, &key_len, &seconds)
-            && _key_normalized_str(&key, &key_len)) {
+            && _key_mapped_str(self, &key, &key_len, &hashed)) {
+        bool instrumented = _PylibMC_Instrumented(self);
+        pylibmc_server_counters *c = NULL;
+        pylibmc_server_timing *t = NULL;
+        uint64_t started = 0;
+        PyObject *span = NULL;
+        if (instrumented) {
+            c = _PylibMC_CounterFor(self, _PylibMC_Counters(self),
+                                    key, key_len);
+            t = _PylibMC_TimeoutFor(self, _PylibMC_Timings(self),
+                                    key, key_len);
+            started = _PylibMC_LatencyStart(self);
+            span = _PylibMC_TraceStart(self, PYLIBMC_OP_TOUCH, 1,
+                                       key, key_len);
+            _PylibMC_CountSent(c, key_len);
+        }
         Py_BEGIN_ALLOW_THREADS;
         rc = memcached_touch(self->mc, key, key_len, seconds);
         Py_END_ALLOW_THREADS;
+        if (instrumented) {
+            _PylibMC_TimeoutDone(self, t, rc);
+            _PylibMC_CountDone(c, rc, 0);
+            _PylibMC_LatencyRecord(self, PYLIBMC_OP_TOUCH, started);
+            _PylibMC_TraceEnd(self, span, rc, key_len, 0);
+        }
         switch (rc){
             case MEMCACHED_SUCCESS:
             case MEMCACHED_STORED:
-                Py_RETURN_TRUE;
+                ret = Py_True;
+                Py_INCREF(ret);
+                break;
             case MEMCACHED_FAILURE:
             case MEMCACHED_NOTFOUND:
             case MEMCACHED_NO_KEY_PROVIDED:
             case MEMCACHED_BAD_KEY_PROVIDED:
-                Py_RETURN_FALSE;
+                ret = Py_False;
+                Py_INCREF(ret);
+                break;
             default:
-                return PylibMC_ErrFromMemcachedWithKey(self, "memcached_touch",
-                                                       rc, key, key_len);
+                ret = PylibMC_ErrFromMemcachedWithKey(self, "memcached_touch",
+                                                      rc, key, key_len);
         }
+        Py_XDECREF(hashed);
     }
 
-    return NULL;
+    return ret;
 #else
     PyErr_Format(PylibMCExc_Error,
                  "memcached_touch isn't available; upgrade libmemcached to >= 1.0.2");
@@ -1455,11 +2350,15 @@ static PyObject *_PylibMC_IncrSingle(PylibMC_Client *self,
     char *key;
     Py_ssize_t key_len = 0;
     int delta = 1;
+    PyObject *hashed = NULL;
     pylibmc_incr incr;
+    memcached_return rc;
 
-    if (!PyArg_ParseTuple(args, "s#|i", &key, &key_len, &delta)) {
+    if (!_PylibMC_ForkCheck(self)) {
         return NULL;
-    } else if (!_key_normalized_str(&key, &key_len)) {
+    }
+
+    if (!PyArg_ParseTuple(args, "s#|i", &key, &key_len, &delta)) {
         return NULL;
     }
 
@@ -1468,13 +2367,29 @@ static PyObject *_PylibMC_IncrSingle(PylibMC_Client *self,
         return NULL;
     }
 
+    if (!_key_mapped_str(self, &key, &key_len, &hashed)) {
+        return NULL;
+    }
+
     incr.key = key;
     incr.key_len = key_len;
     incr.incr_func = incr_func;
     incr.delta = delta;
     incr.result = 0;
 
-    _PylibMC_IncrDecr(self, &incr, 1);
+    bool instrumented = _PylibMC_Instrumented(self);
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_INCR, 1, key, key_len);
+    }
+    rc = _PylibMC_IncrDecr(self, &incr, 1);
+    if (instrumented) {
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_INCR, started);
+        _PylibMC_TraceEnd(self, span, rc, key_len, 0);
+    }
+    Py_XDECREF(hashed);
 
     if(PyErr_Occurred() != NULL) {
       /* exception already on the stack */
@@ -1488,100 +2403,81 @@ static PyObject *_PylibMC_IncrSingle(PylibMC_Client *self,
 static PyObject *_PylibMC_IncrMulti(PylibMC_Client *self,
                                     _PylibMC_IncrCommand incr_func,
                                     PyObject *args, PyObject *kwds) {
-    PyObject *key = NULL;
     PyObject *keys = NULL;
-    PyObject *keys_tmp = NULL;
     const char *key_prefix_raw = NULL;
     Py_ssize_t key_prefix_len = 0;
-    PyObject *key_prefix = NULL;
     PyObject *retval = NULL;
-    PyObject *iterator = NULL;
     unsigned int delta = 1;
     Py_ssize_t nkeys = 0, i = 0;
-    pylibmc_incr *incrs;
+    Py_ssize_t prefixed_size = 0;
+    pylibmc_key *key_objs = NULL;
+    pylibmc_incr *incrs = NULL;
+    pylibmc_keybuf prefixed = { NULL };
+    memcached_return rc;
 
     static char *kws[] = { "keys", "key_prefix", "delta", NULL };
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s#I", kws,
                                      &keys, &key_prefix_raw,
                                      &key_prefix_len, &delta))
         return NULL;
 
-    nkeys = (Py_ssize_t)PySequence_Size(keys);
+    /* key_objs and prefixed own the keys backing each pylibmc_incr */
+    nkeys = _PylibMC_NormalizeKeys(self, keys, key_prefix_raw, key_prefix_len,
+                                   &key_objs, &prefixed);
     if (nkeys == -1)
         return NULL;
 
-    if (key_prefix_raw != NULL) {
-        key_prefix = PyBytes_FromStringAndSize(key_prefix_raw, key_prefix_len);
-
-        if (key_prefix != NULL && PyBytes_Size(key_prefix) == 0)
-            key_prefix = NULL;
-    }
-
-    keys_tmp = PyList_New(nkeys);
-    if (keys_tmp == NULL)
-        return NULL;
-
-    incrs = PyMem_New(pylibmc_incr, nkeys);
-    if (incrs == NULL)
-        goto cleanup;
-
-    iterator = PyObject_GetIter(keys);
-    if (iterator == NULL)
+    incrs = PyMem_New(pylibmc_incr, nkeys ? nkeys : 1);
+    if (incrs == NULL) {
+        PyErr_NoMemory();
         goto cleanup;
+    }
 
-    /* Build pylibmc_incr structs, prefixed as appropriate. */
-    for (i = 0; (key = PyIter_Next(iterator)) != NULL; i++) {
+    /* Build pylibmc_incr structs. */
+    for (i = 0; i < nkeys; i++) {
         pylibmc_incr *incr = incrs + i;
 
-        if (!_key_normalized_obj(&key))
-            goto loopcleanup;
-
-        /* prefix `key` with `key_prefix` */
-        if (key_prefix != NULL) {
-            PyObject* newkey = PyBytes_FromFormat("%s%s",
-                                                   PyBytes_AS_STRING(key_prefix),
-                                                   PyBytes_AS_STRING(key));
-            Py_DECREF(key);
-            key = newkey;
-        }
-
-        Py_INCREF(key);
-        if (PyList_SetItem(keys_tmp, i, key) == -1)
-            goto loopcleanup;
+        incr->key = key_objs[i].key;
+        incr->key_len = key_objs[i].key_len;
+        prefixed_size += incr->key_len;
 
-        /* Populate pylibmc_incr */
-        if (PyBytes_AsStringAndSize(key, &incr->key, &incr->key_len) == -1)
-            goto loopcleanup;
         incr->delta = delta;
         incr->incr_func = incr_func;
         /* After incring we have no way of knowing whether the real result is 0
          * or if the incr wasn't successful (or if noreply is set), but since
          * we're not actually returning the result that's okay for now */
         incr->result = 0;
-
-loopcleanup:
-        Py_DECREF(key);
-        if (PyErr_Occurred())
-            goto cleanup;
     } /* end each key */
 
-    _PylibMC_IncrDecr(self, incrs, nkeys);
+    bool instrumented = _PylibMC_Instrumented(self);
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_INCR_MULTI, nkeys,
+                                   NULL, 0);
+    }
+    rc = _PylibMC_IncrDecr(self, incrs, nkeys);
+    if (instrumented) {
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_INCR_MULTI, started);
+        _PylibMC_TraceEnd(self, span, rc, prefixed_size, 0);
+    }
 
     if (!PyErr_Occurred()) {
         retval = Py_None;
         Py_INCREF(retval);
-    } else {
-        Py_XDECREF(retval);
-        retval = NULL;
     }
 
 cleanup:
     if (incrs != NULL)
         PyMem_Free(incrs);
-    Py_XDECREF(key_prefix);
-    Py_DECREF(keys_tmp);
-    Py_XDECREF(iterator);
+    _PylibMC_KeyBufFree(&prefixed);
+    _PylibMC_FreeKeys(key_objs, nkeys);
 
     return retval;
 }
@@ -1599,25 +2495,55 @@ static PyObject *PylibMC_Client_incr_multi(PylibMC_Client *self, PyObject *args,
     return _PylibMC_IncrMulti(self, memcached_increment, args, kwds);
 }
 
-static bool _PylibMC_IncrDecr(PylibMC_Client *self,
+/* Apply `incrs`, raising if any failed. Returns MEMCACHED_SUCCESS, or the
+ * error of the last key to fail, MEMCACHED_NOTFOUND if all of those that
+ * failed were missing. */
+static memcached_return _PylibMC_IncrDecr(PylibMC_Client *self,
                               pylibmc_incr *incrs, Py_ssize_t nkeys) {
-    memcached_return rc = MEMCACHED_SUCCESS;
+    memcached_return rc = MEMCACHED_SUCCESS, failed = MEMCACHED_SUCCESS;
     _PylibMC_IncrCommand f = NULL;
     Py_ssize_t i, notfound = 0, errors = 0;
+    bool instrumented = _PylibMC_Instrumented(self);
+    pylibmc_server_counters *counters = NULL;
+    pylibmc_server_timing *timings = NULL;
+
+    if (instrumented) {
+        counters = _PylibMC_Counters(self);
+        timings = _PylibMC_Timings(self);
+    }
 
     Py_BEGIN_ALLOW_THREADS;
     for (i = 0; i < nkeys; i++) {
         pylibmc_incr *incr = &incrs[i];
         uint64_t result = 0;
 
+        /* Keys rejected by verify_keys never reach libmemcached. */
+        if (incr->key == NULL) {
+            failed = MEMCACHED_BAD_KEY_PROVIDED;
+            errors++;
+            continue;
+        }
+
+        pylibmc_server_counters *c = NULL;
+        pylibmc_server_timing *t = NULL;
+        if (instrumented) {
+            c = _PylibMC_CounterFor(self, counters, incr->key, incr->key_len);
+            t = _PylibMC_TimeoutFor(self, timings, incr->key, incr->key_len);
+            _PylibMC_CountSent(c, incr->key_len);
+        }
         f = incr->incr_func;
         rc = f(self->mc, incr->key, incr->key_len, incr->delta, &result);
+        if (instrumented) {
+            _PylibMC_TimeoutDone(self, t, rc);
+            _PylibMC_CountDone(c, rc, 0);
+        }
         /* TODO Signal errors through `incr` */
         if (rc == MEMCACHED_SUCCESS) {
             incr->result = result;
         } else if (rc == MEMCACHED_NOTFOUND) {
             notfound++;
         } else {
+            failed = rc;
             errors++;
         }
     }
@@ -1627,29 +2553,65 @@ static bool _PylibMC_IncrDecr(PylibMC_Client *self,
         PyObject *exc = PylibMCExc_Error;
 
         if (errors == 0)
-            exc = _exc_by_rc(MEMCACHED_NOTFOUND);
+            exc = _exc_by_rc(failed = MEMCACHED_NOTFOUND);
         else if (errors == 1)
-            exc = _exc_by_rc(rc);
+            exc = _exc_by_rc(failed);
 
         PyErr_Format(exc, "%d keys %s",
                      (int)(notfound + errors),
                      errors ? "failed" : "not found");
     }
 
-    return 0 == (errors + notfound);
+    return failed;
 }
 /* }}} */
 
-static pylibmc_mget_res _fetch_multi(memcached_st *mc,
+static pylibmc_mget_res _fetch_multi(PylibMC_Client *self,
                                      pylibmc_mget_req req) {
     /* Completely GIL-free multi getter */
+    memcached_st *mc = self->mc;
     pylibmc_mget_res res = { 0 };
+    int32_t poll_timeout = 0;
+    Py_ssize_t i, fetch_errors = 0;
+
+    if (req.instrumented && req.counters != NULL) {
+        for (i = 0; i < req.nkeys; i++) {
+            _PylibMC_CountSent(_PylibMC_CounterFor(self, req.counters,
+                                                   req.keys[i], req.key_lens[i]),
+                               req.key_lens[i]);
+        }
+    }
+
+    if (req.deadline) {
+        poll_timeout = (int32_t)memcached_behavior_get(mc,
+                MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+        if (!_PylibMC_DeadlineWait(mc, req.deadline, poll_timeout)) {
+            res.rc = MEMCACHED_SUCCESS;
+            goto done;
+        }
+    }
 
     res.rc = memcached_mget(mc, (const char **)req.keys, req.key_lens, req.nkeys);
 
-    if (res.rc != MEMCACHED_SUCCESS) {
+    if (req.partial && res.rc == MEMCACHED_SOME_ERRORS) {
+        /* The keys of the other servers went out; fetch those. */
+        _PylibMC_CountError(_PylibMC_CounterForFailure(self, req.counters),
+                            res.rc);
+        _PylibMC_MarkFailed(self, &res, false);
+    } else if (req.partial && _PylibMC_ServerFailure(res.rc)) {
+        _PylibMC_CountError(_PylibMC_CounterForFailure(self, req.counters),
+                            res.rc);
+        _PylibMC_MarkFailed(self, &res, true);
+        memcached_quit(mc);
+        res.rc = MEMCACHED_SUCCESS;
+        goto done;
+    } else if (res.rc == MEMCACHED_TIMEOUT && req.deadline) {
+        memcached_quit(mc);
+        res.rc = MEMCACHED_SUCCESS;
+        goto done;
+    } else if (res.rc != MEMCACHED_SUCCESS) {
         res.err_func = "memcached_mget";
-        return res;
+        goto done;
     }
 
     /* Allocate the results array, with room for libmemcached's sentinel. */
@@ -1659,143 +2621,336 @@ static pylibmc_mget_res _fetch_multi(memcached_st *mc,
      * runs a half pass after the last key has been fetched, thus bumping the
      * count once. */
     for (res.nresults = 0; ; res.nresults++) {
-        memcached_result_st *result = memcached_result_create(mc, &res.results[res.nresults]);
+        memcached_result_st *result;
+
+        /* Past the deadline, what has come so far is the result. */
+        if (req.deadline
+                && !_PylibMC_DeadlineWait(mc, req.deadline, poll_timeout)) {
+            if (req.partial) {
+                _PylibMC_MarkFailed(self, &res, false);
+            }
+            memcached_quit(mc);  /* Reset fetch state */
+            break;
+        }
+
+        result = memcached_result_create(mc, &res.results[res.nresults]);
 
         assert(res.nresults <= req.nkeys);
 
         result = memcached_fetch_result(mc, result, &res.rc);
 
-        if (result == NULL || res.rc == MEMCACHED_END) {
+        if (req.partial && _PylibMC_ServerFailure(res.rc)) {
+            /* Note the server and go on with the others, unless failures
+             * keep coming, and then leave it at what has come. */
+            _PylibMC_CountError(_PylibMC_CounterForFailure(self, req.counters),
+                                res.rc);
+            _PylibMC_MarkFailed(self, &res, false);
+            memcached_result_free(&res.results[res.nresults]);
+            if (++fetch_errors > (Py_ssize_t)res.nservers) {
+                _PylibMC_MarkFailed(self, &res, true);
+                memcached_quit(mc);
+                break;
+            }
+            res.nresults--;
+            continue;
+        } else if (result == NULL || res.rc == MEMCACHED_END) {
             /* This is how libmecached signals EOF. */
             break;
+        } else if (res.rc == MEMCACHED_TIMEOUT && req.deadline) {
+            memcached_quit(mc);
+            memcached_result_free(&res.results[res.nresults]);
+            break;
         } else if (res.rc == MEMCACHED_BAD_KEY_PROVIDED
                 || res.rc == MEMCACHED_NO_KEY_PROVIDED) {
             continue;
         } else if (res.rc != MEMCACHED_SUCCESS) {
             memcached_quit(mc);  /* Reset fetch state */
             res.err_func = "memcached_fetch";
+            /* The failed result was created too. */
+            res.nresults++;
             _free_multi_result(res);
+            res.results = NULL;
+            res.nresults = 0;
+            goto done;
+        }
+
+        if (req.instrumented && req.counters != NULL) {
+            const char *key = memcached_result_key_value(result);
+            Py_ssize_t key_len = memcached_result_key_length(result);
+            pylibmc_server_counters *c = _PylibMC_CounterFor(self, req.counters,
+                                                             key, key_len);
+            if (c != NULL) {
+                c->bytes_in += key_len + memcached_result_length(result);
+            }
         }
     }
 
     res.rc = MEMCACHED_SUCCESS;
+
+done:
+    if (req.deadline) {
+        memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                               (uint64_t)(int64_t)poll_timeout);
+    }
+    if (req.counters != NULL && res.rc != MEMCACHED_SUCCESS) {
+        _PylibMC_CountError(_PylibMC_CounterForFailure(self, req.counters),
+                            res.rc);
+    }
     return res;
 }
 
-static void _free_multi_result(pylibmc_mget_res res) {
-    if (res.results == NULL)
-        return;
-    for (Py_ssize_t i = 0; i < res.nresults; i++) {
-        memcached_result_free(&res.results[i]);
+/* Whether `rc` says a server could not be reached or did not answer, as
+ * opposed to something being wrong with the request. */
+static bool _PylibMC_ServerFailure(memcached_return rc) {
+    switch (rc) {
+        case MEMCACHED_TIMEOUT:
+        case MEMCACHED_CONNECTION_FAILURE:
+        case MEMCACHED_CONNECTION_SOCKET_CREATE_FAILURE:
+        case MEMCACHED_HOST_LOOKUP_FAILURE:
+        case MEMCACHED_WRITE_FAILURE:
+        case MEMCACHED_READ_FAILURE:
+        case MEMCACHED_UNKNOWN_READ_FAILURE:
+        case MEMCACHED_ERRNO:
+        case MEMCACHED_SOME_ERRORS:
+        case MEMCACHED_SERVER_MARKED_DEAD:
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000002
+        case MEMCACHED_SERVER_TEMPORARILY_DISABLED:
+#endif
+            return true;
+        default:
+            return false;
     }
-    PyMem_RawDel(res.results);
 }
 
-static PyObject *PylibMC_Client_get_multi(
-        PylibMC_Client *self, PyObject *args, PyObject *kwds) {
-    PyObject *key_seq, **key_objs, **orig_key_objs, *retval = NULL;
-    char **keys, *prefix = NULL;
-    Py_ssize_t prefix_len = 0;
-    Py_ssize_t i;
-    PyObject *key_str_map = NULL;
-    PyObject *temp_key_obj;
-    size_t *key_lens;
-    Py_ssize_t nkeys = 0, orig_nkeys = 0;
-    pylibmc_mget_req req;
-    pylibmc_mget_res res = { 0 };
-
-    static char *kws[] = { "keys", "key_prefix", NULL };
+/* Flag in `res` the server libmemcached last lost its connection to, or
+ * with `all`, or should it not say, every server still owing answers; or
+ * failing that, every server. Needs no GIL. */
+static void _PylibMC_MarkFailed(PylibMC_Client *self, pylibmc_mget_res *res,
+                                bool all) {
+    memcached_st *mc = self->mc;
+    bool marked = false;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s#:get_multi", kws,
-            &key_seq, &prefix, &prefix_len))
-        return NULL;
+    if (res->failed == NULL) {
+        res->nservers = memcached_server_count(mc);
+        res->failed = PyMem_RawCalloc(res->nservers ? res->nservers : 1, 1);
+        if (res->failed == NULL) {
+            return;
+        }
+    }
 
-    if ((orig_nkeys = PySequence_Length(key_seq)) == -1)
-        return NULL;
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+    uint32_t i;
+    int idx = -1;
 
-    /* Populate keys and key_lens. */
-    keys = PyMem_New(char *, orig_nkeys);
-    key_lens = PyMem_New(size_t, (size_t) orig_nkeys);
-    key_objs = PyMem_New(PyObject *, (Py_ssize_t) orig_nkeys);
-    orig_key_objs = PyMem_New(PyObject *, (Py_ssize_t) orig_nkeys);
-    if (!keys || !key_lens || !key_objs || !orig_key_objs) {
-        PyErr_NoMemory();
-        goto memory_cleanup;
+    if (!all) {
+        idx = _PylibMC_ServerIndex(self,
+                memcached_server_get_last_disconnect(mc));
     }
+    if (idx >= 0 && (uint32_t)idx < res->nservers) {
+        res->failed[idx] = 1;
+        return;
+    }
+    for (i = 0; i < res->nservers; i++) {
+        memcached_server_instance_st server =
+            memcached_server_instance_by_position(mc, i);
+
+        if (server != NULL && memcached_server_response_count(server)) {
+            res->failed[i] = 1;
+            marked = true;
+        }
+    }
+#endif
+    if (!marked) {
+        memset(res->failed, 1, res->nservers);
+    }
+}
 
-    /* Clear potential previous exception, because we explicitly check for
-     * exceptions as a loop predicate. */
-    PyErr_Clear();
+/* (values, {server: [key, ...]}) for get_multi(partial=True), listing the
+ * keys that are not in `values` under the failed server they map to.
+ * Steals `values`. */
+static PyObject *_PylibMC_PartialResult(PylibMC_Client *self, PyObject *values,
+        pylibmc_mget_res *res, char **keys, size_t *key_lens, Py_ssize_t nkeys,
+        pylibmc_keyindex *index, pylibmc_key *key_objs) {
+    PyObject *failed = PyDict_New();
+    Py_ssize_t i;
 
-    key_str_map = _PylibMC_map_str_keys(key_seq, orig_key_objs, &orig_nkeys);
-    if (key_str_map == NULL) {
-        goto memory_cleanup;
+    if (failed == NULL) {
+        goto error;
     }
 
-    /* Iterate through all keys and set lengths etc. */
-    Py_ssize_t key_idx = 0;
-    for (i = 0; i < orig_nkeys; i++) {
-        PyObject *ckey = orig_key_objs[i];
-        char *key;
-        Py_ssize_t key_len;
-        Py_ssize_t final_key_len;
-        PyObject *rkey;
-
-        if (PyErr_Occurred() || !_key_normalized_obj(&ckey)) {
-            nkeys = key_idx;
-            goto earlybird;
+    for (i = 0; res->failed != NULL && i < nkeys; i++) {
+        uint32_t idx = memcached_generate_hash(self->mc, keys[i], key_lens[i]);
+        pylibmc_key *k;
+        PyObject *server, *server_keys;
+        int found;
+
+        if (idx >= res->nservers || !res->failed[idx]) {
+            continue;
+        }
+        k = _PylibMC_KeyIndexLookup(index, key_objs, keys[i], key_lens[i]);
+        if (k == NULL || (found = PyDict_Contains(values, k->obj)) == 1) {
+            continue;
+        } else if (found == -1) {
+            goto error;
+        }
+
+        if ((server = _PylibMC_ServerName(self, idx)) == NULL) {
+            goto error;
+        }
+        server_keys = PyDict_GetItemWithError(failed, server);
+        if (server_keys == NULL) {
+            if (PyErr_Occurred()
+                    || (server_keys = PyList_New(0)) == NULL
+                    || PyDict_SetItem(failed, server, server_keys) == -1) {
+                Py_XDECREF(server_keys);
+                Py_DECREF(server);
+                goto error;
+            }
+            Py_DECREF(server_keys);
         }
+        Py_DECREF(server);
+        if (PyList_Append(server_keys, k->obj) == -1) {
+            goto error;
+        }
+    }
+
+    return Py_BuildValue("(NN)", values, failed);
+
+error:
+    Py_DECREF(values);
+    Py_XDECREF(failed);
+    return NULL;
+}
 
-        /* Normalization created an owned reference to ckey */
+static void _free_multi_result(pylibmc_mget_res res) {
+    if (res.results == NULL)
+        return;
+    for (Py_ssize_t i = 0; i < res.nresults; i++) {
+        memcached_result_free(&res.results[i]);
+    }
+    PyMem_RawDel(res.results);
+}
+
+static PyObject *PylibMC_Client_get_multi(
+        PylibMC_Client *self, PyObject *args, PyObject *kwds) {
+    PyObject *key_seq, *retval = NULL;
+    char **keys = NULL, *prefix = NULL;
+    Py_ssize_t prefix_len = 0;
+    Py_ssize_t i;
+    size_t *key_lens = NULL;
+    Py_ssize_t nkeys = 0, orig_nkeys = 0;
+    Py_ssize_t prefixed_size = 0;
+    pylibmc_key *key_objs = NULL;
+    pylibmc_keyindex index = { NULL };
+    pylibmc_keybuf prefixed = { NULL };
+    pylibmc_mget_req req;
+    pylibmc_mget_res res = { 0 };
+    PyObject *deadline = NULL;
+    double deadline_secs = 0.0;
+    int partial = 0;
 
-        PyBytes_AsStringAndSize(ckey, &key, &key_len);
+    static char *kws[] = { "keys", "key_prefix", "deadline", "partial", NULL };
+
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s#Op:get_multi", kws,
+            &key_seq, &prefix, &prefix_len, &deadline, &partial))
+        return NULL;
+
+    if (deadline != NULL && deadline != Py_None) {
+        deadline_secs = PyFloat_AsDouble(deadline);
+        if (deadline_secs == -1.0 && PyErr_Occurred())
+            return NULL;
+    }
+
+    orig_nkeys = _PylibMC_NormalizeKeys(self, key_seq, prefix, prefix_len,
+                                        &key_objs, &prefixed);
+    if (orig_nkeys == -1)
+        return NULL;
+
+    /* Populate keys and key_lens. */
+    keys = PyMem_New(char *, orig_nkeys);
+    key_lens = PyMem_New(size_t, (size_t) orig_nkeys);
+    if (!keys || !key_lens) {
+        PyErr_NoMemory();
+        goto earlybird;
+    }
 
-        final_key_len = (Py_ssize_t)(key_len + prefix_len);
+    /* Iterate through all keys and set lengths etc. */
+    for (i = 0; i < orig_nkeys; i++) {
+        pylibmc_key *k = &key_objs[i];
 
-        /* Skip empty keys */
-        if (!final_key_len) {
-            Py_DECREF(ckey);
+        /* Skip empty keys; prefixed ones already count the prefix. */
+        if (!(k->key_len + prefix_len)) {
             continue;
         }
 
-        /* Determine rkey, the prefixed ckey */
-        if (prefix != NULL) {
-            rkey = PyBytes_FromStringAndSize(prefix, prefix_len);
-            PyBytes_Concat(&rkey, ckey);
-            if (rkey == NULL)
-                goto earlybird;
-            Py_DECREF(rkey);
-            rkey = PyBytes_FromFormat("%s%s",
-                    prefix, PyBytes_AS_STRING(ckey));
-        } else {
-            Py_INCREF(ckey);
-            rkey = ckey;
+        /* memcached_mget would refuse the whole batch, so fail early. */
+        if (k->key == NULL) {
+            PylibMC_ErrFromMemcached(self, "memcached_mget",
+                                     MEMCACHED_BAD_KEY_PROVIDED);
+            goto earlybird;
         }
-        Py_DECREF(ckey);
 
-        keys[key_idx] = PyBytes_AS_STRING(rkey);
-        key_objs[key_idx] = rkey;
-        key_lens[key_idx] = final_key_len;
-        key_idx++;
-        /* we've added a total of 1 ref, to rkey */
+        keys[nkeys] = k->key;
+        key_lens[nkeys] = k->key_len;
+        nkeys++;
+        prefixed_size += k->key_len;
     }
-    nkeys = key_idx;
 
     if (nkeys == 0) {
         retval = PyDict_New();
-        goto earlybird;
-    } else if (PyErr_Occurred()) {
-        nkeys--;
+        if (partial && retval != NULL) {
+            retval = Py_BuildValue("(N{})", retval);
+        }
         goto earlybird;
     }
 
+    if (!_PylibMC_KeyIndexInit(&index, key_objs, orig_nkeys))
+        goto earlybird;
+
     req.keys = keys;
     req.nkeys = (ssize_t) nkeys;
     req.key_lens = key_lens;
-
+    req.instrumented = _PylibMC_Instrumented(self);
+    req.counters = req.instrumented ? _PylibMC_Counters(self) : NULL;
+    req.deadline = 0;
+    req.partial = partial != 0;
+    if (deadline != NULL && deadline != Py_None) {
+        /* Counted from here, after the keys have been prepared. */
+        req.deadline = _PylibMC_Now()
+                     + (deadline_secs > 0.0 ? (uint64_t)(deadline_secs * 1e9) : 0);
+    }
+
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (req.instrumented) {
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_GET_MULTI, nkeys,
+                                   NULL, 0);
+    }
     Py_BEGIN_ALLOW_THREADS;
-    res = _fetch_multi(self->mc, req);
+    res = _fetch_multi(self, req);
     Py_END_ALLOW_THREADS;
+    if (req.instrumented) {
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_GET_MULTI, started);
+        _PylibMC_TraceEnd(self, span, res.rc, prefixed_size,
+                          span != NULL ? _PylibMC_ResultBytes(&res) : 0);
+        if (self->sampler != NULL) {
+            for (i = 0; i < nkeys; i++) {
+                _PylibMC_SampleKey(self, keys[i], key_lens[i]);
+            }
+            for (i = 0; i < res.nresults; i++) {
+                memcached_result_st *result = &res.results[i];
+
+                _PylibMC_SampleValue(self, memcached_result_key_value(result),
+                                     memcached_result_key_length(result),
+                                     memcached_result_length(result));
+            }
+        }
+    }
 
     if (res.rc != MEMCACHED_SUCCESS) {
         PylibMC_ErrFromMemcached(self, res.err_func, res.rc);
@@ -1807,20 +2962,24 @@ static PyObject *PylibMC_Client_get_multi(
     for (i = 0; i < res.nresults; i++) {
         PyObject *val, *key_obj;
         memcached_result_st *result = &(res.results[i]);
+        const char *key = memcached_result_key_value(result);
+        Py_ssize_t key_len = memcached_result_key_length(result);
+        pylibmc_key *k;
         int rc;
 
-        /* Long-winded, but this way we can handle NUL-bytes in keys. */
-        key_obj = PyBytes_FromStringAndSize(memcached_result_key_value(result) + prefix_len,
-                                             memcached_result_key_length(result) - prefix_len);
-        if (key_obj == NULL)
-            goto loopcleanup;
-
-        if (PyDict_Contains(key_str_map, key_obj)) {
-            temp_key_obj = key_obj;
-            key_obj = PyDict_GetItem(key_str_map, temp_key_obj);
-            /* PyDict_GetItem borrows a reference; own it for consistency */
+        /* Hand back the very key object the caller gave us. The index holds
+         * the keys as sent, prefixed and mapped. */
+        if ((k = _PylibMC_KeyIndexLookup(&index, key_objs, key, key_len)) != NULL) {
+            key_obj = k->obj;
             Py_INCREF(key_obj);
-            Py_DECREF(temp_key_obj);
+        } else if (key_len >= prefix_len && !memcmp(key, prefix, prefix_len)) {
+            /* Long-winded, but this way we can handle NUL-bytes in keys. */
+            key_obj = PyBytes_FromStringAndSize(key + prefix_len,
+                                                key_len - prefix_len);
+            if (key_obj == NULL)
+                goto loopcleanup;
+        } else {
+            continue;
         }
 
         /* Parse out value */
@@ -1829,8 +2988,10 @@ static PyObject *PylibMC_Client_get_multi(
             Py_DECREF(key_obj);
             continue;
         }
-        else if (val == NULL)
+        else if (val == NULL) {
+            Py_DECREF(key_obj);
             goto loopcleanup;
+        }
 
         rc = PyDict_SetItem(retval, key_obj, val);
         /* clean up our local owned references (now that rc has its own) */
@@ -1848,132 +3009,23 @@ loopcleanup:
         break;
     }
 
+    if (partial && retval != NULL) {
+        retval = _PylibMC_PartialResult(self, retval, &res, keys, key_lens,
+                                        nkeys, &index, key_objs);
+    }
+
 earlybird:
-    for (i = 0; i < orig_nkeys; i++)
-        Py_DECREF(orig_key_objs[i]);
-    for (i = 0; i < nkeys; i++)
-        Py_DECREF(key_objs[i]);
-    Py_XDECREF(key_str_map);
-
-memory_cleanup:
-    PyMem_Free(key_objs);
+    _PylibMC_FreeKeys(key_objs, orig_nkeys);
+    _PylibMC_KeyIndexFree(&index);
+    _PylibMC_KeyBufFree(&prefixed);
     PyMem_Free(key_lens);
     PyMem_Free(keys);
-    PyMem_Free(orig_key_objs);
+    PyMem_RawFree(res.failed);
     _free_multi_result(res);
 
     return retval;
 }
 
-/**
- * Run func over every item in value, building arguments of:
- *     *(item + extra_args)
- */
-static PyObject *_PylibMC_DoMulti(PyObject *values, PyObject *func,
-        PyObject *prefix, PyObject *extra_args) {
-    /* TODO: acquire/release the GIL only once per DoMulti rather than
-       once per action; fortunately this is only used for
-       delete_multi, which isn't used very often */
-
-    PyObject *retval = PyList_New(0);
-    PyObject *iter = NULL;
-    PyObject *item = NULL;
-    PyObject *orig_item = NULL;
-    int is_mapping = PyDict_Check(values);
-
-    if (retval == NULL)
-        goto cleanup;
-
-    if ((iter = PyObject_GetIter(values)) == NULL)
-        goto cleanup;
-
-    while ((orig_item = item = PyIter_Next(iter)) != NULL) {
-        PyObject *args_f = NULL;
-        PyObject *args = NULL;
-        PyObject *key = NULL;
-        PyObject *ro = NULL;
-
-        /**
-         * Calculate key.
-         *
-         * prefix is already converted to a byte string, so ensure that
-         * the key is of the same type before trying to append.
-         */
-        if (!_key_normalized_obj(&item))
-            goto loopcleanup;
-        if (prefix == NULL || prefix == Py_None) {
-            key = item;
-            Py_INCREF(key);
-        } else {
-            PyObject *concat_key = key = PySequence_Concat(prefix, item);
-            /**
-             * Another call to _key_normalized_obj is still a good idea since
-             * we might have created a key that's too long
-             */
-            if (key == NULL || !_key_normalized_obj(&key))
-                goto loopcleanup;
-            /* Normalization created a new ref to key; clean up the temporary ref. */
-            Py_DECREF(concat_key);
-        }
-
-        /* Calculate args. */
-        if (is_mapping) {
-            PyObject *value;
-            char *key_str = PyBytes_AS_STRING(item);
-
-            if ((value = PyMapping_GetItemString(values, key_str)) == NULL)
-                goto loopcleanup;
-
-            args = PyTuple_Pack(2, key, value);
-            Py_DECREF(value);
-        } else {
-            args = PyTuple_Pack(1, key);
-        }
-        if (args == NULL)
-            goto loopcleanup;
-
-        /* Calculate full argument tuple. */
-        if (extra_args == NULL) {
-            Py_INCREF(args);
-            args_f = args;
-        } else {
-            if ((args_f = PySequence_Concat(args, extra_args)) == NULL)
-                goto loopcleanup;
-        }
-
-        /* Call stuff. */
-        ro = PyObject_CallObject(func, args_f);
-        /* This is actually safe even if True got deleted because we're
-         * only comparing addresses. */
-        Py_XDECREF(ro);
-        if (ro == NULL) {
-            goto loopcleanup;
-        } else if (ro != Py_True) {
-            if (PyList_Append(retval, item) != 0)
-                goto loopcleanup;
-        }
-        Py_DECREF(args_f);
-        Py_DECREF(args);
-        Py_DECREF(key);
-        Py_DECREF(item);
-        Py_DECREF(orig_item);
-        continue;
-loopcleanup:
-        Py_XDECREF(args_f);
-        Py_XDECREF(args);
-        Py_XDECREF(key);
-        Py_DECREF(item);
-        goto cleanup;
-    }
-    Py_DECREF(iter);
-
-    return retval;
-cleanup:
-    Py_XDECREF(retval);
-    Py_XDECREF(iter);
-    return NULL;
-}
-
 static PyObject *PylibMC_Client_set_multi(PylibMC_Client *self, PyObject *args,
         PyObject *kwds) {
   return _PylibMC_RunSetCommandMulti(self, memcached_set, "memcached_set_multi",
@@ -1988,24 +3040,31 @@ static PyObject *PylibMC_Client_add_multi(PylibMC_Client *self, PyObject *args,
 
 static PyObject *PylibMC_Client_delete_multi(PylibMC_Client *self,
         PyObject *args, PyObject *kwds) {
-    const char *prefix_raw = NULL;
-    Py_ssize_t prefix_len;
-    PyObject *prefix = NULL;
-    PyObject *delete;
+    const char *prefix = NULL;
+    Py_ssize_t prefix_len = 0;
     PyObject *keys;
-    PyObject *retval;
+    PyObject *retval = NULL;
+    pylibmc_key *key_objs = NULL;
+    pylibmc_key *failed_key = NULL;
+    pylibmc_keybuf prefixed = { NULL };
+    Py_ssize_t i, nkeys, prefixed_size = 0;
+    memcached_return rc = MEMCACHED_SUCCESS, soft_rc = MEMCACHED_SUCCESS;
+    bool softerrors = false,
+         harderrors = false;
 
     static char *kws[] = { "keys", "key_prefix", NULL };
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s#:delete_multi", kws,
-                                     &keys, &prefix_raw, &prefix_len))
+                                     &keys, &prefix, &prefix_len))
         return NULL;
 
     /**
-     * Prohibit use of mappings, otherwise DoMulti interprets the values of
-     * such mappings as the 2nd argument to the delete function, e.g.
-     * DoMulti({"a": 1, "b": 2}) calls delete("a", 1) and delete("b", 2), which
-     * is nonsense.
+     * Prohibit use of mappings, as the values of such mappings might be
+     * mistaken for the 2nd argument to the delete function.
      */
     if (PyDict_Check(keys)) {
         PyErr_SetString(PyExc_TypeError,
@@ -2013,29 +3072,155 @@ static PyObject *PylibMC_Client_delete_multi(PylibMC_Client *self,
         return NULL;
     }
 
-    if (prefix_raw != NULL)
-        prefix = PyBytes_FromStringAndSize(prefix_raw, prefix_len);
-
-    if ((delete = PyObject_GetAttrString((PyObject *)self, "delete")) == NULL)
+    nkeys = _PylibMC_NormalizeKeys(self, keys, prefix, prefix_len, &key_objs,
+                                   &prefixed);
+    if (nkeys == -1)
         return NULL;
 
-    retval = _PylibMC_DoMulti(keys, delete, prefix, NULL);
+    for (i = 0; i < nkeys; i++) {
+        prefixed_size += key_objs[i].key_len;
+    }
 
-    Py_DECREF(delete);
-    Py_XDECREF(prefix);
+    bool instrumented = _PylibMC_Instrumented(self);
+    pylibmc_server_counters *counters = NULL;
+    pylibmc_server_timing *timings = NULL;
+    uint64_t started = 0;
+    PyObject *span = NULL;
+    if (instrumented) {
+        counters = _PylibMC_Counters(self);
+        timings = _PylibMC_Timings(self);
+        started = _PylibMC_LatencyStart(self);
+        span = _PylibMC_TraceStart(self, PYLIBMC_OP_DELETE_MULTI, nkeys,
+                                   NULL, 0);
+    }
+    Py_BEGIN_ALLOW_THREADS;
 
-    if (retval == NULL)
-        return NULL;
+    for (i = 0; i < nkeys && !harderrors; i++) {
+        pylibmc_key *k = &key_objs[i];
 
-    if (PyList_Size(retval) == 0) {
-        Py_DECREF(retval);
-        retval = Py_True;
+        /* Keys rejected by verify_keys never reach libmemcached. */
+        if (k->key == NULL) {
+            soft_rc = MEMCACHED_BAD_KEY_PROVIDED;
+            softerrors = true;
+            continue;
+        }
+
+        pylibmc_server_counters *c = NULL;
+        pylibmc_server_timing *t = NULL;
+        if (instrumented) {
+            c = _PylibMC_CounterFor(self, counters, k->key, k->key_len);
+            t = _PylibMC_TimeoutFor(self, timings, k->key, k->key_len);
+            _PylibMC_CountSent(c, k->key_len);
+        }
+        rc = memcached_delete(self->mc, k->key, k->key_len, 0);
+        if (instrumented) {
+            _PylibMC_TimeoutDone(self, t, rc);
+            _PylibMC_CountDone(c, rc, 0);
+        }
+
+        switch (rc) {
+            case MEMCACHED_SUCCESS:
+                break;
+            case MEMCACHED_FAILURE:
+            case MEMCACHED_NOTFOUND:
+            case MEMCACHED_NO_KEY_PROVIDED:
+            case MEMCACHED_BAD_KEY_PROVIDED:
+                soft_rc = rc;
+                softerrors = true;
+                break;
+            default:
+                failed_key = k;
+                harderrors = true;
+                break;
+        }
+    }
+
+    Py_END_ALLOW_THREADS;
+    if (instrumented) {
+        _PylibMC_LatencyRecord(self, PYLIBMC_OP_DELETE_MULTI, started);
+        _PylibMC_TraceEnd(self, span,
+                          harderrors ? rc : softerrors ? soft_rc
+                                                       : MEMCACHED_SUCCESS,
+                          prefixed_size, 0);
+    }
+
+    if (harderrors) {
+        PylibMC_ErrFromMemcachedWithKey(self, "memcached_delete", rc,
+                                        failed_key->key, failed_key->key_len);
     } else {
-        Py_DECREF(retval);
-        retval = Py_False;
+        retval = PyBool_FromLong(!softerrors);
+    }
+
+    _PylibMC_KeyBufFree(&prefixed);
+    _PylibMC_FreeKeys(key_objs, nkeys);
+
+    return retval;
+}
+
+static PyObject *PylibMC_Client_route_multi(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    const char *prefix = NULL;
+    Py_ssize_t prefix_len = 0;
+    PyObject *keys;
+    PyObject *retval = NULL;
+    pylibmc_key *key_objs = NULL;
+    pylibmc_keybuf prefixed = { NULL };
+    uint32_t *servers = NULL;
+    Py_ssize_t i, nkeys;
+
+    static char *kws[] = { "keys", "key_prefix", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s#:route_multi", kws,
+                                     &keys, &prefix, &prefix_len))
+        return NULL;
+
+    /* Prefixed and mapped as delete_multi and friends send them. */
+    nkeys = _PylibMC_NormalizeKeys(self, keys, prefix, prefix_len, &key_objs,
+                                   &prefixed);
+    if (nkeys == -1)
+        return NULL;
+
+    if ((servers = PyMem_New(uint32_t, nkeys ? nkeys : 1)) == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    /* memcached_generate_hash leaves ejected servers be until the next
+     * request rebuilds the continuum, and the call that would rebuild it
+     * is private to libmemcached; the docs say so. */
+    Py_BEGIN_ALLOW_THREADS;
+    for (i = 0; i < nkeys; i++) {
+        pylibmc_key *k = &key_objs[i];
+
+        if (k->key != NULL && k->key_len) {
+            servers[i] = memcached_generate_hash(self->mc, k->key, k->key_len);
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    if ((retval = PyList_New(nkeys)) == NULL)
+        goto cleanup;
+
+    for (i = 0; i < nkeys; i++) {
+        pylibmc_key *k = &key_objs[i];
+        PyObject *server;
+
+        /* Keys that would never be sent go nowhere. */
+        if (k->key == NULL || !k->key_len) {
+            Py_INCREF(Py_None);
+            server = Py_None;
+        } else if ((server = PyLong_FromUnsignedLong(servers[i])) == NULL) {
+            Py_CLEAR(retval);
+            goto cleanup;
+        }
+        PyList_SET_ITEM(retval, i, server);
     }
 
-    Py_INCREF(retval);
+cleanup:
+    PyMem_Free(servers);
+    _PylibMC_KeyBufFree(&prefixed);
+    _PylibMC_FreeKeys(key_objs, nkeys);
+
     return retval;
 }
 
@@ -2054,6 +3239,28 @@ static PyObject *PylibMC_Client_get_behaviors(PylibMC_Client *self) {
         case PYLIBMC_BEHAVIOR_PICKLE_PROTOCOL:
             bval = self->pickle_protocol;
             break;
+        case PYLIBMC_BEHAVIOR_HASH_LONG_KEYS:
+            bval = self->hash_long_keys;
+            break;
+        case PYLIBMC_BEHAVIOR_CHUNK_SIZE:
+            bval = self->chunk_size;
+            break;
+        case PYLIBMC_BEHAVIOR_LATENCY_HISTOGRAMS:
+            bval = self->latency != NULL;
+            break;
+        case PYLIBMC_BEHAVIOR_SERVER_COUNTERS:
+            bval = self->count_servers;
+            break;
+        case PYLIBMC_BEHAVIOR_KEY_SAMPLING:
+            bval = self->sampler != NULL ? self->sampler->rate : 0;
+            break;
+        case PYLIBMC_BEHAVIOR_ADAPTIVE_TIMEOUT:
+            bval = self->adaptive_timeout;
+            break;
+        case MEMCACHED_BEHAVIOR_DISTRIBUTION:
+            bval = self->distribution ? self->distribution
+                 : memcached_behavior_get(self->mc, b->flag);
+            break;
         default:
             bval = memcached_behavior_get(self->mc, b->flag);
         }
@@ -2081,6 +3288,10 @@ static PyObject *PylibMC_Client_set_behaviors(PylibMC_Client *self,
     memcached_return r;
     char *key;
 
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
     for (b = PylibMC_behaviors; b->name != NULL; b++) {
         if (behaviors == Py_None || !PyMapping_HasKeyString(behaviors, b->name)) {
             continue;
@@ -2099,6 +3310,40 @@ static PyObject *PylibMC_Client_set_behaviors(PylibMC_Client *self,
         case PYLIBMC_BEHAVIOR_PICKLE_PROTOCOL:
             self->pickle_protocol = v;
             break;
+        case PYLIBMC_BEHAVIOR_HASH_LONG_KEYS:
+            self->hash_long_keys = v != 0;
+            break;
+        case PYLIBMC_BEHAVIOR_CHUNK_SIZE:
+            if (v < 0 || (unsigned long)v > UINT32_MAX) {
+                PyErr_Format(PyExc_ValueError,
+                             "behavior 'chunk_size' = %ld out of range", v);
+                goto error;
+            }
+            self->chunk_size = (uint32_t)v;
+            break;
+        case PYLIBMC_BEHAVIOR_LATENCY_HISTOGRAMS:
+            if (!_PylibMC_LatencyEnable(self, v != 0)) {
+                goto error;
+            }
+            break;
+        case PYLIBMC_BEHAVIOR_SERVER_COUNTERS:
+            _PylibMC_CountersEnable(self, v != 0);
+            break;
+        case PYLIBMC_BEHAVIOR_KEY_SAMPLING:
+            if (!_PylibMC_SamplerEnable(self, v)) {
+                goto error;
+            }
+            break;
+        case PYLIBMC_BEHAVIOR_ADAPTIVE_TIMEOUT:
+            if (!_PylibMC_TimingsEnable(self, v)) {
+                goto error;
+            }
+            break;
+        case MEMCACHED_BEHAVIOR_DISTRIBUTION:
+            if (!_PylibMC_SetDistribution(self, v)) {
+                goto error;
+            }
+            break;
         default:
             r = memcached_behavior_set(self->mc, b->flag, (uint64_t)v);
             if (r != MEMCACHED_SUCCESS) {
@@ -2133,6 +3378,10 @@ static PyObject *PylibMC_Client_set_behaviors(PylibMC_Client *self,
         }
     }
 
+    /* The hash or distribution may have changed. */
+    if (!_PylibMC_BucketsUpdate(self)) {
+        return NULL;
+    }
     Py_RETURN_NONE;
 error:
     return NULL;
@@ -2165,164 +3414,2750 @@ _PylibMC_AddServerCallback(memcached_st *mc,
     if (rc != MEMCACHED_SUCCESS)
         return rc;
 
-    for (curr_key = stat_keys; *curr_key; curr_key++) {
-        PyObject *curr_value;
-        char *mc_val;
-        int fail;
+    for (curr_key = stat_keys; *curr_key; curr_key++) {
+        PyObject *curr_value;
+        char *mc_val;
+        int fail;
+
+        mc_val = memcached_stat_get_value(mc, stat, *curr_key, &rc);
+        if (rc != MEMCACHED_SUCCESS) {
+            PylibMC_ErrFromMemcached(self, "get_stats val", rc);
+            goto error;
+        }
+
+        curr_value = _PylibMC_StatValue(mc_val, strlen(mc_val), context->typed);
+        free(mc_val);
+        if (curr_value == NULL)
+            goto error;
+
+        fail = PyDict_SetItemString(val, *curr_key, curr_value);
+        Py_DECREF(curr_value);
+        if (fail)
+            goto error;
+    }
+
+    free(stat_keys);
+
+    desc = PyBytes_FromFormat("%s:%d (%u)",
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+            memcached_server_name(instance), memcached_server_port(instance),
+#else /* ver < libmemcached 0.39 */
+            server->hostname, server->port,
+#endif
+            (unsigned int)context->index);
+
+    PyList_SET_ITEM(context->retval, context->index++,
+                    Py_BuildValue("NN", desc, val));
+
+    return MEMCACHED_SUCCESS;
+
+error:
+    free(stat_keys);
+    Py_DECREF(val);
+    return MEMCACHED_FAILURE;
+}
+
+/* A stat as bytes, or with `typed`, as an int or float if it reads as one
+ * and otherwise as str. */
+static PyObject *_PylibMC_StatValue(const char *val, Py_ssize_t len,
+                                    int typed) {
+    char buf[64], *end;
+
+    if (!typed) {
+        return PyBytes_FromStringAndSize(val, len);
+    }
+
+    if (len > 0 && len < (Py_ssize_t)sizeof(buf)) {
+        long long i;
+        double d;
+
+        memcpy(buf, val, len);
+        buf[len] = '\0';
+        errno = 0;
+        i = strtoll(buf, &end, 10);
+        if (*end == '\0' && errno == 0) {
+            return PyLong_FromLongLong(i);
+        }
+        if (buf[0] != '-') {
+            unsigned long long u = strtoull(buf, &end, 10);
+            if (*end == '\0' && errno == 0) {
+                return PyLong_FromUnsignedLongLong(u);
+            }
+        }
+        d = strtod(buf, &end);
+        if (*end == '\0' && strchr(buf, '.') != NULL) {
+            return PyFloat_FromDouble(d);
+        }
+    }
+    return PyUnicode_DecodeUTF8(val, len, "replace");
+}
+
+#if LIBMEMCACHED_VERSION_HEX >= 0x00044000
+/* Called by memcached_stat_execute for each stat of each server, without
+ * the GIL. */
+static memcached_return _PylibMC_StatCallback(
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000017
+        const memcached_instance_st *instance,
+#else
+        memcached_server_instance_st instance,
+#endif
+        const char *key, size_t key_len, const char *value, size_t value_len,
+        void *user) {
+    _PylibMC_StatsContext *context = (_PylibMC_StatsContext *)user;
+    PylibMC_Client *self = (PylibMC_Client *)context->self;
+    memcached_return rc = MEMCACHED_FAILURE;
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyObject *item, *k = NULL, *v = NULL;
+    int idx;
+
+    if (PyErr_Occurred()) {
+        goto done;
+    }
+
+    idx = _PylibMC_ServerIndex(self, (memcached_server_instance_st)instance);
+    if (idx < 0 || idx >= PyList_GET_SIZE(context->retval)) {
+        rc = MEMCACHED_SUCCESS;
+        goto done;
+    }
+
+    item = PyList_GET_ITEM(context->retval, idx);
+    k = PyUnicode_DecodeUTF8(key, key_len, "replace");
+    v = _PylibMC_StatValue(value, value_len, context->typed);
+    if (k != NULL && v != NULL
+            && PyDict_SetItem(PyTuple_GET_ITEM(item, 1), k, v) == 0) {
+        rc = MEMCACHED_SUCCESS;
+    }
+
+done:
+    Py_XDECREF(k);
+    Py_XDECREF(v);
+    PyGILState_Release(gil);
+    return rc;
+}
+
+/* get_stats for a stats subcommand, e.g. "slabs" or "settings", whose stats
+ * don't fit memcached_stat_st: each server's as they come. */
+static PyObject *_PylibMC_GetStatsOf(PylibMC_Client *self, const char *mc_args,
+                                     int typed) {
+    _PylibMC_StatsContext context = { 0 };
+    memcached_return rc;
+    uint32_t i, nservers = memcached_server_count(self->mc);
+
+    context.self = (PyObject *)self;
+    context.typed = typed;
+    if ((context.retval = PyList_New(nservers)) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < nservers; i++) {
+        PyObject *item = Py_BuildValue("(N{})",
+            PyBytes_FromFormat("%s:%d (%u)",
+                memcached_server_name(memcached_server_instance_by_position(self->mc, i)),
+                memcached_server_port(memcached_server_instance_by_position(self->mc, i)),
+                (unsigned int)i));
+        if (item == NULL) {
+            Py_DECREF(context.retval);
+            return NULL;
+        }
+        PyList_SET_ITEM(context.retval, i, item);
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    rc = memcached_stat_execute(self->mc, mc_args,
+                                (memcached_stat_fn)_PylibMC_StatCallback,
+                                (void *)&context);
+    Py_END_ALLOW_THREADS;
+
+    if (PyErr_Occurred()) {
+        Py_CLEAR(context.retval);
+    } else if (rc != MEMCACHED_SUCCESS) {
+        Py_CLEAR(context.retval);
+        PylibMC_ErrFromMemcached(self, "get_stats", rc);
+    }
+    return context.retval;
+}
+#endif
+
+static PyObject *PylibMC_Client_get_stats(PylibMC_Client *self,
+                                          PyObject *args, PyObject *kwds) {
+    memcached_stat_st *stats;
+    memcached_return rc;
+    char *mc_args;
+    int typed = 0;
+    Py_ssize_t nservers;
+    _PylibMC_StatsContext context;
+#if LIBMEMCACHED_VERSION_HEX >= 0x00038000
+    memcached_server_function callbacks[] = {
+        (memcached_server_function)_PylibMC_AddServerCallback
+    };
+#endif
+    static char *kws[] = { "args", "typed", NULL };
+
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    mc_args = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zp:get_stats", kws,
+                                     &mc_args, &typed))
+        return NULL;
+
+#if LIBMEMCACHED_VERSION_HEX >= 0x00044000
+    if (mc_args != NULL && *mc_args) {
+        return _PylibMC_GetStatsOf(self, mc_args, typed);
+    }
+#endif
+
+    Py_BEGIN_ALLOW_THREADS;
+    stats = memcached_stat(self->mc, mc_args, &rc);
+    Py_END_ALLOW_THREADS;
+    if (rc != MEMCACHED_SUCCESS)
+        return PylibMC_ErrFromMemcached(self, "get_stats", rc);
+
+    /** retval contents:
+     * [('<addr, 127.0.0.1:11211> (<num, 1>)', {stat: stat, stat: stat}),
+     *  (str, dict),
+     *  (str, dict)]
+     */
+    nservers = (Py_ssize_t)memcached_server_count(self->mc);
+
+    /* Setup stats callback context */
+    context.self = (PyObject *)self;
+    context.retval = PyList_New(nservers);
+    context.stats = stats;
+    context.servers = NULL;  /* DEPRECATED */
+    context.index = 0;
+    context.typed = typed;
+
+#if LIBMEMCACHED_VERSION_HEX >= 0x00038000
+    rc = memcached_server_cursor(self->mc, callbacks, (void *)&context, 1);
+#else /* ver < libmemcached 0.38 */
+    context.servers = memcached_server_list(self->mc);
+
+    for (; context.index < nservers; context.index++) {
+        memcached_server_st *server = context.servers + context.index;
+        memcached_return rc;
+
+        rc = _PylibMC_AddServerCallback(self->mc, server, (void *)&context);
+        if (rc != MEMCACHED_SUCCESS)
+            break;
+    }
+#endif
+
+    if (rc != MEMCACHED_SUCCESS) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "unknown error occured");
+        Py_DECREF(context.retval);
+        context.retval = NULL;
+    }
+
+    free(context.stats);
+
+    return context.retval;
+}
+
+static PyObject *PylibMC_Client_flush_all(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    memcached_return rc;
+    time_t expire = 0;
+    PyObject *time = NULL;
+
+    static char *kws[] = { "time", NULL };
+
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O!:flush_all", kws,
+                                     &PyLong_Type, &time))
+        return NULL;
+
+    if (time != NULL)
+        expire = PyLong_AS_LONG(time);
+
+    expire = (expire > 0) ? expire : 0;
+
+    Py_BEGIN_ALLOW_THREADS;
+    rc = memcached_flush(self->mc, expire);
+    Py_END_ALLOW_THREADS;
+    if (rc != MEMCACHED_SUCCESS)
+        return PylibMC_ErrFromMemcached(self, "flush_all", rc);
+
+    Py_RETURN_TRUE;
+}
+
+static PyObject *PylibMC_Client_disconnect_all(PylibMC_Client *self) {
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    memcached_quit(self->mc);
+    Py_END_ALLOW_THREADS;
+    _PylibMC_MetaReset(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *PylibMC_Client_connect_all(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    PyObject *timeout = Py_None, *failed;
+    double secs = 0.0;
+    uint64_t connect_timeout = 0, poll_timeout = 0;
+    uint32_t i, nservers;
+    static char *kws[] = { "timeout", NULL };
+
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:connect_all", kws,
+                                     &timeout)) {
+        return NULL;
+    }
+    if (timeout != Py_None) {
+        secs = PyFloat_AsDouble(timeout);
+        if (secs == -1.0 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (secs <= 0.0) {
+            PyErr_SetString(PyExc_ValueError, "timeout must be positive");
+            return NULL;
+        }
+    }
+    if ((failed = PyList_New(0)) == NULL) {
+        return NULL;
+    }
+    /* UDP has no connections to open. */
+    if (memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_USE_UDP)) {
+        return failed;
+    }
+
+    nservers = memcached_server_count(self->mc);
+    Py_BEGIN_ALLOW_THREADS;
+    if (timeout != Py_None) {
+        uint64_t ms = secs < 0.001 ? 1 : (uint64_t)(secs * 1000.0);
+
+        connect_timeout = memcached_behavior_get(self->mc,
+                MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT);
+        poll_timeout = memcached_behavior_get(self->mc,
+                MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, ms);
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, ms);
+    }
+    /* Asking each server for its version connects to it. libmemcached only
+     * asks those it has no version of since they last connected. */
+    memcached_version(self->mc);
+    if (timeout != Py_None) {
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
+                               connect_timeout);
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                               poll_timeout);
+    }
+    Py_END_ALLOW_THREADS;
+
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000000
+    for (i = 0; i < nservers; i++) {
+        memcached_server_instance_st instance =
+            memcached_server_instance_by_position(self->mc, i);
+        PyObject *idx;
+
+        if (memcached_server_major_version(instance) != UINT8_MAX) {
+            continue;
+        }
+        if ((idx = PyLong_FromUnsignedLong(i)) == NULL
+                || PyList_Append(failed, idx) == -1) {
+            Py_XDECREF(idx);
+            Py_DECREF(failed);
+            return NULL;
+        }
+        Py_DECREF(idx);
+    }
+#else
+    (void)i;
+    (void)nservers;
+#endif
+    return failed;
+}
+
+static PyObject *PylibMC_Client_clone(PylibMC_Client *self) {
+    /* Essentially this is a reimplementation of the allocator, only it uses a
+     * cloned memcached_st for mc. */
+    PylibMC_Client *clone;
+
+    clone = (PylibMC_Client *)PyType_GenericNew(Py_TYPE(self), NULL, NULL);
+    if (clone == NULL) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    clone->mc = memcached_clone(NULL, self->mc);
+    Py_END_ALLOW_THREADS;
+    if (clone->mc == NULL) {
+        Py_DECREF(clone);
+        return PyErr_NoMemory();
+    }
+    clone->forks = PylibMC_forks;
+    clone->native_serialization = self->native_serialization;
+    clone->native_deserialization = self->native_deserialization;
+    clone->pickle_protocol = self->pickle_protocol;
+    clone->hash_long_keys = self->hash_long_keys;
+    clone->chunk_size = self->chunk_size;
+    /* The clone counts and records on its own, starting afresh. */
+    clone->count_servers = self->count_servers;
+    clone->adaptive_timeout = self->adaptive_timeout;
+    _PylibMC_InstrumentedUpdate(clone);
+    /* memcached_clone has copied the servers, behaviors and credentials
+     * into clone->mc, and rebuilt any continuum; libmemcached can't share
+     * them. What pylibmc keeps itself, the buckets and weights, is shared,
+     * as a client replaces these rather than modifies them. */
+    clone->distribution = self->distribution;
+    if ((clone->buckets = self->buckets) != NULL) {
+        clone->buckets->refcnt++;
+    }
+    Py_XINCREF(clone->weights = self->weights);
+    Py_XINCREF(clone->meta_auth = self->meta_auth);
+    if (!_PylibMC_BucketsApply(clone)) {
+        Py_DECREF(clone);
+        return NULL;
+    }
+    if ((self->latency != NULL && !_PylibMC_LatencyEnable(clone, true))
+            || (self->sampler != NULL
+                && !_PylibMC_SamplerEnable(clone, self->sampler->rate))) {
+        Py_DECREF(clone);
+        return NULL;
+    }
+    return (PyObject *)clone;
+}
+
+/* {{{ Instrumentation */
+/* Call whenever latency, count_servers, sampler or adaptive_timeout
+ * changes. */
+static void _PylibMC_InstrumentedUpdate(PylibMC_Client *self) {
+    self->instrumented = self->latency != NULL || self->count_servers
+                         || self->sampler != NULL || self->adaptive_timeout;
+}
+
+/* Whether a call is to run the hooks: the counters, adaptive timeouts,
+ * latency histograms, key sampling and tracing around it. Each call site
+ * asks once and runs all of them or none, so a client with all of them
+ * off, and no tracer set, pays this one branch. Needs no GIL. */
+static bool _PylibMC_Instrumented(PylibMC_Client *self) {
+    return self->instrumented | (PylibMC_tracer != NULL);
+}
+/* }}} */
+
+/* {{{ Latency histograms */
+static int _PylibMC_LatencyEnable(PylibMC_Client *self, int enable) {
+    if (!enable) {
+        PyMem_Free(self->latency);
+        self->latency = NULL;
+    } else if (self->latency == NULL) {
+        self->latency = PyMem_New(pylibmc_histogram, PYLIBMC_OP_COUNT);
+        if (self->latency == NULL) {
+            PyErr_NoMemory();
+            return false;
+        }
+        memset(self->latency, 0, PYLIBMC_OP_COUNT * sizeof(pylibmc_histogram));
+    }
+    _PylibMC_InstrumentedUpdate(self);
+    return true;
+}
+
+static uint64_t _PylibMC_Now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Call with the GIL held, before releasing it for libmemcached; pass the
+ * result on to _PylibMC_LatencyRecord once the call is done. Costs a branch
+ * when latency_histograms is off. */
+static uint64_t _PylibMC_LatencyStart(PylibMC_Client *self) {
+    return self->latency != NULL ? _PylibMC_Now() : 0;
+}
+
+static size_t _PylibMC_HistBucket(uint64_t v) {
+    int msb = 0;
+
+    if (v < 2 * PYLIBMC_HIST_SUB) {
+        return (size_t)v;
+    }
+    if (v >> PYLIBMC_HIST_MAX_BITS) {
+        v = ((uint64_t)1 << PYLIBMC_HIST_MAX_BITS) - 1;
+    }
+#if defined(__GNUC__)
+    msb = 63 - __builtin_clzll(v);
+#else
+    for (uint64_t w = v; w >>= 1; msb++);
+#endif
+    /* Keep the PYLIBMC_HIST_SUB_BITS bits below the most significant one. */
+    int shift = msb - PYLIBMC_HIST_SUB_BITS;
+    return (size_t)shift * PYLIBMC_HIST_SUB + (size_t)(v >> shift);
+}
+
+/* The highest value that lands in `bucket`, inverse of _PylibMC_HistBucket. */
+static uint64_t _PylibMC_HistBucketTop(size_t bucket) {
+    int shift;
+    uint64_t m;
+
+    if (bucket < 2 * PYLIBMC_HIST_SUB) {
+        return bucket;
+    }
+    shift = (int)(bucket / PYLIBMC_HIST_SUB) - 1;
+    m = bucket - (size_t)shift * PYLIBMC_HIST_SUB;
+    return ((m + 1) << shift) - 1;
+}
+
+static void _PylibMC_LatencyRecord(PylibMC_Client *self, PylibMC_Op op,
+                                   uint64_t start) {
+    pylibmc_histogram *hist;
+    uint64_t elapsed;
+
+    /* latency_histograms may have been turned on while the GIL was off. */
+    if (!start || self->latency == NULL) {
+        return;
+    }
+
+    elapsed = _PylibMC_Now() - start;
+    hist = &self->latency[op];
+    if (!hist->count || elapsed < hist->min) {
+        hist->min = elapsed;
+    }
+    if (elapsed > hist->max) {
+        hist->max = elapsed;
+    }
+    hist->count++;
+    hist->sum += elapsed;
+    hist->buckets[_PylibMC_HistBucket(elapsed)]++;
+}
+
+/* Summarize one histogram as a dict of count, min, max, mean and the
+ * value at each of `percentiles`, in microseconds. */
+static PyObject *_PylibMC_HistSummary(pylibmc_histogram *hist,
+                                      PyObject *percentiles) {
+    PyObject *summary, *pcts = NULL;
+    Py_ssize_t i, n = PySequence_Fast_GET_SIZE(percentiles);
+
+    summary = Py_BuildValue("{sKsdsdsd}",
+                            "count", (unsigned PY_LONG_LONG)hist->count,
+                            "min", hist->min / 1e3,
+                            "max", hist->max / 1e3,
+                            "mean", hist->sum / 1e3 / hist->count);
+    if (summary == NULL || (pcts = PyDict_New()) == NULL) {
+        goto error;
+    }
+
+    for (i = 0; i < n; i++) {
+        PyObject *p_obj = PySequence_Fast_GET_ITEM(percentiles, i);
+        PyObject *v_obj;
+        double p = PyFloat_AsDouble(p_obj);
+        uint64_t rank, seen = 0, v = hist->max;
+        size_t b;
+
+        if (p == -1.0 && PyErr_Occurred()) {
+            goto error;
+        } else if (p < 0.0 || p > 100.0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "percentiles must be between 0 and 100");
+            goto error;
+        }
+
+        rank = (uint64_t)(p / 100.0 * hist->count + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        for (b = 0; b < PYLIBMC_HIST_BUCKETS; b++) {
+            seen += hist->buckets[b];
+            if (seen >= rank) {
+                v = _PylibMC_HistBucketTop(b);
+                break;
+            }
+        }
+        if (v > hist->max) {
+            v = hist->max;
+        }
+
+        v_obj = PyFloat_FromDouble(v / 1e3);
+        if (v_obj == NULL || PyDict_SetItem(pcts, p_obj, v_obj) == -1) {
+            Py_XDECREF(v_obj);
+            goto error;
+        }
+        Py_DECREF(v_obj);
+    }
+
+    if (PyDict_SetItemString(summary, "percentiles", pcts) == -1) {
+        goto error;
+    }
+    Py_DECREF(pcts);
+    return summary;
+
+error:
+    Py_XDECREF(pcts);
+    Py_XDECREF(summary);
+    return NULL;
+}
+
+static PyObject *PylibMC_Client_latency_stats(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    PyObject *percentiles = NULL, *seq = NULL, *retval = NULL;
+    static char *kws[] = { "percentiles", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:latency_stats", kws,
+                                     &percentiles)) {
+        return NULL;
+    }
+
+    if (self->latency == NULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "latency_stats without latency_histograms behavior");
+        return NULL;
+    }
+
+    if (percentiles == NULL) {
+        seq = Py_BuildValue("(dddd)", 50.0, 90.0, 99.0, 99.9);
+    } else {
+        seq = PySequence_Fast(percentiles, "percentiles must be a sequence");
+    }
+    if (seq == NULL || (retval = PyDict_New()) == NULL) {
+        goto error;
+    }
+
+    for (int op = 0; op < PYLIBMC_OP_COUNT; op++) {
+        PyObject *summary;
+
+        if (!self->latency[op].count) {
+            continue;
+        }
+        summary = _PylibMC_HistSummary(&self->latency[op], seq);
+        if (summary == NULL
+                || PyDict_SetItemString(retval, PylibMC_op_names[op], summary) == -1) {
+            Py_XDECREF(summary);
+            goto error;
+        }
+        Py_DECREF(summary);
+    }
+
+    Py_DECREF(seq);
+    return retval;
+
+error:
+    Py_XDECREF(seq);
+    Py_XDECREF(retval);
+    return NULL;
+}
+
+static PyObject *PylibMC_Client_reset_latency_stats(PylibMC_Client *self) {
+    if (self->latency != NULL) {
+        memset(self->latency, 0, PYLIBMC_OP_COUNT * sizeof(pylibmc_histogram));
+    }
+    Py_RETURN_NONE;
+}
+/* }}} */
+
+/* {{{ Fork safety */
+static void _PylibMC_AfterForkChild(void) {
+    PylibMC_forks++;
+}
+
+/* Call with the GIL held before anything that may use or close self->mc's
+ * connections. Costs a compare unless a fork came between. */
+static bool _PylibMC_ForkCheck(PylibMC_Client *self) {
+    return self->forks == PylibMC_forks || _PylibMC_ForkReset(self);
+}
+
+/* Move a client made before a fork onto a memcached_st of its own. The old
+ * one is left as it is: freeing it, or even memcached_quit, would send quit
+ * on the sockets the parent still uses. Its sockets stay open in this
+ * process, unused. */
+static bool _PylibMC_ForkReset(PylibMC_Client *self) {
+    memcached_st *mc;
+
+    Py_BEGIN_ALLOW_THREADS;
+    mc = memcached_clone(NULL, self->mc);
+    Py_END_ALLOW_THREADS;
+    if (mc == NULL) {
+        PyErr_NoMemory();
+        return false;
+    }
+    self->mc = mc;
+    self->forks = PylibMC_forks;
+    _PylibMC_MetaReset(self);
+    return _PylibMC_BucketsApply(self);
+}
+/* }}} */
+
+/* {{{ Bucket distributions */
+static uint64_t _PylibMC_Mix(uint64_t x) {
+    /* splitmix64's finalizer */
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Lamping and Veach's jump consistent hash: the bucket of `n` that `key`
+ * goes to, moving only 1/n of keys as the nth is added. */
+static uint32_t _PylibMC_Jump(uint64_t key, uint32_t n) {
+    int64_t b = -1, j = 0;
+
+    while (j < (int64_t)n) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((double)(b + 1)
+                      * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (uint32_t)b;
+}
+
+/* The server of each bucket under `distribution`, for the servers of
+ * self->mc. Call with the GIL held. Returns NULL with an exception set on
+ * failure, or without one where there are no servers. */
+static pylibmc_buckets *_PylibMC_BucketsBuild(PylibMC_Client *self,
+                                              uint32_t distribution) {
+    uint32_t i, b, nservers = memcached_server_count(self->mc);
+    uint64_t *ids = NULL;
+    double *weights = NULL;
+    bool weighted = false;
+    pylibmc_buckets *buckets;
+
+    if (nservers == 0) {
+        return NULL;
+    }
+    if ((buckets = PyMem_Malloc(sizeof(pylibmc_buckets))) == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    buckets->refcnt = 1;
+
+    if (distribution == PYLIBMC_DISTRIBUTION_JUMP) {
+        for (b = 0; b < PYLIBMC_BUCKETS; b++) {
+            buckets->servers[b] = _PylibMC_Jump(_PylibMC_Mix(b), nservers);
+        }
+        return buckets;
+    }
+
+    /* Rendezvous hashing ranks servers by name rather than position, so
+     * that a server leaving the list only moves its own buckets. */
+    ids = PyMem_Malloc(nservers * sizeof(uint64_t));
+    weights = PyMem_Malloc(nservers * sizeof(double));
+    if (ids == NULL || weights == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < nservers; i++) {
+        PyObject *name = _PylibMC_ServerName(self, i), *w;
+        const char *str;
+        Py_ssize_t len;
+
+        if (name == NULL || (str = PyUnicode_AsUTF8AndSize(name, &len)) == NULL) {
+            Py_XDECREF(name);
+            goto error;
+        }
+        ids[i] = _PylibMC_KeyHash(str, len);
+        w = self->weights != NULL ? PyDict_GetItem(self->weights, name) : NULL;
+        weights[i] = w != NULL ? PyLong_AsDouble(w) : 1.0;
+        weighted |= weights[i] != 1.0;
+        Py_DECREF(name);
+    }
+
+    for (b = 0; b < PYLIBMC_BUCKETS; b++) {
+        double best = -1.0;
+
+        for (i = 0; i < nservers; i++) {
+            uint64_t h = _PylibMC_Mix(ids[i] ^ _PylibMC_Mix(b));
+            double score;
+
+            if (weighted) {
+                /* -w / ln(u) for u uniform in (0, 1): the server with the
+                 * highest score gets a share of buckets proportional to
+                 * its weight. */
+                score = -weights[i] / log(((double)(h >> 11) + 0.5)
+                                          / (double)(1ULL << 53));
+            } else {
+                score = (double)(h >> 11);
+            }
+            if (score > best) {
+                best = score;
+                buckets->servers[b] = i;
+            }
+        }
+    }
+
+    PyMem_Free(ids);
+    PyMem_Free(weights);
+    return buckets;
+error:
+    PyMem_Free(ids);
+    PyMem_Free(weights);
+    PyMem_Free(buckets);
+    return NULL;
+}
+
+static void _PylibMC_BucketsRelease(pylibmc_buckets *buckets) {
+    if (buckets != NULL && --buckets->refcnt == 0) {
+        PyMem_Free(buckets);
+    }
+}
+
+/* Hand the bucket table to self->mc, which keeps a copy of its own. */
+static bool _PylibMC_BucketsApply(PylibMC_Client *self) {
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000000
+    memcached_return rc;
+
+    if (self->buckets == NULL) {
+        return true;
+    }
+    rc = memcached_virtual_bucket_create(self->mc, self->buckets->servers,
+                                         NULL, PYLIBMC_BUCKETS, 0);
+    if (rc == MEMCACHED_SUCCESS) {
+        rc = memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_DISTRIBUTION,
+                                    MEMCACHED_DISTRIBUTION_VIRTUAL_BUCKET);
+    }
+    if (rc != MEMCACHED_SUCCESS) {
+        PylibMC_ErrFromMemcached(self, "memcached_virtual_bucket_create", rc);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/* Call with the GIL held whenever the servers or distribution of self->mc
+ * change. */
+static bool _PylibMC_BucketsUpdate(PylibMC_Client *self) {
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000000
+    /* Setting ketama, say, picks another distribution behind our back. */
+    if (self->distribution && self->buckets != NULL
+            && memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_DISTRIBUTION)
+               != MEMCACHED_DISTRIBUTION_VIRTUAL_BUCKET) {
+        self->distribution = 0;
+    }
+#endif
+    _PylibMC_BucketsRelease(self->buckets);
+    self->buckets = NULL;
+    if (!self->distribution) {
+        return true;
+    }
+    self->buckets = _PylibMC_BucketsBuild(self, self->distribution);
+    if (self->buckets == NULL) {
+        return !PyErr_Occurred();
+    }
+    return _PylibMC_BucketsApply(self);
+}
+
+/* Set the distribution behavior to `v`, libmemcached's or pylibmc's. */
+static bool _PylibMC_SetDistribution(PylibMC_Client *self, long v) {
+    memcached_return rc;
+
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000000
+    if (v == PYLIBMC_DISTRIBUTION_JUMP || v == PYLIBMC_DISTRIBUTION_RENDEZVOUS) {
+        self->distribution = (uint32_t)v;
+        return _PylibMC_BucketsUpdate(self);
+    }
+    if (self->distribution) {
+        self->distribution = 0;
+        memcached_virtual_bucket_free(self->mc);
+    }
+#endif
+    rc = memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_DISTRIBUTION,
+                                (uint64_t)v);
+    if (rc != MEMCACHED_SUCCESS) {
+        PyErr_Format(PylibMCExc_Error,
+                     "memcached_behavior_set returned %d for "
+                     "behavior 'distribution' = %ld", rc, v);
+        return false;
+    }
+    return true;
+}
+/* }}} */
+
+/* {{{ Per-server counters */
+static int _PylibMC_CountersEnable(PylibMC_Client *self, int enable) {
+    self->count_servers = enable != 0;
+    if (!enable) {
+        PyMem_Free(self->counters);
+        self->counters = NULL;
+        self->ncounters = 0;
+    }
+    _PylibMC_InstrumentedUpdate(self);
+    return true;
+}
+
+/* The counters to update in the call about to be made, or NULL if
+ * server_counters is off. Call with the GIL held; the table grows with the
+ * server list. Should growing fail, the call just goes uncounted. */
+static pylibmc_server_counters *_PylibMC_Counters(PylibMC_Client *self) {
+    pylibmc_server_counters *counters = self->counters;
+    Py_ssize_t nservers;
+
+    if (!self->count_servers) {
+        return NULL;
+    }
+
+    nservers = (Py_ssize_t)memcached_server_count(self->mc);
+    if (nservers <= (Py_ssize_t)self->ncounters) {
+        return counters;
+    }
+
+    if (PyMem_Resize(counters, pylibmc_server_counters, nservers) == NULL) {
+        return NULL;
+    }
+    memset(counters + self->ncounters, 0,
+           (nservers - self->ncounters) * sizeof(pylibmc_server_counters));
+    self->counters = counters;
+    self->ncounters = (uint32_t)nservers;
+    return counters;
+}
+
+/* The counters of the server `key` maps to. Needs no GIL. */
+static pylibmc_server_counters *_PylibMC_CounterFor(PylibMC_Client *self,
+        pylibmc_server_counters *counters, const char *key, Py_ssize_t key_len) {
+    uint32_t idx;
+
+    if (counters == NULL) {
+        return NULL;
+    }
+    idx = memcached_generate_hash(self->mc, key, key_len);
+    return idx < self->ncounters ? &counters[idx] : NULL;
+}
+
+/* The counters of the server libmemcached last lost its connection to, if
+ * any. Needs no GIL. */
+static pylibmc_server_counters *_PylibMC_CounterForFailure(PylibMC_Client *self,
+        pylibmc_server_counters *counters) {
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+    int idx;
+
+    if (counters == NULL) {
+        return NULL;
+    }
+    idx = _PylibMC_ServerIndex(self,
+                               memcached_server_get_last_disconnect(self->mc));
+    if (idx >= 0 && (uint32_t)idx < self->ncounters) {
+        return &counters[idx];
+    }
+#endif
+    return NULL;
+}
+
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+/* The position of `instance` in the server list, or -1. Needs no GIL. */
+static int _PylibMC_ServerIndex(PylibMC_Client *self,
+                                memcached_server_instance_st instance) {
+    uint32_t i, nservers = memcached_server_count(self->mc);
+
+    if (instance == NULL) {
+        return -1;
+    }
+
+    /* libmemcached keeps a copy of the server, so compare addresses. */
+    for (i = 0; i < nservers; i++) {
+        memcached_server_instance_st server =
+            memcached_server_instance_by_position(self->mc, i);
+
+        if (server != NULL
+                && memcached_server_port(server) == memcached_server_port(instance)
+                && !strcmp(memcached_server_name(server),
+                           memcached_server_name(instance))) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+#endif
+
+static void _PylibMC_CountSent(pylibmc_server_counters *c, Py_ssize_t nbytes) {
+    if (c != NULL) {
+        c->requests++;
+        c->bytes_out += nbytes;
+    }
+}
+
+static void _PylibMC_CountDone(pylibmc_server_counters *c, memcached_return rc,
+                               Py_ssize_t nbytes) {
+    if (c != NULL) {
+        c->bytes_in += nbytes;
+        _PylibMC_CountError(c, rc);
+    }
+}
+
+static void _PylibMC_CountError(pylibmc_server_counters *c, memcached_return rc) {
+    if (c == NULL) {
+        return;
+    }
+
+    switch (rc) {
+        case MEMCACHED_TIMEOUT:
+            c->timeouts++;
+            break;
+        case MEMCACHED_CONNECTION_FAILURE:
+        case MEMCACHED_CONNECTION_SOCKET_CREATE_FAILURE:
+        case MEMCACHED_WRITE_FAILURE:
+        case MEMCACHED_READ_FAILURE:
+        case MEMCACHED_UNKNOWN_READ_FAILURE:
+        case MEMCACHED_ERRNO:
+            c->connection_resets++;
+            break;
+        case MEMCACHED_SERVER_MARKED_DEAD:
+#if LIBMEMCACHED_VERSION_HEX >= 0x01000002
+        case MEMCACHED_SERVER_TEMPORARILY_DISABLED:
+#endif
+            c->ejections++;
+            break;
+        default:
+            break;
+    }
+}
+
+static PyObject *PylibMC_Client_server_counters(PylibMC_Client *self) {
+    PyObject *retval;
+    uint32_t i, nservers = memcached_server_count(self->mc);
+#if LIBMEMCACHED_VERSION_HEX < 0x00039000
+    memcached_server_st *servers = memcached_server_list(self->mc);
+#endif
+
+    if (!self->count_servers) {
+        PyErr_SetString(PyExc_ValueError,
+                        "server_counters without server_counters behavior");
+        return NULL;
+    }
+
+    /* Same layout as get_stats: [('<addr> (<num>)', {name: value}), ...] */
+    if ((retval = PyList_New(nservers)) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < nservers; i++) {
+        pylibmc_server_counters zero = { 0 };
+        pylibmc_server_counters *c = i < self->ncounters ? &self->counters[i] : &zero;
+        PyObject *item;
+
+        item = Py_BuildValue("(N{sKsKsKsKsKsK})",
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+            PyBytes_FromFormat("%s:%d (%u)",
+                memcached_server_name(memcached_server_instance_by_position(self->mc, i)),
+                memcached_server_port(memcached_server_instance_by_position(self->mc, i)),
+                (unsigned int)i),
+#else /* ver < libmemcached 0.39 */
+            PyBytes_FromFormat("%s:%d (%u)",
+                servers[i].hostname, servers[i].port, (unsigned int)i),
+#endif
+            "requests", (unsigned PY_LONG_LONG)c->requests,
+            "bytes_out", (unsigned PY_LONG_LONG)c->bytes_out,
+            "bytes_in", (unsigned PY_LONG_LONG)c->bytes_in,
+            "timeouts", (unsigned PY_LONG_LONG)c->timeouts,
+            "connection_resets", (unsigned PY_LONG_LONG)c->connection_resets,
+            "ejections", (unsigned PY_LONG_LONG)c->ejections);
+        if (item == NULL) {
+            Py_DECREF(retval);
+            return NULL;
+        }
+        PyList_SET_ITEM(retval, i, item);
+    }
+
+    return retval;
+}
+/* }}} */
+
+/* {{{ Adaptive timeouts */
+static int _PylibMC_TimingsEnable(PylibMC_Client *self, long k) {
+    if (k < 0 || (unsigned long)k > UINT32_MAX) {
+        PyErr_Format(PyExc_ValueError,
+                     "behavior 'adaptive_timeout' = %ld out of range", k);
+        return false;
+    }
+    self->adaptive_timeout = (uint32_t)k;
+    if (!k) {
+        PyMem_Free(self->timings);
+        self->timings = NULL;
+        self->ntimings = 0;
+    }
+    _PylibMC_InstrumentedUpdate(self);
+    return true;
+}
+
+/* The timings to go by in the call about to be made, or NULL if
+ * adaptive_timeout is off. Call with the GIL held; grows with the server
+ * list like _PylibMC_Counters. */
+static pylibmc_server_timing *_PylibMC_Timings(PylibMC_Client *self) {
+    pylibmc_server_timing *timings = self->timings;
+    Py_ssize_t nservers;
+
+    if (!self->adaptive_timeout) {
+        return NULL;
+    }
+
+    nservers = (Py_ssize_t)memcached_server_count(self->mc);
+    if (nservers <= (Py_ssize_t)self->ntimings) {
+        return timings;
+    }
+
+    if (PyMem_Resize(timings, pylibmc_server_timing, nservers) == NULL) {
+        return NULL;
+    }
+    memset(timings + self->ntimings, 0,
+           (nservers - self->ntimings) * sizeof(pylibmc_server_timing));
+    self->timings = timings;
+    self->ntimings = (uint32_t)nservers;
+    return timings;
+}
+
+/* The timeout in milliseconds for a call to the server timed in `t`, given
+ * `poll_timeout` as the longest it may be (negative waits forever). */
+static int32_t _PylibMC_TimeoutOf(PylibMC_Client *self,
+        pylibmc_server_timing *t, int32_t poll_timeout) {
+    int64_t cap = _PylibMC_TimeoutCap(poll_timeout), ns, ms;
+    int64_t k = (int64_t)self->adaptive_timeout;
+
+    if (t->samples < PYLIBMC_TIMEOUT_SAMPLES) {
+        return poll_timeout;
+    }
+
+    /* mean + k * deviation, worked out so as not to overflow */
+    if (t->mean >= cap || (k && t->deviation > (cap - t->mean) / k)) {
+        ns = cap;
+    } else {
+        ns = t->mean + k * t->deviation;
+    }
+    ms = (ns + 999999) / 1000000;
+    if (ms < PYLIBMC_TIMEOUT_MIN_MS) {
+        ms = PYLIBMC_TIMEOUT_MIN_MS;
+    }
+    if (poll_timeout >= 0 && ms > poll_timeout) {
+        ms = poll_timeout;
+    }
+    return (int32_t)ms;
+}
+
+/* The longest a call may wait under `poll_timeout`, in nanoseconds: the
+ * bound on the timings, so that backing off can't overflow them. */
+static int64_t _PylibMC_TimeoutCap(int32_t poll_timeout) {
+    return (int64_t)(poll_timeout >= 0 ? poll_timeout : INT32_MAX) * 1000000;
+}
+
+/* Have the call about to be made to the server `key` maps to wait as long
+ * as its timing says, and start timing it. Needs no GIL; pass the result on
+ * to _PylibMC_TimeoutDone once the call is done. */
+static pylibmc_server_timing *_PylibMC_TimeoutFor(PylibMC_Client *self,
+        pylibmc_server_timing *timings, const char *key, Py_ssize_t key_len) {
+    pylibmc_server_timing *t;
+    int32_t timeout;
+    uint32_t idx;
+
+    if (timings == NULL) {
+        return NULL;
+    }
+    idx = memcached_generate_hash(self->mc, key, key_len);
+    if (idx >= self->ntimings) {
+        return NULL;
+    }
+
+    t = &timings[idx];
+    self->poll_timeout = (int32_t)memcached_behavior_get(self->mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+    timeout = _PylibMC_TimeoutOf(self, t, self->poll_timeout);
+    if (timeout != self->poll_timeout) {
+        memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                               (uint64_t)(int64_t)timeout);
+    }
+    t->started = _PylibMC_Now();
+    return t;
+}
+
+/* Put _poll_timeout back and fold the call's latency into the timing of its
+ * server. Needs no GIL. */
+static void _PylibMC_TimeoutDone(PylibMC_Client *self,
+        pylibmc_server_timing *t, memcached_return rc) {
+    int64_t elapsed, err;
+
+    if (t == NULL) {
+        return;
+    }
+    memcached_behavior_set(self->mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+                           (uint64_t)(int64_t)self->poll_timeout);
+
+    switch (rc) {
+        case MEMCACHED_SUCCESS:
+        case MEMCACHED_NOTFOUND:
+        case MEMCACHED_NOTSTORED:
+        case MEMCACHED_STORED:
+        case MEMCACHED_DELETED:
+        case MEMCACHED_DATA_EXISTS:
+        case MEMCACHED_END:
+            break;
+        case MEMCACHED_TIMEOUT:
+            /* Back off the way TCP does, so that a server which has merely
+             * slowed down is not timed out for good. */
+            t->deviation = t->deviation ? 2 * t->deviation : t->mean;
+            if (t->deviation > _PylibMC_TimeoutCap(self->poll_timeout)) {
+                t->deviation = _PylibMC_TimeoutCap(self->poll_timeout);
+            }
+            return;
+        default:
+            /* Failures say nothing of how fast the server answers. */
+            return;
+    }
+
+    elapsed = (int64_t)(_PylibMC_Now() - t->started);
+    if (!t->samples) {
+        t->mean = elapsed;
+        t->deviation = elapsed / 2;
+    } else {
+        err = elapsed - t->mean;
+        t->mean += err / 8;
+        t->deviation += ((err < 0 ? -err : err) - t->deviation) / 4;
+    }
+    t->samples++;
+}
+
+/* Have the next wait of `mc` end by `deadline`, or sooner if `poll_timeout`
+ * is shorter. False once the deadline has passed. Needs no GIL. */
+static bool _PylibMC_DeadlineWait(memcached_st *mc, uint64_t deadline,
+                                  int32_t poll_timeout) {
+    uint64_t now = _PylibMC_Now();
+    int64_t ms;
+
+    if (now >= deadline) {
+        return false;
+    }
+    ms = (int64_t)((deadline - now + 999999) / 1000000);
+    if (poll_timeout >= 0 && ms > poll_timeout) {
+        ms = poll_timeout;
+    }
+    memcached_behavior_set(mc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, (uint64_t)ms);
+    return true;
+}
+
+static PyObject *PylibMC_Client_server_timeouts(PylibMC_Client *self) {
+    PyObject *retval;
+    uint32_t i, nservers = memcached_server_count(self->mc);
+    int32_t poll_timeout = (int32_t)memcached_behavior_get(self->mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+#if LIBMEMCACHED_VERSION_HEX < 0x00039000
+    memcached_server_st *servers = memcached_server_list(self->mc);
+#endif
+
+    if (!self->adaptive_timeout) {
+        PyErr_SetString(PyExc_ValueError,
+                        "server_timeouts without adaptive_timeout behavior");
+        return NULL;
+    }
+
+    /* Same layout as get_stats: [('<addr> (<num>)', {name: value}), ...] */
+    if ((retval = PyList_New(nservers)) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < nservers; i++) {
+        pylibmc_server_timing zero = { 0 };
+        pylibmc_server_timing *t = i < self->ntimings ? &self->timings[i] : &zero;
+        PyObject *item;
+
+        item = Py_BuildValue("(N{sKsdsdsi})",
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+            PyBytes_FromFormat("%s:%d (%u)",
+                memcached_server_name(memcached_server_instance_by_position(self->mc, i)),
+                memcached_server_port(memcached_server_instance_by_position(self->mc, i)),
+                (unsigned int)i),
+#else /* ver < libmemcached 0.39 */
+            PyBytes_FromFormat("%s:%d (%u)",
+                servers[i].hostname, servers[i].port, (unsigned int)i),
+#endif
+            "samples", (unsigned PY_LONG_LONG)t->samples,
+            "mean", t->mean / 1e3,
+            "deviation", t->deviation / 1e3,
+            "timeout", (int)_PylibMC_TimeoutOf(self, t, poll_timeout));
+        if (item == NULL) {
+            Py_DECREF(retval);
+            return NULL;
+        }
+        PyList_SET_ITEM(retval, i, item);
+    }
+
+    return retval;
+}
+/* }}} */
+
+/* {{{ Key sampling */
+static int _PylibMC_SamplerEnable(PylibMC_Client *self, long rate) {
+    if (rate < 0 || (unsigned long)rate > UINT32_MAX) {
+        PyErr_Format(PyExc_ValueError,
+                     "behavior 'key_sampling' = %ld out of range", rate);
+        return false;
+    }
+    /* Setting the behavior again starts afresh. */
+    PyMem_Free(self->sampler);
+    self->sampler = NULL;
+    _PylibMC_InstrumentedUpdate(self);
+    if (rate) {
+        self->sampler = PyMem_New(pylibmc_sampler, 1);
+        if (self->sampler == NULL) {
+            PyErr_NoMemory();
+            return false;
+        }
+        memset(self->sampler, 0, sizeof(pylibmc_sampler));
+        self->sampler->rate = (uint32_t)rate;
+        self->sampler->rng = ((uint64_t)(uintptr_t)self << 1) ^ _PylibMC_Now();
+        self->sampler->rng |= 1;
+        self->instrumented = true;
+    }
+    return true;
+}
+
+/* xorshift64*, plenty for picking samples. */
+static uint64_t _PylibMC_SampleRandom(pylibmc_sampler *sampler) {
+    uint64_t x = sampler->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sampler->rng = x;
+    return x * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+static bool _PylibMC_SampleTaken(pylibmc_sampler *sampler) {
+    return sampler->rate == 1
+        || _PylibMC_SampleRandom(sampler) % sampler->rate == 0;
+}
+
+static uint64_t _PylibMC_SampleHash(const char *key, Py_ssize_t key_len) {
+    unsigned char digest[16];
+    uint64_t h = 0;
+
+    _key_digest(key, key_len, digest);
+    memcpy(&h, digest, sizeof(h));
+    return h;
+}
+
+static void _PylibMC_SampleSet(pylibmc_key_sample *sample, uint64_t hash,
+                               const char *key, Py_ssize_t key_len,
+                               uint64_t count, uint64_t error) {
+    if (key_len > MEMCACHED_MAX_KEY) {
+        key_len = MEMCACHED_MAX_KEY;
+    }
+    sample->hash = hash;
+    sample->count = count;
+    sample->error = error;
+    sample->key_len = (uint8_t)key_len;
+    memcpy(sample->key, key, (size_t)key_len);
+}
+
+/* Count a use of `key` if it is sampled. Space-saving: a key not yet among
+ * the hot ones takes the place of the least used, inheriting its count as
+ * the bound on how much it is overestimated. Call with the GIL held, as
+ * hot_keys reads the sampler with it. */
+static void _PylibMC_SampleKey(PylibMC_Client *self, const char *key,
+                               Py_ssize_t key_len) {
+    pylibmc_sampler *sampler = self->sampler;
+    pylibmc_key_sample *least;
+    uint64_t hash;
+    uint32_t i;
+
+    if (sampler == NULL || !_PylibMC_SampleTaken(sampler)) {
+        return;
+    }
+
+    hash = _PylibMC_SampleHash(key, key_len);
+    least = &sampler->hot[0];
+    for (i = 0; i < sampler->nhot; i++) {
+        pylibmc_key_sample *hot = &sampler->hot[i];
+
+        if (hot->hash == hash && hot->key_len == key_len
+                && !memcmp(hot->key, key, (size_t)key_len)) {
+            hot->count++;
+            return;
+        }
+        if (hot->count < least->count) {
+            least = hot;
+        }
+    }
+
+    if (sampler->nhot < PYLIBMC_HOT_KEYS) {
+        _PylibMC_SampleSet(&sampler->hot[sampler->nhot++], hash, key, key_len,
+                           1, 0);
+    } else {
+        _PylibMC_SampleSet(least, hash, key, key_len,
+                           least->count + 1, least->count);
+    }
+}
+
+/* Note the size of a value got or set under `key`: into the reservoir if
+ * sampled, among the largest if it is one of them. Call with the GIL held,
+ * like _PylibMC_SampleKey. */
+static void _PylibMC_SampleValue(PylibMC_Client *self, const char *key,
+                                 Py_ssize_t key_len, Py_ssize_t size) {
+    pylibmc_sampler *sampler = self->sampler;
+    pylibmc_key_sample *smallest;
+    uint64_t n;
+    uint32_t i;
+
+    if (sampler == NULL) {
+        return;
+    }
+
+    if (_PylibMC_SampleTaken(sampler)) {
+        /* Algorithm R: the n-th size replaces a random one with odds
+         * PYLIBMC_SIZE_SAMPLES / n. */
+        n = sampler->nsizes++;
+        if (n < PYLIBMC_SIZE_SAMPLES) {
+            sampler->sizes[n] = (uint32_t)size;
+        } else if ((n = _PylibMC_SampleRandom(sampler) % (n + 1))
+                       < PYLIBMC_SIZE_SAMPLES) {
+            sampler->sizes[n] = (uint32_t)size;
+        }
+        if (sampler->nsizes == 1 || (uint64_t)size < sampler->size_min) {
+            sampler->size_min = (uint64_t)size;
+        }
+        if ((uint64_t)size > sampler->size_max) {
+            sampler->size_max = (uint64_t)size;
+        }
+        sampler->size_sum += (uint64_t)size;
+    }
+
+    if (sampler->nbig < PYLIBMC_BIG_VALUES) {
+        smallest = NULL;
+    } else {
+        smallest = &sampler->big[0];
+        for (i = 1; i < PYLIBMC_BIG_VALUES; i++) {
+            if (sampler->big[i].count < smallest->count) {
+                smallest = &sampler->big[i];
+            }
+        }
+        if ((uint64_t)size <= smallest->count) {
+            return;
+        }
+    }
+    /* A key already among the largest keeps one entry, its latest size. */
+    for (i = 0; i < sampler->nbig; i++) {
+        if (sampler->big[i].key_len == key_len
+                && !memcmp(sampler->big[i].key, key, (size_t)key_len)) {
+            sampler->big[i].count = (uint64_t)size;
+            return;
+        }
+    }
+    if (smallest == NULL) {
+        smallest = &sampler->big[sampler->nbig++];
+    }
+    _PylibMC_SampleSet(smallest, 0, key, key_len, (uint64_t)size, 0);
+}
+
+static int _PylibMC_SampleCompare(const void *a, const void *b) {
+    const pylibmc_key_sample *x = a, *y = b;
+
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int _PylibMC_SizeCompare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* [(key, count), ...] of `samples`, largest count first. */
+static PyObject *_PylibMC_SampleList(pylibmc_key_sample *samples, uint32_t n,
+                                     Py_ssize_t limit, uint64_t scale) {
+    pylibmc_key_sample *sorted;
+    PyObject *retval;
+    Py_ssize_t i;
+
+    if ((sorted = PyMem_New(pylibmc_key_sample, n ? n : 1)) == NULL) {
+        return PyErr_NoMemory();
+    }
+    memcpy(sorted, samples, n * sizeof(pylibmc_key_sample));
+    qsort(sorted, n, sizeof(pylibmc_key_sample), _PylibMC_SampleCompare);
+
+    if (limit < 0 || limit > (Py_ssize_t)n) {
+        limit = n;
+    }
+    if ((retval = PyList_New(limit)) == NULL) {
+        goto error;
+    }
+    for (i = 0; i < limit; i++) {
+        PyObject *item = Py_BuildValue("(y#K)", sorted[i].key,
+                                       (Py_ssize_t)sorted[i].key_len,
+                                       (unsigned PY_LONG_LONG)(sorted[i].count * scale));
+
+        if (item == NULL) {
+            Py_CLEAR(retval);
+            goto error;
+        }
+        PyList_SET_ITEM(retval, i, item);
+    }
+
+error:
+    PyMem_Free(sorted);
+    return retval;
+}
+
+static PyObject *PylibMC_Client_hot_keys(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    Py_ssize_t n = 10;
+    static char *kws[] = { "n", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n:hot_keys", kws, &n)) {
+        return NULL;
+    }
+
+    if (self->sampler == NULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "hot_keys without key_sampling behavior");
+        return NULL;
+    }
+
+    /* Scale sampled counts back up to estimate actual uses. */
+    return _PylibMC_SampleList(self->sampler->hot, self->sampler->nhot, n,
+                               self->sampler->rate);
+}
+
+static PyObject *PylibMC_Client_value_size_distribution(PylibMC_Client *self,
+        PyObject *args, PyObject *kwds) {
+    PyObject *percentiles = NULL, *seq = NULL, *pcts = NULL, *largest = NULL;
+    PyObject *retval = NULL;
+    pylibmc_sampler *sampler = self->sampler;
+    uint32_t *sizes = NULL;
+    Py_ssize_t i, nsizes;
+    static char *kws[] = { "percentiles", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:value_size_distribution",
+                                     kws, &percentiles)) {
+        return NULL;
+    }
+
+    if (sampler == NULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "value_size_distribution without key_sampling behavior");
+        return NULL;
+    }
+
+    if (percentiles == NULL) {
+        seq = Py_BuildValue("(dddd)", 50.0, 90.0, 99.0, 99.9);
+    } else {
+        seq = PySequence_Fast(percentiles, "percentiles must be a sequence");
+    }
+    if (seq == NULL || (pcts = PyDict_New()) == NULL) {
+        goto error;
+    }
+
+    nsizes = sampler->nsizes < PYLIBMC_SIZE_SAMPLES
+           ? (Py_ssize_t)sampler->nsizes : PYLIBMC_SIZE_SAMPLES;
+    if ((sizes = PyMem_New(uint32_t, PYLIBMC_SIZE_SAMPLES)) == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memcpy(sizes, sampler->sizes, nsizes * sizeof(uint32_t));
+    qsort(sizes, nsizes, sizeof(uint32_t), _PylibMC_SizeCompare);
+
+    for (i = 0; nsizes && i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject *p_obj = PySequence_Fast_GET_ITEM(seq, i), *v_obj;
+        double p = PyFloat_AsDouble(p_obj);
+        Py_ssize_t rank;
+
+        if (p == -1.0 && PyErr_Occurred()) {
+            goto error;
+        } else if (p < 0.0 || p > 100.0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "percentiles must be between 0 and 100");
+            goto error;
+        }
+
+        rank = (Py_ssize_t)(p / 100.0 * nsizes + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        v_obj = PyLong_FromUnsignedLong(sizes[rank - 1]);
+        if (v_obj == NULL || PyDict_SetItem(pcts, p_obj, v_obj) == -1) {
+            Py_XDECREF(v_obj);
+            goto error;
+        }
+        Py_DECREF(v_obj);
+    }
+
+    largest = _PylibMC_SampleList(sampler->big, sampler->nbig, -1, 1);
+    if (largest == NULL) {
+        goto error;
+    }
+
+    retval = Py_BuildValue("{sKsKsKsdsOsO}",
+        "count", (unsigned PY_LONG_LONG)sampler->nsizes,
+        "min", (unsigned PY_LONG_LONG)sampler->size_min,
+        "max", (unsigned PY_LONG_LONG)sampler->size_max,
+        "mean", sampler->nsizes ? (double)sampler->size_sum / sampler->nsizes : 0.0,
+        "percentiles", pcts,
+        "largest", largest);
+
+error:
+    PyMem_Free(sizes);
+    Py_XDECREF(largest);
+    Py_XDECREF(pcts);
+    Py_XDECREF(seq);
+    return retval;
+}
+/* }}} */
+
+/* {{{ Meta protocol */
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+/* The meta connection state of every server, or NULL with an exception
+ * set. Call with the GIL held; the table grows with the server list. */
+static pylibmc_meta_conn *_PylibMC_MetaConns(PylibMC_Client *self) {
+    pylibmc_meta_conn *conns = self->meta;
+    uint32_t i, nservers = memcached_server_count(self->mc);
+
+    if (nservers <= self->nmeta) {
+        return conns;
+    }
+
+    if (PyMem_Resize(conns, pylibmc_meta_conn, nservers) == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i = self->nmeta; i < nservers; i++) {
+        conns[i].fd = -1;
+        conns[i].failures = 0;
+        conns[i].retry_at = 0;
+    }
+    self->meta = conns;
+    self->nmeta = nservers;
+    return conns;
+}
+
+/* Close the meta connections and forget the failures. Call with the GIL
+ * held. Closing a socket another process still has sends nothing, so this
+ * is safe in the child of a fork too. */
+static void _PylibMC_MetaReset(PylibMC_Client *self) {
+    uint32_t i;
+
+    for (i = 0; i < self->nmeta; i++) {
+        if (self->meta[i].fd != -1) {
+            close(self->meta[i].fd);
+        }
+    }
+    PyMem_Free(self->meta);
+    self->meta = NULL;
+    self->nmeta = 0;
+}
+
+/* Wait at most `timeout` milliseconds for `fd` to be ready for `events`.
+ * Needs no GIL. */
+static memcached_return _PylibMC_MetaWait(int fd, short events, int timeout) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    do {
+        rc = poll(&pfd, 1, timeout);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc == 0) {
+        return MEMCACHED_TIMEOUT;
+    }
+    return rc == -1 ? MEMCACHED_ERRNO : MEMCACHED_SUCCESS;
+}
+
+/* Open b->fd to the server of `b`, with the client's connect_timeout and
+ * socket behaviors, and log in if the client has credentials. Sets b->err
+ * to the errno of a failure. Needs no GIL. */
+static memcached_return _PylibMC_MetaConnect(PylibMC_Client *self,
+                                             pylibmc_meta_batch *b) {
+    memcached_st *mc = self->mc;
+    memcached_server_instance_st server =
+        memcached_server_instance_by_position(mc, b->server);
+    const char *host = memcached_server_name(server);
+    int timeout = (int)memcached_behavior_get(mc,
+            MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT);
+    memcached_return rc = MEMCACHED_CONNECTION_FAILURE;
+    int fd = -1, on = 1;
+
+    if (host[0] == '/') {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, host, sizeof(addr.sun_path) - 1);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+            b->err = errno;
+            return rc;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            b->err = errno;
+            close(fd);
+            return rc;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    } else {
+        struct addrinfo hints, *addrs, *ai;
+        char port[8];
+        int opt;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port, sizeof(port), "%u",
+                 (unsigned)memcached_server_port(server));
+        if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+            return MEMCACHED_HOST_LOOKUP_FAILURE;
+        }
+
+        for (ai = addrs; ai != NULL; ai = ai->ai_next) {
+            socklen_t len = sizeof(b->err);
+
+            rc = MEMCACHED_CONNECTION_FAILURE;
+            if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                             ai->ai_protocol)) == -1) {
+                b->err = errno;
+                continue;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            if ((b->err = errno) == EINPROGRESS) {
+                rc = _PylibMC_MetaWait(fd, POLLOUT, timeout);
+                b->err = rc == MEMCACHED_ERRNO ? errno : 0;
+                if (rc == MEMCACHED_SUCCESS
+                        && getsockopt(fd, SOL_SOCKET, SO_ERROR,
+                                      &b->err, &len) == 0
+                        && b->err == 0) {
+                    break;
+                }
+                if (rc != MEMCACHED_TIMEOUT) {
+                    rc = MEMCACHED_CONNECTION_FAILURE;
+                }
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addrs);
+        if (fd == -1) {
+            return rc;
+        }
+
+        if (memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_TCP_NODELAY)) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        if (memcached_behavior_get(mc, MEMCACHED_BEHAVIOR_TCP_KEEPALIVE)) {
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        }
+#ifdef TCP_KEEPIDLE
+        if ((opt = (int)memcached_behavior_get(mc,
+                MEMCACHED_BEHAVIOR_TCP_KEEPIDLE)) > 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
+        }
+#else
+        (void)opt;
+#endif
+    }
+
+    b->err = 0;
+    if (self->meta_auth != NULL
+            && (rc = _PylibMC_MetaAuth(self, fd)) != MEMCACHED_SUCCESS) {
+        close(fd);
+        return rc;
+    }
+    b->fd = fd;
+    return MEMCACHED_SUCCESS;
+}
+
+/* Log in on `fd` the text protocol's way, with a set whose value is
+ * "username password", as memcached takes it from clients that can't do
+ * SASL. Needs no GIL. */
+static memcached_return _PylibMC_MetaAuth(PylibMC_Client *self, int fd) {
+    pylibmc_meta_batch b;
+    Py_ssize_t auth_len = PyBytes_GET_SIZE(self->meta_auth);
+    char head[48];
+    int head_len;
+
+    memset(&b, 0, sizeof(b));
+    b.fd = fd;
+    head_len = snprintf(head, sizeof(head), "set pylibmc 0 0 %zd\r\n",
+                        auth_len);
+    if (!_PylibMC_MetaAppend(&b, head, head_len)
+            || !_PylibMC_MetaAppend(&b, PyBytes_AS_STRING(self->meta_auth),
+                                    auth_len)
+            || !_PylibMC_MetaAppend(&b, "\r\n", 2)) {
+        b.rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+    } else {
+        /* STORED ends the exchange as any answer but a meta one does. */
+        _PylibMC_MetaExchange(self, &b, 1);
+        if (b.rc == MEMCACHED_SUCCESS
+                && (b.in_len != 8 || memcmp(b.in, "STORED\r\n", 8))) {
+            b.rc = MEMCACHED_AUTH_FAILURE;
+        }
+    }
+    PyMem_RawFree(b.out);
+    PyMem_RawFree(b.in);
+    return b.rc;
+}
+
+/* Add `len` bytes to the requests of `b`. Needs no GIL. */
+static bool _PylibMC_MetaAppend(pylibmc_meta_batch *b, const char *data,
+                                size_t len) {
+    if (b->out_len + len > b->out_size) {
+        size_t size = b->out_size ? b->out_size : 4096;
+        char *out;
+
+        while (size < b->out_len + len) {
+            size *= 2;
+        }
+        if ((out = PyMem_RawRealloc(b->out, size)) == NULL) {
+            return false;
+        }
+        b->out = out;
+        b->out_size = size;
+    }
+    memcpy(b->out + b->out_len, data, len);
+    b->out_len += len;
+    return true;
+}
+
+/* Add to `b` the request `command` for the key at `pos`, sent as `key`,
+ * with the next opaque in `b`, quiet if `quiet`, `flags` and, for ms,
+ * `value`. Needs no GIL. */
+static bool _PylibMC_MetaRequest(pylibmc_meta_batch *b, Py_ssize_t pos,
+                                 const char *command, const char *key,
+                                 size_t key_len, bool base64, bool quiet,
+                                 const char *flags, Py_ssize_t flags_len,
+                                 pylibmc_mset *value) {
+    char num[64];
+    int n;
+
+    if (b->nreqs == b->reqs_size) {
+        Py_ssize_t size = b->reqs_size ? b->reqs_size * 2 : 16;
+        Py_ssize_t *reqs = PyMem_RawRealloc(b->reqs, size * sizeof(*reqs));
+
+        if (reqs == NULL) {
+            return false;
+        }
+        b->reqs = reqs;
+        b->reqs_size = size;
+    }
+
+    if (!_PylibMC_MetaAppend(b, command, 2)
+            || !_PylibMC_MetaAppend(b, " ", 1)
+            || !_PylibMC_MetaAppend(b, key, key_len)) {
+        return false;
+    }
+    if (value != NULL) {
+        n = snprintf(num, sizeof(num), " %zd", value->value_len);
+        if (!_PylibMC_MetaAppend(b, num, n)) {
+            return false;
+        }
+    }
+    n = snprintf(num, sizeof(num), "%s%s O%zd", base64 ? " b" : "",
+                 quiet ? " q" : "", b->nreqs);
+    if (!_PylibMC_MetaAppend(b, num, n)) {
+        return false;
+    }
+    if (value != NULL) {
+        n = snprintf(num, sizeof(num), " F%u", (unsigned)value->flags);
+        if (!_PylibMC_MetaAppend(b, num, n)) {
+            return false;
+        }
+    }
+    if (flags_len && (!_PylibMC_MetaAppend(b, " ", 1)
+                      || !_PylibMC_MetaAppend(b, flags, flags_len))) {
+        return false;
+    }
+    if (!_PylibMC_MetaAppend(b, "\r\n", 2)) {
+        return false;
+    }
+    if (value != NULL && (!_PylibMC_MetaAppend(b, value->value,
+                                               value->value_len)
+                          || !_PylibMC_MetaAppend(b, "\r\n", 2))) {
+        return false;
+    }
+
+    b->reqs[b->nreqs++] = pos;
+    return true;
+}
+
+/* `len` bytes of `in` in base64 into `out`, which takes 4 * ((len + 2) / 3)
+ * of them; returns how many. */
+static size_t _PylibMC_MetaBase64(const char *in, size_t len, char *out) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *)in;
+    size_t i, n = 0;
+    uint32_t v;
+
+    for (i = 0; i + 2 < len; i += 3) {
+        v = (uint32_t)p[i] << 16 | (uint32_t)p[i + 1] << 8 | p[i + 2];
+        out[n++] = digits[v >> 18];
+        out[n++] = digits[v >> 12 & 63];
+        out[n++] = digits[v >> 6 & 63];
+        out[n++] = digits[v & 63];
+    }
+    if (i < len) {
+        v = (uint32_t)p[i] << 16 | (i + 1 < len ? (uint32_t)p[i + 1] << 8 : 0);
+        out[n++] = digits[v >> 18];
+        out[n++] = digits[v >> 12 & 63];
+        out[n++] = i + 1 < len ? digits[v >> 6 & 63] : '=';
+        out[n++] = '=';
+    }
+    return n;
+}
+
+/* Step b->scanned over the answers in b->in that have come in whole. The
+ * MN that ends them marks `b` done, and so does an answer that isn't a
+ * meta one, such as ERROR, which carries no opaque to tell whose it is;
+ * b->scanned is left at that line. Needs no GIL. */
+static void _PylibMC_MetaScan(pylibmc_meta_batch *b) {
+    while (!b->done) {
+        const char *line = b->in + b->scanned;
+        size_t avail = b->in_len - b->scanned, end, size = 0, i;
+        const char *nl = memchr(line, '\n', avail);
+
+        if (nl == NULL) {
+            return;
+        }
+        end = (size_t)(nl - line) + 1;
+        if (end < 4 || (line[2] != ' ' && line[2] != '\r')) {
+            b->done = true;
+            return;
+        }
+        if (line[0] == 'V' && line[1] == 'A') {
+            for (i = 3; i < end && line[i] >= '0' && line[i] <= '9'; i++) {
+                size = size * 10 + (size_t)(line[i] - '0');
+            }
+            if ((end += size + 2) > avail) {
+                return;
+            }
+        } else if (line[0] == 'M' && line[1] == 'N') {
+            b->done = true;
+        }
+        b->scanned += end;
+    }
+}
+
+/* Send every batch its requests and read back its answers, to and from all
+ * servers at once, waiting at most poll_timeout each time. Needs no GIL. */
+static void _PylibMC_MetaExchange(PylibMC_Client *self,
+                                  pylibmc_meta_batch *batches,
+                                  size_t nbatches) {
+    int timeout = (int)memcached_behavior_get(self->mc,
+            MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+    struct pollfd *pfds = PyMem_RawNew(struct pollfd, nbatches);
+    size_t *which = PyMem_RawNew(size_t, nbatches);
+    size_t i, n;
+    int rc;
+
+    for (;;) {
+        for (i = n = 0; i < nbatches; i++) {
+            pylibmc_meta_batch *b = &batches[i];
+
+            if (b->rc != MEMCACHED_SUCCESS || b->done) {
+                continue;
+            } else if (pfds == NULL || which == NULL) {
+                b->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+                continue;
+            }
+            pfds[n].fd = b->fd;
+            pfds[n].events = POLLIN;
+            if (b->out_sent < b->out_len) {
+                pfds[n].events |= POLLOUT;
+            }
+            pfds[n].revents = 0;
+            which[n++] = i;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        do {
+            rc = poll(pfds, n, timeout);
+        } while (rc == -1 && errno == EINTR);
+        if (rc <= 0) {
+            for (i = 0; i < n; i++) {
+                batches[which[i]].rc = rc ? MEMCACHED_ERRNO : MEMCACHED_TIMEOUT;
+                batches[which[i]].err = rc ? errno : 0;
+            }
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            pylibmc_meta_batch *b = &batches[which[i]];
+            short revents = pfds[i].revents;
+            ssize_t got;
+
+            if (revents & POLLOUT) {
+                got = send(b->fd, b->out + b->out_sent,
+                           b->out_len - b->out_sent, MSG_NOSIGNAL);
+                if (got >= 0) {
+                    b->out_sent += (size_t)got;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK
+                           && errno != EINTR) {
+                    b->rc = MEMCACHED_WRITE_FAILURE;
+                    b->err = errno;
+                    continue;
+                }
+            }
+            if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if (b->in_size - b->in_len < 4096) {
+                size_t size = b->in_size ? b->in_size * 2 : 16384;
+                char *in = PyMem_RawRealloc(b->in, size);
+
+                if (in == NULL) {
+                    b->rc = MEMCACHED_MEMORY_ALLOCATION_FAILURE;
+                    continue;
+                }
+                b->in = in;
+                b->in_size = size;
+            }
+            got = recv(b->fd, b->in + b->in_len, b->in_size - b->in_len, 0);
+            if (got > 0) {
+                b->in_len += (size_t)got;
+                _PylibMC_MetaScan(b);
+            } else if (got == 0) {
+                b->rc = MEMCACHED_CONNECTION_FAILURE;
+                b->err = 0;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK
+                       && errno != EINTR) {
+                b->rc = MEMCACHED_READ_FAILURE;
+                b->err = errno;
+            }
+        }
+    }
+
+    PyMem_RawFree(pfds);
+    PyMem_RawFree(which);
+}
+
+/* The error for the keys of `b`, whose server failed, or answered with
+ * something other than a meta response. Call with the GIL held. */
+static PyObject *_PylibMC_MetaError(PylibMC_Client *self,
+                                    pylibmc_meta_batch *b) {
+    PyObject *name, *msg, *exc;
+    memcached_return rc = b->rc;
+
+    if ((name = _PylibMC_ServerName(self, b->server)) == NULL) {
+        return NULL;
+    }
+
+    if (rc == MEMCACHED_SUCCESS) {
+        const char *line = b->in + b->scanned;
+        size_t len = b->in_len - b->scanned;
+        const char *cr = memchr(line, '\r', len);
+        PyObject *text;
+
+        if (cr != NULL) {
+            len = (size_t)(cr - line);
+        }
+        if (len == 5 && !memcmp(line, "ERROR", 5)) {
+            rc = MEMCACHED_PROTOCOL_ERROR;
+            msg = PyUnicode_FromFormat("%U does not speak the meta protocol",
+                                       name);
+        } else {
+            if (len >= 12 && !memcmp(line, "CLIENT_ERROR", 12)) {
+                rc = MEMCACHED_CLIENT_ERROR;
+            } else if (len >= 12 && !memcmp(line, "SERVER_ERROR", 12)) {
+                rc = MEMCACHED_SERVER_ERROR;
+            } else {
+                rc = MEMCACHED_PROTOCOL_ERROR;
+            }
+            text = PyUnicode_DecodeASCII(line, len < 200 ? len : 200,
+                                         "replace");
+            msg = text ? PyUnicode_FromFormat("%U: %U", name, text) : NULL;
+            Py_XDECREF(text);
+        }
+    } else {
+        msg = PyUnicode_FromFormat("%U: %s", name, b->err
+                                   ? strerror(b->err)
+                                   : memcached_strerror(self->mc, rc));
+    }
+    Py_DECREF(name);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    exc = PyObject_CallFunctionObjArgs(_exc_by_rc(rc), msg, NULL);
+    Py_DECREF(msg);
+    return exc;
+}
+
+/* Put each answer in b->in into `results`, at the position of the key its
+ * opaque says it is for, as (status, flags, value). Call with the GIL
+ * held. */
+static bool _PylibMC_MetaResults(PylibMC_Client *self, pylibmc_meta_batch *b,
+                                 PyObject *results) {
+    size_t pos = 0;
+
+    while (pos < b->scanned) {
+        const char *line = b->in + pos;
+        const char *end = memchr(line, '\n', b->scanned - pos) - 1;
+        const char *tok = line + 2, *t;
+        bool sized = !(line[0] == 'V' && line[1] == 'A');
+        Py_ssize_t size = 0, opaque = -1;
+        PyObject *flags, *value = NULL, *response;
+
+        pos = (size_t)(end - b->in) + 2;
+        if (line[0] == 'M' && line[1] == 'N') {
+            continue;
+        }
+        if ((flags = PyDict_New()) == NULL) {
+            return false;
+        }
+
+        while (tok < end) {
+            PyObject *k, *v;
+            int rc;
+
+            if (*tok == ' ') {
+                tok++;
+                continue;
+            }
+            for (t = tok; tok < end && *tok != ' '; tok++)
+                ;
+            if (!sized) {
+                for (; t < tok; t++) {
+                    size = size * 10 + (*t - '0');
+                }
+                sized = true;
+                continue;
+            }
+            if (*t == 'O') {
+                const char *d;
+
+                for (opaque = 0, d = t + 1; d < tok; d++) {
+                    if (*d < '0' || *d > '9' || opaque > b->nreqs) {
+                        opaque = -1;
+                        break;
+                    }
+                    opaque = opaque * 10 + (*d - '0');
+                }
+            }
+
+            k = PyBytes_FromStringAndSize(t, 1);
+            v = PyBytes_FromStringAndSize(t + 1, tok - t - 1);
+            rc = k != NULL && v != NULL ? PyDict_SetItem(flags, k, v) : -1;
+            Py_XDECREF(k);
+            Py_XDECREF(v);
+            if (rc == -1) {
+                Py_DECREF(flags);
+                return false;
+            }
+        }
+
+        if (!(line[0] == 'V' && line[1] == 'A')) {
+            Py_INCREF(Py_None);
+            value = Py_None;
+        } else if ((value = PyBytes_FromStringAndSize(b->in + pos,
+                                                      size)) == NULL) {
+            Py_DECREF(flags);
+            return false;
+        } else {
+            pos += (size_t)size + 2;
+        }
+
+        /* Every request carries its opaque, so this is only a server
+         * answering out of turn. */
+        if (opaque < 0 || opaque >= b->nreqs) {
+            Py_DECREF(flags);
+            Py_DECREF(value);
+            continue;
+        }
+        if ((response = Py_BuildValue("(y#NN)", line, (Py_ssize_t)2,
+                                      flags, value)) == NULL) {
+            return false;
+        }
+        PyList_SetItem(results, b->reqs[opaque], response);
+    }
+    return true;
+}
+
+static PyObject *PylibMC_Client_meta(PylibMC_Client *self, PyObject *args,
+                                     PyObject *kwds) {
+    const char *command, *flags = "", *prefix = NULL, *ns;
+    Py_ssize_t command_len, flags_len = 0, prefix_len = 0;
+    size_t ns_len;
+    PyObject *keys, *values = Py_None, *values_seq = NULL;
+    PyObject *results = NULL;
+    pylibmc_key *key_objs = NULL;
+    pylibmc_keybuf prefixed = { NULL };
+    pylibmc_mset *msets = NULL;
+    pylibmc_meta_conn *conns;
+    pylibmc_meta_batch *batches = NULL;
+    Py_ssize_t *batch_of = NULL;
+    size_t j, nbatches = 0;
+    uint32_t nservers;
+    uint64_t now, limit, retry;
+    Py_ssize_t i, nkeys = 0;
+    memcached_return rc;
+
+    int quiet = 0;
+    static char *kws[] = { "command", "keys", "flags", "values",
+                           "key_prefix", "quiet", NULL };
+
+    if (!_PylibMC_ForkCheck(self)) {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#O|z#Oz#p:meta", kws,
+                                     &command, &command_len, &keys,
+                                     &flags, &flags_len, &values,
+                                     &prefix, &prefix_len, &quiet)) {
+        return NULL;
+    }
+
+    if (command_len != 2 || command[0] != 'm'
+            || memchr("gsda", command[1], 4) == NULL) {
+        PyErr_Format(PyExc_ValueError, "not a meta command: %s", command);
+        return NULL;
+    }
+    if (flags == NULL) {
+        flags = "";
+    } else if (memchr(flags, '\r', flags_len) || memchr(flags, '\n', flags_len)) {
+        PyErr_SetString(PyExc_ValueError, "flags must be on one line");
+        return NULL;
+    }
+    /* The opaque, base64 keys, quiet mode and, for ms, the client flags are
+     * the engine's to set, as it matches up the answers by them. */
+    for (i = 0; i < flags_len; i++) {
+        if ((i == 0 || flags[i - 1] == ' ')
+                && (memchr("Oqb", flags[i], 3) != NULL
+                    || (command[1] == 's' && flags[i] == 'F'))) {
+            PyErr_Format(PyExc_ValueError, "flag %c is set by meta itself%s",
+                         flags[i], flags[i] == 'q' ? "; pass quiet" : "");
+            return NULL;
+        }
+    }
+    if ((command[1] == 's') != (values != Py_None)) {
+        PyErr_SetString(PyExc_TypeError, "values go with ms, and only ms");
+        return NULL;
+    }
+    if (memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_USE_UDP)) {
+        PyErr_SetString(_exc_by_rc(MEMCACHED_NOT_SUPPORTED),
+                        "the meta protocol needs TCP or UNIX sockets");
+        return NULL;
+    }
+    if ((nservers = memcached_server_count(self->mc)) == 0) {
+        return PylibMC_ErrFromMemcached(self, "meta", MEMCACHED_NO_SERVERS);
+    }
+    if ((conns = _PylibMC_MetaConns(self)) == NULL) {
+        return NULL;
+    }
+
+    /* Prefixed and mapped as the other commands send them. */
+    nkeys = _PylibMC_NormalizeKeys(self, keys, prefix, prefix_len, &key_objs,
+                                   &prefixed);
+    if (nkeys == -1) {
+        return NULL;
+    }
+
+    if (values != Py_None) {
+        if ((values_seq = PySequence_Fast(values,
+                "values must be a sequence")) == NULL) {
+            goto cleanup;
+        }
+        if (PySequence_Fast_GET_SIZE(values_seq) != nkeys) {
+            PyErr_SetString(PyExc_ValueError,
+                            "values and keys differ in number");
+            goto cleanup;
+        }
+        if ((msets = PyMem_New(pylibmc_mset, nkeys ? nkeys : 1)) == NULL) {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        memset(msets, 0, (nkeys ? nkeys : 1) * sizeof(pylibmc_mset));
+        for (i = 0; i < nkeys; i++) {
+            pylibmc_mset *m = &msets[i];
+            PyObject *value = PySequence_Fast_GET_ITEM(values_seq, i);
+            int ok = self->native_serialization
+                ? _PylibMC_serialize_native(self, value, &m->value_obj, &m->flags)
+                : _PylibMC_serialize_user(self, value, &m->value_obj, &m->flags);
+
+            if (!ok || PyBytes_AsStringAndSize(m->value_obj, &m->value,
+                                               &m->value_len) == -1) {
+                goto cleanup;
+            }
+        }
+    }
+
+    /* libmemcached puts its namespace in front of every key it sends. */
+#ifdef MEMCACHED_CALLBACK_NAMESPACE
+    ns = (const char *)memcached_callback_get(self->mc,
+            MEMCACHED_CALLBACK_NAMESPACE, &rc);
+#else
+    ns = (const char *)memcached_callback_get(self->mc,
+            MEMCACHED_CALLBACK_PREFIX_KEY, &rc);
+#endif
+    ns_len = ns != NULL ? strlen(ns) : 0;
+
+    if ((results = PyList_New(nkeys)) == NULL) {
+        goto cleanup;
+    }
+    for (i = 0; i < nkeys; i++) {
+        Py_INCREF(Py_None);
+        PyList_SET_ITEM(results, i, Py_None);
+    }
+
+    batches = PyMem_New(pylibmc_meta_batch, nservers);
+    batch_of = PyMem_New(Py_ssize_t, nservers);
+    if (batches == NULL || batch_of == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (j = 0; j < nservers; j++) {
+        batch_of[j] = -1;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        pylibmc_key *k = &key_objs[i];
+        char raw[PYLIBMC_META_KEY_MAX], encoded[PYLIBMC_META_KEY_MAX + 4];
+        const char *key = raw;
+        size_t key_len = ns_len + (size_t)k->key_len, n;
+        bool base64 = false;
+        uint32_t server;
+
+        /* Keys that memcached would turn away are never sent. */
+        if (k->key == NULL || !k->key_len || key_len > PYLIBMC_META_KEY_MAX) {
+            continue;
+        }
+        memcpy(raw, ns, ns_len);
+        memcpy(raw + ns_len, k->key, k->key_len);
+        for (n = 0; n < key_len && !base64; n++) {
+            base64 = (unsigned char)raw[n] <= ' ' || raw[n] == 0x7f;
+        }
+        if (base64) {
+            if (4 * ((key_len + 2) / 3) > PYLIBMC_META_KEY_MAX) {
+                continue;
+            }
+            key_len = _PylibMC_MetaBase64(raw, key_len, encoded);
+            key = encoded;
+        }
+
+        server = memcached_generate_hash(self->mc, k->key, k->key_len);
+        if (server >= nservers) {
+            continue;
+        }
+        if (batch_of[server] == -1) {
+            pylibmc_meta_batch *b = &batches[nbatches];
+
+            memset(b, 0, sizeof(*b));
+            b->server = server;
+            b->fd = -1;
+            batch_of[server] = (Py_ssize_t)nbatches++;
+        }
+        if (!_PylibMC_MetaRequest(&batches[batch_of[server]], i, command,
+                                  key, key_len, base64, quiet != 0,
+                                  flags, flags_len,
+                                  msets != NULL ? &msets[i] : NULL)) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+
+    /* Each batch ends with a no-op, whose MN says the answers are all in,
+     * so that quiet requests can go unanswered. */
+    for (j = 0; j < nbatches; j++) {
+        if (!_PylibMC_MetaAppend(&batches[j], "mn\r\n", 4)) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+
+    now = _PylibMC_Now();
+    limit = memcached_behavior_get(self->mc,
+            MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT);
+    retry = memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT);
+
+    Py_BEGIN_ALLOW_THREADS;
+    for (j = 0; j < nbatches; j++) {
+        pylibmc_meta_batch *b = &batches[j];
+        pylibmc_meta_conn *conn = &conns[b->server];
+
+        if (conn->fd != -1) {
+            b->fd = conn->fd;
+        } else if (conn->retry_at && now < conn->retry_at) {
+            b->rc = MEMCACHED_SERVER_MARKED_DEAD;
+        } else if ((b->rc = _PylibMC_MetaConnect(self, b))
+                   == MEMCACHED_SUCCESS) {
+            conn->fd = b->fd;
+        }
+    }
+    _PylibMC_MetaExchange(self, batches, nbatches);
+    Py_END_ALLOW_THREADS;
+
+    for (j = 0; j < nbatches; j++) {
+        pylibmc_meta_batch *b = &batches[j];
+        pylibmc_meta_conn *conn = &conns[b->server];
+        PyObject *exc;
+        Py_ssize_t r;
+
+        if (b->rc == MEMCACHED_SUCCESS && b->scanned == b->in_len) {
+            conn->failures = 0;
+            conn->retry_at = 0;
+            if (!_PylibMC_MetaResults(self, b, results)) {
+                goto error;
+            }
+            continue;
+        }
+
+        /* Past a failure, or an answer without an opaque, the connection
+         * can't be trusted to be in step any more. */
+        if (conn->fd != -1) {
+            close(conn->fd);
+            conn->fd = -1;
+        }
+        if (b->rc != MEMCACHED_SUCCESS && b->rc != MEMCACHED_SERVER_MARKED_DEAD
+                && limit && ++conn->failures >= limit) {
+            conn->retry_at = _PylibMC_Now() + retry * 1000000000;
+        }
+        if ((exc = _PylibMC_MetaError(self, b)) == NULL) {
+            goto error;
+        }
+        for (r = 0; r < b->nreqs; r++) {
+            Py_INCREF(exc);
+            PyList_SetItem(results, b->reqs[r], exc);
+        }
+        Py_DECREF(exc);
+    }
+    goto cleanup;
+
+error:
+    Py_CLEAR(results);
+cleanup:
+    for (j = 0; j < nbatches; j++) {
+        PyMem_RawFree(batches[j].out);
+        PyMem_RawFree(batches[j].in);
+        PyMem_RawFree(batches[j].reqs);
+    }
+    PyMem_Free(batches);
+    PyMem_Free(batch_of);
+    if (msets != NULL) {
+        for (i = 0; i < nkeys; i++) {
+            _PylibMC_FreeMset(&msets[i]);
+        }
+        PyMem_Free(msets);
+    }
+    Py_XDECREF(values_seq);
+    _PylibMC_KeyBufFree(&prefixed);
+    _PylibMC_FreeKeys(key_objs, nkeys);
+    return results;
+}
+/* }}} */
+
+/* {{{ Tracing */
+/* Call with the GIL held, before releasing it; hand the span on to
+ * _PylibMC_TraceEnd once the call is done. `key` names the one key of a
+ * single-key operation, NULL for batches. */
+static PyObject *_PylibMC_TraceStart(PylibMC_Client *self, PylibMC_Op op,
+                                     Py_ssize_t nkeys, const char *key,
+                                     Py_ssize_t key_len) {
+    if (PylibMC_tracer == NULL) {
+        return NULL;
+    }
+    return _PylibMC_TraceCall(self, op, nkeys, key, key_len);
+}
+
+/* Call the tracer as tracer(operation, key_count, server) and return what it
+ * gives back as the span's end callback, NULL if it gives None. A tracer
+ * that raises is reported as unraisable rather than failing the call. */
+static PyObject *_PylibMC_TraceCall(PylibMC_Client *self, PylibMC_Op op,
+                                    Py_ssize_t nkeys, const char *key,
+                                    Py_ssize_t key_len) {
+    PyObject *tracer = PylibMC_tracer, *server = NULL, *span;
+
+    if (key != NULL && memcached_server_count(self->mc)) {
+        server = _PylibMC_ServerName(self,
+                memcached_generate_hash(self->mc, key, key_len));
+    } else {
+        Py_INCREF(Py_None);
+        server = Py_None;
+    }
+
+    Py_INCREF(tracer);
+    span = server == NULL ? NULL :
+        PyObject_CallFunction(tracer, "snO", PylibMC_op_names[op], nkeys, server);
+    Py_XDECREF(server);
+
+    if (span == NULL) {
+        PyErr_WriteUnraisable(tracer);
+    } else if (span == Py_None) {
+        Py_CLEAR(span);
+    }
+    Py_DECREF(tracer);
+    return span;
+}
+
+/* "host:port" of the server at position `idx`. */
+static PyObject *_PylibMC_ServerName(PylibMC_Client *self, uint32_t idx) {
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+    memcached_server_instance_st instance =
+        memcached_server_instance_by_position(self->mc, idx);
+
+    return PyUnicode_FromFormat("%s:%d", memcached_server_name(instance),
+                                (int)memcached_server_port(instance));
+#else /* ver < libmemcached 0.39 */
+    memcached_server_st *servers = memcached_server_list(self->mc);
+
+    return PyUnicode_FromFormat("%s:%d", servers[idx].hostname,
+                                (int)servers[idx].port);
+#endif
+}
+
+/* End `span` as end(result, bytes_out, bytes_in), where result is
+ * libmemcached's description of `rc`, or of the error the operation raised,
+ * and drop it. Leaves that exception in place. */
+static void _PylibMC_TraceEnd(PylibMC_Client *self, PyObject *span,
+                              memcached_return rc, Py_ssize_t bytes_out,
+                              Py_ssize_t bytes_in) {
+    PyObject *exc_type, *exc_value, *exc_tb, *r;
+
+    if (span == NULL) {
+        return;
+    }
+
+    /* Batches report the outcome through the exception they raise. */
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (exc_type != NULL) {
+        PylibMC_McErr *err;
 
-        mc_val = memcached_stat_get_value(mc, stat, *curr_key, &rc);
-        if (rc != MEMCACHED_SUCCESS) {
-            PylibMC_ErrFromMemcached(self, "get_stats val", rc);
-            goto error;
+        rc = MEMCACHED_FAILURE;
+        for (err = PylibMCExc_mc_errs; err->name != NULL; err++) {
+            if (err->exc == exc_type) {
+                rc = err->rc;
+                break;
+            }
         }
+    }
+    r = PyObject_CallFunction(span, "snn", memcached_strerror(self->mc, rc),
+                              bytes_out, bytes_in);
+    if (r == NULL) {
+        PyErr_WriteUnraisable(span);
+    }
+    Py_XDECREF(r);
+    Py_DECREF(span);
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
 
-        curr_value = PyBytes_FromString(mc_val);
-        free(mc_val);
-        if (curr_value == NULL)
-            goto error;
+/* Value bytes a batch of fetches received. */
+static Py_ssize_t _PylibMC_ResultBytes(pylibmc_mget_res *res) {
+    Py_ssize_t i, nbytes = 0;
 
-        fail = PyDict_SetItemString(val, *curr_key, curr_value);
-        Py_DECREF(curr_value);
-        if (fail)
-            goto error;
+    for (i = 0; i < res->nresults; i++) {
+        nbytes += (Py_ssize_t)memcached_result_length(&res->results[i]);
     }
+    return nbytes;
+}
 
-    free(stat_keys);
+/* Key and value bytes a batch of stores sends. */
+static Py_ssize_t _PylibMC_MsetBytes(pylibmc_mset *msets, Py_ssize_t nkeys) {
+    Py_ssize_t i, nbytes = 0;
 
-    desc = PyBytes_FromFormat("%s:%d (%u)",
-#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
-            memcached_server_name(instance), memcached_server_port(instance),
-#else /* ver < libmemcached 0.39 */
-            server->hostname, server->port,
-#endif
-            (unsigned int)context->index);
+    for (i = 0; i < nkeys; i++) {
+        nbytes += msets[i].key_len + (Py_ssize_t)msets[i].value_len;
+    }
+    return nbytes;
+}
 
-    PyList_SET_ITEM(context->retval, context->index++,
-                    Py_BuildValue("NN", desc, val));
+static PyObject *PylibMC_set_tracer(PyObject *self, PyObject *tracer) {
+    if (tracer != Py_None && !PyCallable_Check(tracer)) {
+        PyErr_SetString(PyExc_TypeError, "tracer must be callable or None");
+        return NULL;
+    }
+    Py_CLEAR(PylibMC_tracer);
+    if (tracer != Py_None) {
+        Py_INCREF(tracer);
+        PylibMC_tracer = tracer;
+    }
+    Py_RETURN_NONE;
+}
 
-    return MEMCACHED_SUCCESS;
+static PyObject *PylibMC_get_tracer(PyObject *self, PyObject *unused) {
+    PyObject *tracer = PylibMC_tracer != NULL ? PylibMC_tracer : Py_None;
 
-error:
-    free(stat_keys);
-    Py_DECREF(val);
-    return MEMCACHED_FAILURE;
+    Py_INCREF(tracer);
+    return tracer;
 }
+/* }}} */
 
-static PyObject *PylibMC_Client_get_stats(PylibMC_Client *self, PyObject *args) {
-    memcached_stat_st *stats;
-    memcached_return rc;
-    char *mc_args;
-    Py_ssize_t nservers;
-    _PylibMC_StatsContext context;
-#if LIBMEMCACHED_VERSION_HEX >= 0x00038000
-    memcached_server_function callbacks[] = {
-        (memcached_server_function)_PylibMC_AddServerCallback
-    };
-#endif
+/* {{{ Allocation counting
+ * For the allocation regression tests: wrap the allocators of each PyMem
+ * domain, and those of a client's memcached_st, in ones that count calls and
+ * pass them on. */
+typedef struct {
+    PyMemAllocatorEx orig;
+    uint64_t calls;
+} pylibmc_alloc_counter;
 
-    mc_args = NULL;
-    if (!PyArg_ParseTuple(args, "|s:get_stats", &mc_args))
-        return NULL;
+static pylibmc_alloc_counter PylibMC_alloc_counters[3];
 
-    Py_BEGIN_ALLOW_THREADS;
-    stats = memcached_stat(self->mc, mc_args, &rc);
-    Py_END_ALLOW_THREADS;
-    if (rc != MEMCACHED_SUCCESS)
-        return PylibMC_ErrFromMemcached(self, "get_stats", rc);
+static void *_PylibMC_CountedMalloc(void *ctx, size_t size) {
+    pylibmc_alloc_counter *c = ctx;
 
-    /** retval contents:
-     * [('<addr, 127.0.0.1:11211> (<num, 1>)', {stat: stat, stat: stat}),
-     *  (str, dict),
-     *  (str, dict)]
-     */
-    nservers = (Py_ssize_t)memcached_server_count(self->mc);
+    c->calls++;
+    return c->orig.malloc(c->orig.ctx, size);
+}
 
-    /* Setup stats callback context */
-    context.self = (PyObject *)self;
-    context.retval = PyList_New(nservers);
-    context.stats = stats;
-    context.servers = NULL;  /* DEPRECATED */
-    context.index = 0;
+static void *_PylibMC_CountedCalloc(void *ctx, size_t nelem, size_t elsize) {
+    pylibmc_alloc_counter *c = ctx;
 
-#if LIBMEMCACHED_VERSION_HEX >= 0x00038000
-    rc = memcached_server_cursor(self->mc, callbacks, (void *)&context, 1);
-#else /* ver < libmemcached 0.38 */
-    context.servers = memcached_server_list(self->mc);
+    c->calls++;
+    return c->orig.calloc(c->orig.ctx, nelem, elsize);
+}
 
-    for (; context.index < nservers; context.index++) {
-        memcached_server_st *server = context.servers + context.index;
-        memcached_return rc;
+static void *_PylibMC_CountedRealloc(void *ctx, void *ptr, size_t size) {
+    pylibmc_alloc_counter *c = ctx;
 
-        rc = _PylibMC_AddServerCallback(self->mc, server, (void *)&context);
-        if (rc != MEMCACHED_SUCCESS)
-            break;
-    }
-#endif
+    c->calls++;
+    return c->orig.realloc(c->orig.ctx, ptr, size);
+}
 
-    if (rc != MEMCACHED_SUCCESS) {
-        if (!PyErr_Occurred())
-            PyErr_SetString(PyExc_RuntimeError, "unknown error occured");
-        Py_DECREF(context.retval);
-        context.retval = NULL;
-    }
+static void _PylibMC_CountedFree(void *ctx, void *ptr) {
+    pylibmc_alloc_counter *c = ctx;
 
-    free(context.stats);
+    c->orig.free(c->orig.ctx, ptr);
+}
 
-    return context.retval;
+#if LIBMEMCACHED_VERSION_HEX >= 0x00044000
+static struct {
+    memcached_malloc_fn malloc;
+    memcached_free_fn free;
+    memcached_realloc_fn realloc;
+    memcached_calloc_fn calloc;
+    void *ctx;
+    uint64_t calls;
+} PylibMC_mc_alloc_counter;
+
+static void *_PylibMC_CountedMcMalloc(const memcached_st *mc,
+                                      const size_t size, void *ctx) {
+    PylibMC_mc_alloc_counter.calls++;
+    return PylibMC_mc_alloc_counter.malloc(mc, size,
+                                           PylibMC_mc_alloc_counter.ctx);
 }
 
-static PyObject *PylibMC_Client_flush_all(PylibMC_Client *self,
-        PyObject *args, PyObject *kwds) {
-    memcached_return rc;
-    time_t expire = 0;
-    PyObject *time = NULL;
+static void *_PylibMC_CountedMcCalloc(const memcached_st *mc, size_t nelem,
+                                      const size_t elsize, void *ctx) {
+    PylibMC_mc_alloc_counter.calls++;
+    return PylibMC_mc_alloc_counter.calloc(mc, nelem, elsize,
+                                           PylibMC_mc_alloc_counter.ctx);
+}
 
-    static char *kws[] = { "time", NULL };
+static void *_PylibMC_CountedMcRealloc(const memcached_st *mc, void *ptr,
+                                       const size_t size, void *ctx) {
+    PylibMC_mc_alloc_counter.calls++;
+    return PylibMC_mc_alloc_counter.realloc(mc, ptr, size,
+                                            PylibMC_mc_alloc_counter.ctx);
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O!:flush_all", kws,
-                                     &PyLong_Type, &time))
+static void _PylibMC_CountedMcFree(const memcached_st *mc, void *ptr,
+                                   void *ctx) {
+    PylibMC_mc_alloc_counter.free(mc, ptr, PylibMC_mc_alloc_counter.ctx);
+}
+#endif
+
+/* Call `func` with the allocators counted, those of `client` too if given;
+ * returns (result, counts). Not reentrant, and allocations by threads running
+ * meanwhile count too. */
+static PyObject *PylibMC_count_allocations(PyObject *self, PyObject *args) {
+    static const PyMemAllocatorDomain domains[3] = {
+        PYMEM_DOMAIN_RAW, PYMEM_DOMAIN_MEM, PYMEM_DOMAIN_OBJ
+    };
+    static bool counting = false;
+    PyObject *func, *counts;
+    PyObject *result;
+    PylibMC_Client *client = NULL;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "O|O!:_count_allocations", &func,
+                          &PylibMC_ClientType, &client)) {
         return NULL;
+    }
 
-    if (time != NULL)
-        expire = PyLong_AS_LONG(time);
+    if (counting) {
+        PyErr_SetString(PyExc_RuntimeError, "already counting allocations");
+        return NULL;
+    }
 
-    expire = (expire > 0) ? expire : 0;
+#if LIBMEMCACHED_VERSION_HEX >= 0x00044000
+    if (client != NULL) {
+        memcached_return rc;
 
-    Py_BEGIN_ALLOW_THREADS;
-    rc = memcached_flush(self->mc, expire);
-    Py_END_ALLOW_THREADS;
-    if (rc != MEMCACHED_SUCCESS)
-        return PylibMC_ErrFromMemcached(self, "flush_all", rc);
+        memcached_get_memory_allocators(client->mc,
+            &PylibMC_mc_alloc_counter.malloc, &PylibMC_mc_alloc_counter.free,
+            &PylibMC_mc_alloc_counter.realloc,
+            &PylibMC_mc_alloc_counter.calloc);
+        PylibMC_mc_alloc_counter.ctx =
+            memcached_get_memory_allocators_context(client->mc);
+        PylibMC_mc_alloc_counter.calls = 0;
+        rc = memcached_set_memory_allocators(client->mc,
+            _PylibMC_CountedMcMalloc, _PylibMC_CountedMcFree,
+            _PylibMC_CountedMcRealloc, _PylibMC_CountedMcCalloc, NULL);
+        if (rc != MEMCACHED_SUCCESS) {
+            return PylibMC_ErrFromMemcached(client, "memcached_set_memory_allocators", rc);
+        }
+    }
+#else
+    if (client != NULL) {
+        PyErr_SetString(PyExc_NotImplementedError,
+                        "libmemcached allocators cannot be counted");
+        return NULL;
+    }
+#endif
 
-    Py_RETURN_TRUE;
-}
+    counting = true;
+    for (i = 0; i < 3; i++) {
+        pylibmc_alloc_counter *c = &PylibMC_alloc_counters[i];
+        PyMemAllocatorEx counted = {
+            c, _PylibMC_CountedMalloc, _PylibMC_CountedCalloc,
+            _PylibMC_CountedRealloc, _PylibMC_CountedFree
+        };
 
-static PyObject *PylibMC_Client_disconnect_all(PylibMC_Client *self) {
-    Py_BEGIN_ALLOW_THREADS;
-    memcached_quit(self->mc);
-    Py_END_ALLOW_THREADS;
-    Py_RETURN_NONE;
-}
+        PyMem_GetAllocator(domains[i], &c->orig);
+        c->calls = 0;
+        PyMem_SetAllocator(domains[i], &counted);
+    }
 
-static PyObject *PylibMC_Client_clone(PylibMC_Client *self) {
-    /* Essentially this is a reimplementation of the allocator, only it uses a
-     * cloned memcached_st for mc. */
-    PylibMC_Client *clone;
+    result = PyObject_CallObject(func, NULL);
 
-    clone = (PylibMC_Client *)PyType_GenericNew(Py_TYPE(self), NULL, NULL);
-    if (clone == NULL) {
+    for (i = 0; i < 3; i++) {
+        PyMem_SetAllocator(domains[i], &PylibMC_alloc_counters[i].orig);
+    }
+    counting = false;
+
+#if LIBMEMCACHED_VERSION_HEX >= 0x00044000
+    if (client != NULL) {
+        memcached_set_memory_allocators(client->mc,
+            PylibMC_mc_alloc_counter.malloc, PylibMC_mc_alloc_counter.free,
+            PylibMC_mc_alloc_counter.realloc, PylibMC_mc_alloc_counter.calloc,
+            PylibMC_mc_alloc_counter.ctx);
+    }
+#endif
+
+    if (result == NULL) {
+        return NULL;
+    }
+    counts = Py_BuildValue("{sKsKsK}",
+        "raw", (unsigned PY_LONG_LONG)PylibMC_alloc_counters[0].calls,
+        "mem", (unsigned PY_LONG_LONG)PylibMC_alloc_counters[1].calls,
+        "obj", (unsigned PY_LONG_LONG)PylibMC_alloc_counters[2].calls);
+    if (counts == NULL) {
+        Py_DECREF(result);
         return NULL;
     }
+#if LIBMEMCACHED_VERSION_HEX >= 0x00044000
+    if (client != NULL) {
+        PyObject *calls = PyLong_FromUnsignedLongLong(
+            PylibMC_mc_alloc_counter.calls);
 
-    Py_BEGIN_ALLOW_THREADS;
-    clone->mc = memcached_clone(NULL, self->mc);
-    Py_END_ALLOW_THREADS;
-    clone->native_serialization = self->native_serialization;
-    clone->native_deserialization = self->native_deserialization;
-    clone->pickle_protocol = self->pickle_protocol;
-    return (PyObject *)clone;
+        if (calls == NULL
+                || PyDict_SetItemString(counts, "libmemcached", calls) < 0) {
+            Py_XDECREF(calls);
+            Py_DECREF(counts);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(calls);
+    }
+#endif
+    return Py_BuildValue("(NN)", result, counts);
 }
 /* }}} */
+/* }}} */
 
 static PyObject *_exc_by_rc(memcached_return rc) {
     PylibMC_McErr *err;
@@ -2428,13 +6263,14 @@ static PyObject *_PylibMC_Pickle(PylibMC_Client *self, PyObject *val) {
  * reference to a normalized key (possibly the original object itself).
  * On error (code == 0), no references are created.
  */
-static int _key_normalized_obj(PyObject **key) {
+static int _key_normalized_obj(PylibMC_Client *self, PyObject **key) {
     int rc;
     char *key_str;
     Py_ssize_t key_sz;
     PyObject *orig_key = *key;
     PyObject *retval = orig_key;
     PyObject *encoded_key = NULL;
+    PyObject *hashed_key = NULL;
 
     if (*key == NULL) {
         PyErr_SetString(PyExc_ValueError, "key must be given");
@@ -2462,8 +6298,10 @@ static int _key_normalized_obj(PyObject **key) {
 
     key_str = PyBytes_AS_STRING(retval);
     key_sz = PyBytes_GET_SIZE(retval);
-    rc = _key_normalized_str(&key_str, &key_sz);
-    if (rc == 2) {
+    rc = _key_mapped_str(self, &key_str, &key_sz, &hashed_key);
+    if (rc && hashed_key != NULL) {
+        retval = hashed_key;
+    } else if (rc == 2) {
         retval = PyBytes_FromStringAndSize(key_str, key_sz);
         if (retval != NULL) {
             rc = 1;
@@ -2507,6 +6345,222 @@ static int _key_normalized_str(char **str, Py_ssize_t *size) {
     return 1;
 }
 
+/**
+ * Normalize a key, mapping it to its hashed form if it is too long and the
+ * hash_long_keys behavior is on.
+ *
+ * On success (code != 0), *hashed is either NULL or a new reference to a
+ * bytes object holding the hashed key, which *str then points into.
+ */
+static int _key_mapped_str(PylibMC_Client *self, char **str, Py_ssize_t *size,
+                           PyObject **hashed) {
+    *hashed = NULL;
+
+    if (*str != NULL && *size >= MEMCACHED_MAX_KEY && self->hash_long_keys) {
+        if ((*hashed = _key_hashed_obj(*str, *size)) == NULL) {
+            return 0;
+        }
+        *str = PyBytes_AS_STRING(*hashed);
+        *size = PyBytes_GET_SIZE(*hashed);
+        return 1;
+    }
+
+    return _key_normalized_str(str, size);
+}
+
+/**
+ * Digest a key with MurmurHash3 (x64, 128-bit, seed 0). Blocks are read
+ * little-endian, so the digest is the same on every platform.
+ */
+static uint64_t _key_digest_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t _key_digest_load(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t _key_digest_fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void _key_digest(const char *str, Py_ssize_t size, unsigned char out[16]) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const unsigned char *data = (const unsigned char *)str;
+    unsigned char tail[16] = { 0 };
+    Py_ssize_t i, rest = size & 15;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+
+    for (i = 0; i + 16 <= size; i += 16) {
+        k1 = _key_digest_load(data + i);
+        k2 = _key_digest_load(data + i + 8);
+
+        k1 *= c1; k1 = _key_digest_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = _key_digest_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = _key_digest_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = _key_digest_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    /* The tail is zero-padded, which leaves the unused bytes out of it. */
+    memcpy(tail, data + i, rest);
+    k1 = _key_digest_load(tail);
+    k2 = _key_digest_load(tail + 8);
+    if (rest > 8) {
+        k2 *= c2; k2 = _key_digest_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (rest > 0) {
+        k1 *= c1; k1 = _key_digest_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (uint64_t)size;
+    h2 ^= (uint64_t)size;
+    h1 += h2;
+    h2 += h1;
+    h1 = _key_digest_fmix(h1);
+    h2 = _key_digest_fmix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    for (i = 0; i < 8; i++) {
+        out[i] = (unsigned char)(h1 >> (8 * i));
+        out[i + 8] = (unsigned char)(h2 >> (8 * i));
+    }
+}
+
+/**
+ * Build the hashed form of a long key: its first PYLIBMC_LONG_KEY_HEAD bytes,
+ * so keys stay recognizable on the server, then the hex digest of it all.
+ *
+ * Returns a new reference, or NULL with an exception set.
+ */
+static PyObject *_key_hashed_obj(const char *str, Py_ssize_t size) {
+    PyObject *hashed;
+
+    if ((hashed = PyBytes_FromStringAndSize(NULL, PYLIBMC_LONG_KEY_LEN)) == NULL) {
+        return NULL;
+    }
+
+    _key_hashed_str(PyBytes_AS_STRING(hashed), str, size);
+    return hashed;
+}
+
+/* As _key_hashed_obj, but into `dest`, which has room for
+ * PYLIBMC_LONG_KEY_LEN bytes. Needs no GIL. */
+static void _key_hashed_str(char *dest, const char *str, Py_ssize_t size) {
+    assert(size >= PYLIBMC_LONG_KEY_HEAD);
+
+    memcpy(dest, str, PYLIBMC_LONG_KEY_HEAD);
+    _key_digest_hex(str, size, dest + PYLIBMC_LONG_KEY_HEAD);
+}
+
+/* The digest of _key_digest as 32 lowercase hex digits, not NUL-terminated. */
+static void _key_digest_hex(const char *str, Py_ssize_t size, char out[32]) {
+    static const char hexdigits[] = "0123456789abcdef";
+    unsigned char digest[16];
+
+    _key_digest(str, size, digest);
+    for (int i = 0; i < 16; i++) {
+        *out++ = hexdigits[digest[i] >> 4];
+        *out++ = hexdigits[digest[i] & 0xf];
+    }
+}
+
+/**
+ * Normalize a key without creating new objects, long keys under
+ * hash_long_keys aside.
+ *
+ * On success (code != 0), *str and *size refer to the key as held by `key`
+ * itself: the bytes buffer, or the UTF-8 form a str caches (which for ASCII
+ * strings is the string data). They stay valid for as long as `key` does.
+ * If the key was hashed, they refer to *hashed instead, a new reference.
+ *
+ * A key that is to be sent after a prefix of `prefix_len` bytes is left as
+ * it is; _PylibMC_KeyBufPrefixMapped checks and maps it once prefixed.
+ */
+static int _key_normalized_buf(PylibMC_Client *self, PyObject *key,
+                               Py_ssize_t prefix_len,
+                               char **str, Py_ssize_t *size,
+                               PyObject **hashed) {
+    int rc;
+
+    *hashed = NULL;
+
+    if (PyUnicode_Check(key)) {
+        if ((*str = (char *)PyUnicode_AsUTF8AndSize(key, size)) == NULL) {
+            return 0;
+        }
+    } else if (PyBytes_Check(key)) {
+        *str = PyBytes_AS_STRING(key);
+        *size = PyBytes_GET_SIZE(key);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "key must be bytes");
+        return 0;
+    }
+
+    if (prefix_len) {
+        return 1;
+    }
+
+    rc = _key_mapped_str(self, str, size, hashed);
+    /* A mutated key would need a buffer of its own. */
+    assert(rc != 2);
+    return rc;
+}
+
+/**
+ * Check a key the way libmemcached does with verify_keys on the text
+ * protocol: every byte must satisfy isgraph() in the C locale, i.e. lie in
+ * 0x21 through 0x7e. The bulk of the key is checked eight bytes at a time.
+ *
+ * Returns 1 if the key is acceptable, 0 otherwise.
+ */
+static int _key_verified_str(const char *str, Py_ssize_t size) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    Py_ssize_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w, del;
+
+        memcpy(&w, str + i, 8);
+        del = w ^ (0x7f * ones);
+
+        /* any byte >= 0x80, any byte < 0x21, any byte == 0x7f */
+        if ((w & highs)
+                || ((w - 0x21 * ones) & ~w & highs)
+                || ((del - ones) & ~del & highs)) {
+            return 0;
+        }
+    }
+
+    for (; i < size; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c < 0x21 || c > 0x7e) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Whether libmemcached verifies key contents, which it only does for the
+ * text protocol. */
+static int _PylibMC_verify_keys(PylibMC_Client *self) {
+    return memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_VERIFY_KEY)
+        && !memcached_behavior_get(self->mc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL);
+}
+
 static int _init_sasl(void) {
 #if LIBMEMCACHED_WITH_SASL_SUPPORT
     int rc;
@@ -2649,11 +6703,19 @@ static void _make_behavior_consts(PyObject *mod) {
 }
 
 static PyMethodDef PylibMC_functions[] = {
+    {"set_tracer", (PyCFunction)PylibMC_set_tracer, METH_O,
+        "Set the callable that traces every client's operations, or None."},
+    {"get_tracer", (PyCFunction)PylibMC_get_tracer, METH_NOARGS,
+        "Return the callable set with set_tracer, or None."},
+    {"_count_allocations", (PyCFunction)PylibMC_count_allocations,
+        METH_VARARGS, "Call a function, counting calls to the Python "
+        "allocators, and to those of a client's memcached_st if given."},
     {NULL, NULL, 0, NULL}
 };
 
 MOD_INIT(_pylibmc) {
     PyObject *module;
+    static bool atfork_set = false;
 
     MOD_DEF(module, "_pylibmc", "Hand-made wrapper for libmemcached.\n\
 \n\
@@ -2676,6 +6738,15 @@ by using comma-separation. Good luck with that.\n", PylibMC_functions);
     if (!_init_sasl())
         return MOD_ERROR_VAL;
 
+    /* Clients check PylibMC_forks before they use their connections. */
+    if (!atfork_set) {
+        if (pthread_atfork(NULL, NULL, _PylibMC_AfterForkChild) != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "pthread_atfork failed");
+            return MOD_ERROR_VAL;
+        }
+        atfork_set = true;
+    }
+
     if (PyType_Ready(&PylibMC_ClientType) < 0) {
         return MOD_ERROR_VAL;
     }
@@ -40,6 +40,18 @@
 
 #include <Python.h>
 #include <libmemcached/memcached.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #ifndef LIBMEMCACHED_VERSION_HEX
 #  define LIBMEMCACHED_VERSION_HEX 0x0
@@ -77,6 +89,8 @@ enum PylibMC_Flags {
     PYLIBMC_FLAG_LONG    = (1 << 2),
     PYLIBMC_FLAG_ZLIB    = (1 << 3),
     PYLIBMC_FLAG_TEXT    = (1 << 4),
+    /* pylibmc only: the item is a manifest of chunks, see chunk_size */
+    PYLIBMC_FLAG_CHUNKED = (1 << 5),
 };
 
 #define PYLIBMC_FLAG_TYPES (PYLIBMC_FLAG_PICKLE | PYLIBMC_FLAG_INTEGER | \
@@ -86,8 +100,32 @@ enum PylibMC_Flags {
 /* Behaviors that only affects pylibmc (i.e. not memached_set_behavior etc) */
 enum PylibMC_Behaviors {
     PYLIBMC_BEHAVIOR_PICKLE_PROTOCOL = 0xcafe0000,
+    PYLIBMC_BEHAVIOR_HASH_LONG_KEYS = 0xcafe0001,
+    PYLIBMC_BEHAVIOR_CHUNK_SIZE = 0xcafe0002,
+    PYLIBMC_BEHAVIOR_LATENCY_HISTOGRAMS = 0xcafe0003,
+    PYLIBMC_BEHAVIOR_SERVER_COUNTERS = 0xcafe0004,
+    PYLIBMC_BEHAVIOR_KEY_SAMPLING = 0xcafe0005,
+    PYLIBMC_BEHAVIOR_ADAPTIVE_TIMEOUT = 0xcafe0006,
 };
 
+/* Distributions that pylibmc works out itself, see pylibmc_buckets */
+enum PylibMC_Distributions {
+    PYLIBMC_DISTRIBUTION_JUMP = 0x0cafe100,
+    PYLIBMC_DISTRIBUTION_RENDEZVOUS = 0x0cafe101,
+};
+
+/* With hash_long_keys, keys of MEMCACHED_MAX_KEY bytes or more are stored
+ * under their first PYLIBMC_LONG_KEY_HEAD bytes followed by the hex digest
+ * of the whole key, making PYLIBMC_LONG_KEY_LEN bytes in all. */
+#define PYLIBMC_LONG_KEY_HEAD 128
+#define PYLIBMC_LONG_KEY_LEN (PYLIBMC_LONG_KEY_HEAD + 32)
+
+/* With chunk_size, values larger than it are stored as chunks under keys
+ * derived from the key and the value digest, and the key itself holds a
+ * manifest of the chunks. */
+#define PYLIBMC_CHUNK_KEY_SUFFIX_MAX (sizeof(":chunk::") - 1 + 16 + 10)
+#define PYLIBMC_CHUNK_MANIFEST_MAX 96
+
 /* Python 3 stuff */
 #ifndef PyVarObject_HEAD_INIT
 #define PyVarObject_HEAD_INIT(type, size)       \
@@ -109,7 +147,7 @@ typedef struct {
 
   /* the objects that must be freed after the mset is executed */
   PyObject *key_obj;
-  PyObject *prefixed_key_obj;
+  PyObject *hashed_key_obj;
   PyObject *value_obj;
 
   /* the success of executing the mset afterwards */
@@ -117,10 +155,45 @@ typedef struct {
 
 } pylibmc_mset;
 
+/* A key as given to a multi operation, and its normalized form. `key` is
+ * borrowed from `obj`, from a pylibmc_keybuf when prefixed, or from `hashed`
+ * for keys that are too long, prefix included, under hash_long_keys; it is
+ * NULL when verify_keys is on and memcached would reject the key. */
+typedef struct {
+  PyObject *obj;
+  PyObject *hashed;
+  char *key;
+  Py_ssize_t key_len;
+} pylibmc_key;
+
+/* Open-addressed index from normalized keys to their position in an array
+ * of pylibmc_key, used to map result keys back to the objects given. */
+typedef struct {
+  Py_ssize_t *slots;
+  size_t mask;
+} pylibmc_keyindex;
+
+/* Scratch space for the prefixed keys of a multi operation. Every prefixed
+ * key of one call is packed back-to-back into a single allocation, so that
+ * key_prefix costs one allocation per call rather than one per key. */
+typedef struct {
+  char *buf;
+  Py_ssize_t used;
+  Py_ssize_t size;
+} pylibmc_keybuf;
+
 typedef struct {
   char **keys;
   Py_ssize_t nkeys;
   size_t *key_lens;
+  /* from _PylibMC_Instrumented; counters from _PylibMC_Counters, as
+   * _fetch_multi runs without the GIL */
+  bool instrumented;
+  struct pylibmc_server_counters *counters;
+  /* _PylibMC_Now() to give up by and return what has come, or 0 */
+  uint64_t deadline;
+  /* carry on past failed servers, noting them in failed */
+  bool partial;
 } pylibmc_mget_req;
 
 typedef struct {
@@ -128,6 +201,9 @@ typedef struct {
   char *err_func;
   memcached_result_st *results;
   Py_ssize_t nresults;
+  /* nservers flags, set for servers whose keys may be missing, or NULL */
+  uint8_t *failed;
+  uint32_t nservers;
 } pylibmc_mget_res;
 
 typedef struct {
@@ -144,11 +220,12 @@ typedef struct {
   memcached_server_st *servers;  /* DEPRECATED */
   memcached_stat_st *stats;
   int index;
+  /* ints and floats as such, other values as str, rather than all bytes */
+  int typed;
 } _PylibMC_StatsContext;
 
 static PyObject *_exc_by_rc(memcached_return);
 static void _free_multi_result(pylibmc_mget_res);
-static pylibmc_mget_res _fetch_multi(memcached_st *, pylibmc_mget_req);
 
 /* {{{ Exceptions */
 static PyObject *PylibMCExc_Error;
@@ -250,6 +327,12 @@ static PylibMC_Behavior PylibMC_behaviors[] = {
     { MEMCACHED_BEHAVIOR_DEAD_TIMEOUT, "dead_timeout" },
 #endif
     { PYLIBMC_BEHAVIOR_PICKLE_PROTOCOL, "pickle_protocol" },
+    { PYLIBMC_BEHAVIOR_HASH_LONG_KEYS, "hash_long_keys" },
+    { PYLIBMC_BEHAVIOR_CHUNK_SIZE, "chunk_size" },
+    { PYLIBMC_BEHAVIOR_LATENCY_HISTOGRAMS, "latency_histograms" },
+    { PYLIBMC_BEHAVIOR_SERVER_COUNTERS, "server_counters" },
+    { PYLIBMC_BEHAVIOR_KEY_SAMPLING, "key_sampling" },
+    { PYLIBMC_BEHAVIOR_ADAPTIVE_TIMEOUT, "adaptive_timeout" },
     { 0, NULL }
 };
 
@@ -288,11 +371,184 @@ static PylibMC_Behavior PylibMC_distributions[] = {
     { MEMCACHED_DISTRIBUTION_CONSISTENT_WEIGHTED, "consistent_weighted" },
     { MEMCACHED_DISTRIBUTION_VIRTUAL_BUCKET, "virtual_bucket" },
     { MEMCACHED_DISTRIBUTION_CONSISTENT_MAX, "consistent_max" },
+    { PYLIBMC_DISTRIBUTION_JUMP, "jump" },
+    { PYLIBMC_DISTRIBUTION_RENDEZVOUS, "rendezvous" },
 #endif
     { 0, NULL }
 };
 /* }}} */
 
+/* {{{ Latency histograms
+ * Client-side latency of each operation, in nanoseconds, bucketed the way
+ * HdrHistogram does it: values below 2 * PYLIBMC_HIST_SUB are exact, larger
+ * ones keep PYLIBMC_HIST_SUB_BITS significant bits, i.e. within 1/16th.
+ * Values are capped at 2^PYLIBMC_HIST_MAX_BITS ns, about 18 minutes.
+ */
+#define PYLIBMC_HIST_SUB_BITS 4
+#define PYLIBMC_HIST_SUB (1 << PYLIBMC_HIST_SUB_BITS)
+#define PYLIBMC_HIST_MAX_BITS 40
+#define PYLIBMC_HIST_BUCKETS \
+    ((PYLIBMC_HIST_MAX_BITS - PYLIBMC_HIST_SUB_BITS + 1) * PYLIBMC_HIST_SUB)
+
+typedef enum {
+    PYLIBMC_OP_GET,
+    PYLIBMC_OP_GETS,
+    PYLIBMC_OP_GET_MULTI,
+    PYLIBMC_OP_SET,
+    PYLIBMC_OP_SET_MULTI,
+    PYLIBMC_OP_CAS,
+    PYLIBMC_OP_INCR,
+    PYLIBMC_OP_INCR_MULTI,
+    PYLIBMC_OP_DELETE,
+    PYLIBMC_OP_DELETE_MULTI,
+    PYLIBMC_OP_TOUCH,
+    PYLIBMC_OP_COUNT
+} PylibMC_Op;
+
+/* Indexed by PylibMC_Op. The set family (add, replace, append, prepend) is
+ * recorded as set, and decr as incr. */
+static const char *PylibMC_op_names[PYLIBMC_OP_COUNT] = {
+    "get", "gets", "get_multi", "set", "set_multi", "cas",
+    "incr", "incr_multi", "delete", "delete_multi", "touch"
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[PYLIBMC_HIST_BUCKETS];
+} pylibmc_histogram;
+/* }}} */
+
+/* {{{ Per-server counters
+ * What this client has asked of each server and how that went, indexed by
+ * server position. */
+typedef struct pylibmc_server_counters {
+    uint64_t requests;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t timeouts;
+    uint64_t connection_resets;
+    uint64_t ejections;
+} pylibmc_server_counters;
+/* }}} */
+
+/* {{{ Bucket distributions
+ * With the jump or rendezvous distribution, keys hash as usual into one of
+ * PYLIBMC_BUCKETS buckets, and each bucket goes to the server that jump
+ * consistent hashing of the bucket picks, or that weighted rendezvous
+ * hashing of the bucket against the server names does. libmemcached routes
+ * by the table as a virtual bucket distribution, one copy per memcached_st;
+ * pylibmc keeps one, shared by reference count across clones. */
+#define PYLIBMC_BUCKETS (1 << 14)
+
+typedef struct {
+    Py_ssize_t refcnt;
+    uint32_t servers[PYLIBMC_BUCKETS];
+} pylibmc_buckets;
+/* }}} */
+
+/* {{{ Adaptive timeouts
+ * With adaptive_timeout = k, the latency of each server is tracked as a
+ * smoothed mean and mean deviation, the way TCP estimates round-trip times,
+ * and a call to the server waits at most mean + k * deviation for it, within
+ * PYLIBMC_TIMEOUT_MIN_MS and _poll_timeout. Until a server has answered
+ * PYLIBMC_TIMEOUT_SAMPLES calls, _poll_timeout applies as it is. */
+#define PYLIBMC_TIMEOUT_MIN_MS 5
+#define PYLIBMC_TIMEOUT_SAMPLES 16
+
+typedef struct {
+    /* nanoseconds */
+    int64_t mean;
+    int64_t deviation;
+    uint64_t samples;
+    uint64_t started;
+} pylibmc_server_timing;
+/* }}} */
+
+/* {{{ Meta protocol
+ * libmemcached doesn't speak the meta commands (mg, ms, md and ma), so the
+ * client keeps connections of its own for them, one per server position,
+ * made with its connect_timeout, socket behaviors and credentials. Every
+ * wait on them is held to poll_timeout, and a server is given up on for
+ * retry_timeout after server_failure_limit failures in a row, as
+ * libmemcached does with its own connections. */
+#define PYLIBMC_META_KEY_MAX 250
+
+typedef struct {
+    int fd;
+    uint32_t failures;
+    /* _PylibMC_Now() before which the server isn't tried again, or 0 */
+    uint64_t retry_at;
+} pylibmc_meta_conn;
+
+/* The requests of one call to one server, and its answers. The buffers are
+ * raw memory, as they are filled with the GIL released. */
+typedef struct {
+    uint32_t server;
+    int fd;
+    char *out;
+    size_t out_len, out_size, out_sent;
+    /* the position among the keys of each request, by opaque */
+    Py_ssize_t *reqs;
+    Py_ssize_t nreqs, reqs_size;
+    char *in;
+    size_t in_len, in_size;
+    /* how far in the answers run complete */
+    size_t scanned;
+    bool done;
+    memcached_return rc;
+    int err;
+} pylibmc_meta_batch;
+/* }}} */
+
+/* {{{ Key sampling
+ * One in `rate` gets and sets is sampled: its key goes into a space-saving
+ * top-K summary of the PYLIBMC_HOT_KEYS most frequent keys, its value size
+ * into a reservoir of PYLIBMC_SIZE_SAMPLES sizes. The PYLIBMC_BIG_VALUES
+ * largest values are looked for in every get and set, sampled or not. */
+#define PYLIBMC_HOT_KEYS 64
+#define PYLIBMC_SIZE_SAMPLES 1024
+#define PYLIBMC_BIG_VALUES 8
+
+typedef struct {
+    uint64_t hash;
+    /* sampled occurrences, or bytes for big values */
+    uint64_t count;
+    /* how much of count may belong to keys evicted before this one */
+    uint64_t error;
+    uint8_t key_len;
+    char key[MEMCACHED_MAX_KEY];
+} pylibmc_key_sample;
+
+typedef struct {
+    uint32_t rate;
+    uint64_t rng;
+    uint32_t nhot;
+    pylibmc_key_sample hot[PYLIBMC_HOT_KEYS];
+    uint64_t nsizes;
+    uint64_t size_min;
+    uint64_t size_max;
+    uint64_t size_sum;
+    uint32_t sizes[PYLIBMC_SIZE_SAMPLES];
+    uint32_t nbig;
+    pylibmc_key_sample big[PYLIBMC_BIG_VALUES];
+} pylibmc_sampler;
+/* }}} */
+
+/* {{{ Tracing
+ * The callable given to _pylibmc.set_tracer, or NULL. One for the whole
+ * process, like a tracer provider; every client reports to it. */
+static PyObject *PylibMC_tracer = NULL;
+/* }}} */
+
+/* {{{ Fork safety
+ * Bumped in the child of every fork. A client made before the last fork
+ * shares its sockets with the parent, or a sibling, and must not use them. */
+static volatile unsigned long PylibMC_forks = 0;
+/* }}} */
+
 /* {{{ _pylibmc.client */
 typedef struct {
     PyObject_HEAD
@@ -301,6 +557,37 @@ typedef struct {
     uint8_t native_serialization;
     uint8_t native_deserialization;
     int pickle_protocol;
+    uint8_t hash_long_keys;
+    uint32_t chunk_size;
+    /* PYLIBMC_OP_COUNT histograms, or NULL unless latency_histograms */
+    pylibmc_histogram *latency;
+    /* ncounters entries, grown as servers are used */
+    uint8_t count_servers;
+    pylibmc_server_counters *counters;
+    uint32_t ncounters;
+    /* NULL unless key_sampling */
+    pylibmc_sampler *sampler;
+    /* ntimings entries, grown as servers are used */
+    uint32_t adaptive_timeout;
+    pylibmc_server_timing *timings;
+    uint32_t ntimings;
+    /* any of latency, count_servers, sampler or adaptive_timeout */
+    uint8_t instrumented;
+    /* _poll_timeout, while a call runs with its own */
+    int32_t poll_timeout;
+    /* PYLIBMC_DISTRIBUTION_*, or 0 for one of libmemcached's */
+    uint32_t distribution;
+    /* NULL unless distribution is set and there are servers */
+    pylibmc_buckets *buckets;
+    /* "host:port" to weight, for the servers given a weight other than 1 */
+    PyObject *weights;
+    /* nmeta entries, grown as servers are used */
+    pylibmc_meta_conn *meta;
+    uint32_t nmeta;
+    /* b"username password" for the meta connections, or NULL */
+    PyObject *meta_auth;
+    /* PylibMC_forks when mc was made */
+    unsigned long forks;
 } PylibMC_Client;
 
 /* {{{ Prototypes */
@@ -326,13 +613,30 @@ static PyObject *PylibMC_Client_get_multi(PylibMC_Client *, PyObject *, PyObject
 static PyObject *PylibMC_Client_set_multi(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_add_multi(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_delete_multi(PylibMC_Client *, PyObject *, PyObject *);
+static PyObject *PylibMC_Client_route_multi(PylibMC_Client *, PyObject *, PyObject *);
+static PyObject *PylibMC_Client_meta(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_hash(PylibMC_Client *, PyObject *args, PyObject *kwds);
 static PyObject *PylibMC_Client_get_behaviors(PylibMC_Client *);
 static PyObject *PylibMC_Client_set_behaviors(PylibMC_Client *, PyObject *);
-static PyObject *PylibMC_Client_get_stats(PylibMC_Client *, PyObject *);
+static PyObject *PylibMC_Client_get_stats(PylibMC_Client *, PyObject *,
+                                          PyObject *);
 static PyObject *PylibMC_Client_flush_all(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_disconnect_all(PylibMC_Client *);
+static PyObject *PylibMC_Client_connect_all(PylibMC_Client *, PyObject *, PyObject *);
 static PyObject *PylibMC_Client_clone(PylibMC_Client *);
+static PyObject *PylibMC_Client_update_servers(PylibMC_Client *, PyObject *,
+                                               PyObject *);
+static int _PylibMC_AddServers(PylibMC_Client *, memcached_st *, PyObject *,
+                               PyObject *);
+static PyObject *PylibMC_Client_latency_stats(PylibMC_Client *, PyObject *,
+                                              PyObject *);
+static PyObject *PylibMC_Client_reset_latency_stats(PylibMC_Client *);
+static PyObject *PylibMC_Client_server_counters(PylibMC_Client *);
+static PyObject *PylibMC_Client_hot_keys(PylibMC_Client *, PyObject *,
+                                         PyObject *);
+static PyObject *PylibMC_Client_value_size_distribution(PylibMC_Client *,
+                                                        PyObject *, PyObject *);
+static PyObject *PylibMC_Client_server_timeouts(PylibMC_Client *);
 static PyObject *PylibMC_Client_touch(PylibMC_Client *, PyObject *);
 static PyObject *PylibMC_ErrFromMemcachedWithKey(PylibMC_Client *, const char *,
         memcached_return, const char *, Py_ssize_t);
@@ -341,34 +645,145 @@ static PyObject *PylibMC_ErrFromMemcached(PylibMC_Client *, const char *,
 static PyObject *_PylibMC_Unpickle(PylibMC_Client *, const char *, Py_ssize_t);
 static PyObject *_PylibMC_Unpickle_Bytes(PylibMC_Client *, PyObject *);
 static PyObject *_PylibMC_Pickle(PylibMC_Client *, PyObject *);
-static int _key_normalized_obj(PyObject **);
+static int _key_normalized_obj(PylibMC_Client *, PyObject **);
 static int _key_normalized_str(char **, Py_ssize_t *);
+static int _key_normalized_buf(PylibMC_Client *, PyObject *, Py_ssize_t,
+                               char **, Py_ssize_t *, PyObject **);
+static int _key_mapped_str(PylibMC_Client *, char **, Py_ssize_t *,
+                           PyObject **);
+static void _key_digest(const char *, Py_ssize_t, unsigned char[16]);
+static void _key_digest_hex(const char *, Py_ssize_t, char[32]);
+static void _key_hashed_str(char *, const char *, Py_ssize_t);
+static PyObject *_key_hashed_obj(const char *, Py_ssize_t);
+static int _key_verified_str(const char *, Py_ssize_t);
+static int _PylibMC_verify_keys(PylibMC_Client *);
+static Py_ssize_t _PylibMC_NormalizeKeys(PylibMC_Client *, PyObject *,
+                                         const char *, Py_ssize_t,
+                                         pylibmc_key **, pylibmc_keybuf *);
+static void _PylibMC_FreeKeys(pylibmc_key *, Py_ssize_t);
+static int _PylibMC_KeyIndexInit(pylibmc_keyindex *, pylibmc_key *, Py_ssize_t);
+static pylibmc_key *_PylibMC_KeyIndexLookup(pylibmc_keyindex *, pylibmc_key *,
+                                            const char *, Py_ssize_t);
+static void _PylibMC_KeyIndexFree(pylibmc_keyindex *);
 static int _PylibMC_serialize_user(PylibMC_Client *, PyObject *, PyObject **, uint32_t *);
 static int _PylibMC_serialize_native(PylibMC_Client *, PyObject *, PyObject **, uint32_t *);
 static PyObject *_PylibMC_deserialize_native(PylibMC_Client *, PyObject *, char *, Py_ssize_t, uint32_t);
 static int _PylibMC_SerializeValue(PylibMC_Client *self,
                                    PyObject *key_obj,
-                                   PyObject *key_prefix,
+                                   Py_ssize_t prefix_len,
                                    PyObject *value_obj,
                                    time_t time,
                                    pylibmc_mset *serialized);
 static void _PylibMC_FreeMset(pylibmc_mset*);
+static int _PylibMC_KeyBufInit(pylibmc_keybuf *, Py_ssize_t);
+static char *_PylibMC_KeyBufPrefix(pylibmc_keybuf *, const char *, Py_ssize_t,
+                                   const char *, Py_ssize_t);
+static int _PylibMC_KeyBufPrefixMapped(PylibMC_Client *, pylibmc_keybuf *,
+                                       const char *, Py_ssize_t,
+                                       char **, Py_ssize_t *, PyObject **);
+static void _PylibMC_KeyBufFree(pylibmc_keybuf *);
 static PyObject *_PylibMC_RunSetCommandSingle(PylibMC_Client *self,
         _PylibMC_SetCommand f, char *fname, PyObject *args, PyObject *kwds);
 static PyObject *_PylibMC_RunSetCommandMulti(PylibMC_Client *self,
         _PylibMC_SetCommand f, char *fname, PyObject *args, PyObject *kwds);
-static bool _PylibMC_RunSetCommand(PylibMC_Client *self,
+static memcached_return _PylibMC_RunSetCommand(PylibMC_Client *self,
                                    _PylibMC_SetCommand f, char *fname,
                                    pylibmc_mset *msets, Py_ssize_t nkeys,
                                    Py_ssize_t min_compress,
                                    int compress_level);
+static Py_ssize_t _PylibMC_ChunkKey(char *, const char *, Py_ssize_t,
+                                    const char *, unsigned int);
+static memcached_return _PylibMC_SetChunked(memcached_st *,
+        _PylibMC_SetCommand, const char *, Py_ssize_t, const char *,
+        Py_ssize_t, time_t, uint32_t, uint32_t);
+static PyObject *_PylibMC_GetChunked(PylibMC_Client *, const char *,
+        Py_ssize_t, const char *, Py_ssize_t, uint32_t);
+static pylibmc_mget_res _fetch_multi(PylibMC_Client *, pylibmc_mget_req);
+static PyObject *_PylibMC_StatValue(const char *, Py_ssize_t, int);
+static bool _PylibMC_ServerFailure(memcached_return);
+#if LIBMEMCACHED_VERSION_HEX >= 0x00039000
+static int _PylibMC_ServerIndex(PylibMC_Client *, memcached_server_instance_st);
+#endif
+static void _PylibMC_MarkFailed(PylibMC_Client *, pylibmc_mget_res *, bool);
+static PyObject *_PylibMC_ServerName(PylibMC_Client *, uint32_t);
+static PyObject *_PylibMC_ServerPositions(PylibMC_Client *);
+static bool _PylibMC_ServersCarry(PylibMC_Client *, PyObject *);
+static PyObject *_PylibMC_PartialResult(PylibMC_Client *, PyObject *,
+        pylibmc_mget_res *, char **, size_t *, Py_ssize_t,
+        pylibmc_keyindex *, pylibmc_key *);
 static int _PylibMC_Deflate(char *value, Py_ssize_t value_len,
                             char **result, Py_ssize_t *result_len,
                             int compress_level);
 static int _PylibMC_Inflate(char *value, Py_ssize_t size,
                             char** result, Py_ssize_t* result_size,
                             char** failure_reason);
-static bool _PylibMC_IncrDecr(PylibMC_Client *, pylibmc_incr *, Py_ssize_t);
+static memcached_return _PylibMC_IncrDecr(PylibMC_Client *, pylibmc_incr *,
+                                          Py_ssize_t);
+static void _PylibMC_InstrumentedUpdate(PylibMC_Client *);
+static bool _PylibMC_Instrumented(PylibMC_Client *);
+static int _PylibMC_LatencyEnable(PylibMC_Client *, int);
+static uint64_t _PylibMC_Now(void);
+static uint64_t _PylibMC_LatencyStart(PylibMC_Client *);
+static void _PylibMC_LatencyRecord(PylibMC_Client *, PylibMC_Op, uint64_t);
+static uint32_t _PylibMC_Jump(uint64_t, uint32_t);
+static pylibmc_buckets *_PylibMC_BucketsBuild(PylibMC_Client *, uint32_t);
+static void _PylibMC_BucketsRelease(pylibmc_buckets *);
+static bool _PylibMC_BucketsApply(PylibMC_Client *);
+static bool _PylibMC_BucketsUpdate(PylibMC_Client *);
+static bool _PylibMC_SetDistribution(PylibMC_Client *, long);
+static void _PylibMC_AfterForkChild(void);
+static bool _PylibMC_ForkCheck(PylibMC_Client *);
+static bool _PylibMC_ForkReset(PylibMC_Client *);
+static int _PylibMC_CountersEnable(PylibMC_Client *, int);
+static pylibmc_server_counters *_PylibMC_Counters(PylibMC_Client *);
+static pylibmc_server_counters *_PylibMC_CounterFor(PylibMC_Client *,
+        pylibmc_server_counters *, const char *, Py_ssize_t);
+static pylibmc_server_counters *_PylibMC_CounterForFailure(PylibMC_Client *,
+        pylibmc_server_counters *);
+static void _PylibMC_CountSent(pylibmc_server_counters *, Py_ssize_t);
+static void _PylibMC_CountDone(pylibmc_server_counters *, memcached_return,
+                               Py_ssize_t);
+static void _PylibMC_CountError(pylibmc_server_counters *, memcached_return);
+static int _PylibMC_TimingsEnable(PylibMC_Client *, long);
+static pylibmc_server_timing *_PylibMC_Timings(PylibMC_Client *);
+static pylibmc_server_timing *_PylibMC_TimeoutFor(PylibMC_Client *,
+        pylibmc_server_timing *, const char *, Py_ssize_t);
+static void _PylibMC_TimeoutDone(PylibMC_Client *, pylibmc_server_timing *,
+                                 memcached_return);
+static int32_t _PylibMC_TimeoutOf(PylibMC_Client *, pylibmc_server_timing *,
+                                  int32_t);
+static int64_t _PylibMC_TimeoutCap(int32_t);
+static bool _PylibMC_DeadlineWait(memcached_st *, uint64_t, int32_t);
+static int _PylibMC_SamplerEnable(PylibMC_Client *, long);
+static void _PylibMC_SampleKey(PylibMC_Client *, const char *, Py_ssize_t);
+static void _PylibMC_SampleValue(PylibMC_Client *, const char *, Py_ssize_t,
+                                 Py_ssize_t);
+static PyObject *_PylibMC_TraceStart(PylibMC_Client *, PylibMC_Op, Py_ssize_t,
+                                     const char *, Py_ssize_t);
+static PyObject *_PylibMC_TraceCall(PylibMC_Client *, PylibMC_Op, Py_ssize_t,
+                                    const char *, Py_ssize_t);
+static void _PylibMC_TraceEnd(PylibMC_Client *, PyObject *, memcached_return,
+                              Py_ssize_t, Py_ssize_t);
+static Py_ssize_t _PylibMC_MsetBytes(pylibmc_mset *, Py_ssize_t);
+static Py_ssize_t _PylibMC_ResultBytes(pylibmc_mget_res *);
+static pylibmc_meta_conn *_PylibMC_MetaConns(PylibMC_Client *);
+static void _PylibMC_MetaReset(PylibMC_Client *);
+static memcached_return _PylibMC_MetaConnect(PylibMC_Client *,
+                                             pylibmc_meta_batch *);
+static memcached_return _PylibMC_MetaWait(int, short, int);
+static memcached_return _PylibMC_MetaAuth(PylibMC_Client *, int);
+static bool _PylibMC_MetaAppend(pylibmc_meta_batch *, const char *, size_t);
+static bool _PylibMC_MetaRequest(pylibmc_meta_batch *, Py_ssize_t,
+                                 const char *, const char *, size_t, bool,
+                                 bool, const char *, Py_ssize_t,
+                                 pylibmc_mset *);
+static size_t _PylibMC_MetaBase64(const char *, size_t, char *);
+static void _PylibMC_MetaScan(pylibmc_meta_batch *);
+static void _PylibMC_MetaExchange(PylibMC_Client *, pylibmc_meta_batch *,
+                                  size_t);
+static PyObject *_PylibMC_MetaError(PylibMC_Client *, pylibmc_meta_batch *);
+static bool _PylibMC_MetaResults(PylibMC_Client *, pylibmc_meta_batch *,
+                                 PyObject *);
 
 /* }}} */
 
@@ -414,21 +829,55 @@ static PyMethodDef PylibMC_ClientType_methods[] = {
         METH_VARARGS|METH_KEYWORDS, "Delete multiple keys at once."},
     {"hash", (PyCFunction)PylibMC_Client_hash,
         METH_VARARGS|METH_KEYWORDS, "Hash value of *key*."},
+    {"route_multi", (PyCFunction)PylibMC_Client_route_multi,
+        METH_VARARGS|METH_KEYWORDS,
+        "Positions of the servers *keys* map to, in one call."},
+    {"meta", (PyCFunction)PylibMC_Client_meta, METH_VARARGS|METH_KEYWORDS,
+        "meta(command, keys, flags=b'', values=None, key_prefix=None, "
+        "quiet=False) -> "
+        "[response, ...]\n\n"
+        "Send the meta command *command* with *flags* for each of *keys*, "
+        "pipelined to all servers at once, and return the response to "
+        "each: (status, flags, value), None if it went unanswered or was "
+        "never sent, or the error of its server."},
     {"get_behaviors", (PyCFunction)PylibMC_Client_get_behaviors, METH_NOARGS,
         "Get behaviors dict."},
     {"set_behaviors", (PyCFunction)PylibMC_Client_set_behaviors, METH_O,
         "Set behaviors dict."},
     {"get_stats", (PyCFunction)PylibMC_Client_get_stats,
-        METH_VARARGS, "Retrieve statistics from all memcached servers."},
+        METH_VARARGS|METH_KEYWORDS, "Retrieve statistics from all memcached servers."},
     {"flush_all", (PyCFunction)PylibMC_Client_flush_all,
         METH_VARARGS|METH_KEYWORDS, "Flush all data on all servers."},
     {"disconnect_all", (PyCFunction)PylibMC_Client_disconnect_all, METH_NOARGS,
         "Disconnect from all servers and reset own state."},
+    {"connect_all", (PyCFunction)PylibMC_Client_connect_all,
+        METH_VARARGS|METH_KEYWORDS,
+        "connect_all(timeout=None) -> positions of the servers not connected\n\n"
+        "Connect to every server not yet connected, waiting at most timeout "
+        "seconds on each, if given, instead of connect_timeout."},
     {"clone", (PyCFunction)PylibMC_Client_clone, METH_NOARGS,
         "Clone this client entirely such that it is safe to access from "
         "another thread. This creates a new connection."},
+    {"update_servers", (PyCFunction)PylibMC_Client_update_servers,
+        METH_VARARGS|METH_KEYWORDS,
+        "Replace the server list, or append to it, without a new client."},
     {"touch", (PyCFunction)PylibMC_Client_touch, METH_VARARGS,
         "Change the TTL of a key."},
+    {"latency_stats", (PyCFunction)PylibMC_Client_latency_stats,
+        METH_VARARGS|METH_KEYWORDS,
+        "Summarize the latency histograms, in microseconds, by operation."},
+    {"reset_latency_stats", (PyCFunction)PylibMC_Client_reset_latency_stats,
+        METH_NOARGS, "Clear the latency histograms."},
+    {"server_counters", (PyCFunction)PylibMC_Client_server_counters,
+        METH_NOARGS, "Retrieve this client's own counters for each server."},
+    {"hot_keys", (PyCFunction)PylibMC_Client_hot_keys,
+        METH_VARARGS|METH_KEYWORDS, "Retrieve the most frequently used keys."},
+    {"value_size_distribution",
+        (PyCFunction)PylibMC_Client_value_size_distribution,
+        METH_VARARGS|METH_KEYWORDS,
+        "Summarize the sizes of values got and set, and the largest ones."},
+    {"server_timeouts", (PyCFunction)PylibMC_Client_server_timeouts,
+        METH_NOARGS, "Retrieve the adaptive timeout of each server."},
     {NULL, NULL, 0, NULL}
 };
 /* }}} */
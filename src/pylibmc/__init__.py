@@ -74,6 +74,9 @@ from _pylibmc import __version__
 from .consts import hashers, distributions
 from .client import Client
 from .pools import ClientPool, ThreadMappedPool
+from .hedging import HedgedReads
+from .replication import ReplicatedWrites
+from .meta import MetaClient
 
 def build_info():
     return ("pylibmc %s for libmemcached %s (compression=%s, sasl=%s)"
@@ -83,4 +86,5 @@ def build_info():
                support_sasl))
 
 __all__ = ["hashers", "distributions", "Client",
-           "ClientPool", "ThreadMappedPool"] + dir(_pylibmc)
+           "ClientPool", "ThreadMappedPool", "HedgedReads",
+           "ReplicatedWrites", "MetaClient"] + dir(_pylibmc)
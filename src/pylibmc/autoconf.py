@@ -1,5 +1,8 @@
 "Autoconfiguration"
 
+import socket
+import threading
+
 import pylibmc
 
 class UnsupportedAutoconfMethod(Exception):
@@ -8,54 +11,139 @@ class UnsupportedAutoconfMethod(Exception):
 class NoAutoconfFound(Exception):
     pass
 
-def _elasticache_config_get(address, key):
-    import socket
-    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
+def _elasticache_config_get(address, key, timeout=None):
     host, port = address.split(':')
     port = int(port)
-    sock.connect((host, port))
-    sock.send((f'config get {key}\r\n').encode('ascii'))
-    state = 'wait-nl-header'
-    nbytes = 0
-    buff = b''
-    while True:
-        chunk = sock.recv(4096)
-        if not chunk:
-            raise RuntimeError('failed reading cluster config')
-        buff += chunk
-        if state.startswith('wait-nl-') and b'\r\n' not in buff:
-            continue
-        elif state == 'wait-nl-header':
-            line, buff = buff.split(b'\r\n', 1)
-            if line.lower() == b'error':
-                raise UnsupportedAutoconfMethod()
-            cmd, key, flags, nbytes = line.split()
-            flags, nbytes = int(flags), int(nbytes)
-            state = 'read-body'
-        elif state == 'ready-body':
-            if len(buff) < nbytes:
+    if isinstance(key, bytes):
+        key = key.decode('ascii')
+    with socket.create_connection((host, port), timeout) as sock:
+        sock.sendall((f'config get {key}\r\n').encode('ascii'))
+        state = 'wait-nl-header'
+        nbytes = 0
+        buff = b''
+        while True:
+            if state.startswith('wait-nl-') and b'\r\n' not in buff:
+                pass
+            elif state == 'wait-nl-header':
+                line, buff = buff.split(b'\r\n', 1)
+                if line.lower() == b'error':
+                    raise UnsupportedAutoconfMethod()
+                cmd, key, flags, nbytes = line.split()
+                flags, nbytes = int(flags), int(nbytes)
+                state = 'read-body'
                 continue
-            config, buff = buff[:nbytes], buff[nbytes+2:]
-            state = 'wait-nl-end'
-        elif state == 'wait-nl-end':
-            break
-        else:
-            raise RuntimeError(state)
+            elif state == 'read-body':
+                if len(buff) >= nbytes + 2:
+                    config, buff = buff[:nbytes], buff[nbytes+2:]
+                    state = 'wait-nl-end'
+                    continue
+            elif state == 'wait-nl-end':
+                line, buff = buff.split(b'\r\n', 1)
+                if line != b'END':
+                    raise RuntimeError(f'unexpected {line!r} after config')
+                break
+            else:
+                raise RuntimeError(state)
+            chunk = sock.recv(4096)
+            if not chunk:
+                raise RuntimeError('failed reading cluster config')
+            buff += chunk
     return config
 
-def _parse_elasticache_config(cfg):
-    ver, nodes = cfg.split(b'\n')
+def _parse_elasticache_config_version(cfg):
+    "The version of the config *cfg*, bumped each time it changes, and its hosts"
+    ver, nodes = cfg.split(b'\n', 1)
     ver, nodes = int(ver), [n.decode('ascii').split('|') for n in nodes.split()]
-    # NOTE Should probably verify ver == 12, but why not try anyways
-    return [f'{addr or cname}:{port}' for (cname, addr, port) in nodes]
+    return ver, [f'{addr or cname}:{port}' for (cname, addr, port) in nodes]
 
-def elasticache(address='127.0.0.1:11211', config_key=b'cluster',
-                mc_key='AmazonElastiCache:cluster'):
+def _parse_elasticache_config(cfg):
+    return _parse_elasticache_config_version(cfg)[1]
+
+def _elasticache_fetch(address, config_key, mc_key, timeout=None):
     try:
-        config = _elasticache_config_get(address, config_key)
+        config = _elasticache_config_get(address, config_key, timeout)
     except UnsupportedAutoconfMethod:
         config = pylibmc.Client([address]).get(mc_key)
         if config is None:
             raise NoAutoconfFound
+    return config
+
+def elasticache(address='127.0.0.1:11211', config_key=b'cluster',
+                mc_key='AmazonElastiCache:cluster'):
+    config = _elasticache_fetch(address, config_key, mc_key)
     hosts = _parse_elasticache_config(config)
     return pylibmc.Client(hosts)
+
+class AutoDiscovery(object):
+    """Keep *mc* and its clones on the servers of an ElastiCache cluster.
+
+    Every *interval* seconds, a background thread asks the configuration
+    endpoint at *address* for the cluster config, as :func:`elasticache` does,
+    and if its version has moved on, passes the new servers to *mc*'s clones.
+    The thread never touches the clients themselves, as they may be in use:
+    each one switches over on its next :meth:`Client.refresh_servers`, which
+    the pools call as they hand out clients. Servers added to the end of the
+    list keep the connections to the others.
+
+    A failed poll leaves the servers as they were and is kept in
+    :attr:`last_error`; the next poll tries again.
+
+    >>> watcher = AutoDiscovery(mc, "my-cluster.cfg.cache.amazonaws.com:11211",
+    ...                         interval=30)            # doctest: +SKIP
+    >>> watcher.start()                                 # doctest: +SKIP
+    >>> pool = pylibmc.ThreadMappedPool(mc)             # doctest: +SKIP
+    """
+
+    def __init__(self, mc, address='127.0.0.1:11211', interval=60.0,
+                 timeout=1.0, config_key=b'cluster',
+                 mc_key='AmazonElastiCache:cluster'):
+        self.mc = mc
+        self.address = address
+        self.interval = interval
+        self.timeout = timeout
+        self.config_key = config_key
+        self.mc_key = mc_key
+        self.version = None
+        self.last_error = None
+        self._stopped = threading.Event()
+        self._thread = None
+
+    def poll(self):
+        """Fetch the cluster config once, returning True if the servers changed.
+
+        Raises if the config can't be fetched.
+        """
+        config = _elasticache_fetch(self.address, self.config_key,
+                                    self.mc_key, self.timeout)
+        version, hosts = _parse_elasticache_config_version(config)
+        if version == self.version:
+            return False
+        self.version = version
+        if hosts == self.mc._topology.current[1]:
+            return False
+        self.mc._topology.publish(hosts)
+        return True
+
+    def _run(self):
+        while not self._stopped.wait(self.interval):
+            try:
+                self.poll()
+            except Exception as e:
+                self.last_error = e
+            else:
+                self.last_error = None
+
+    def start(self):
+        """Start polling in the background."""
+        if self._thread is None:
+            self._stopped.clear()
+            self._thread = threading.Thread(target=self._run, daemon=True,
+                                            name='pylibmc-autodiscovery')
+            self._thread.start()
+
+    def stop(self):
+        """Stop polling, waiting for a poll under way to finish."""
+        if self._thread is not None:
+            self._stopped.set()
+            self._thread.join()
+            self._thread = None
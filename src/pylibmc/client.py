@@ -1,5 +1,8 @@
 """Python-level wrapper client"""
 
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
 import _pylibmc
 from .consts import (hashers, distributions, all_behaviors,
                      hashers_rvs, distributions_rvs,
@@ -87,6 +90,23 @@ def translate_server_specs(servers):
         addr_tups.append(addr_tup)
     return addr_tups
 
+def _nest_stats(stats):
+    """Group per-slab stats, named "1:chunk_size" or "items:1:number", by slab
+
+    >>> _nest_stats({"1:chunk_size": 96, "items:1:number": 3, "active_slabs": 1})
+    {1: {'chunk_size': 96, 'number': 3}, 'active_slabs': 1}
+    """
+    nested = {}
+    for name, value in stats.items():
+        parts = name.split(":")
+        if parts[0] == "items":
+            parts = parts[1:]
+        if len(parts) == 2 and parts[0].isdigit():
+            nested.setdefault(int(parts[0]), {})[parts[1]] = value
+        else:
+            nested[name] = value
+    return nested
+
 def _behaviors_symbolic(behaviors):
     """Turn numeric constants into symbolic strings"""
 
@@ -122,9 +142,22 @@ def _behaviors_numeric(behaviors):
 
     return behaviors
 
+class _Topology(object):
+    "The latest server list of a client and its clones"
+
+    def __init__(self, addresses):
+        self.lock = threading.Lock()
+        self.current = (0, list(addresses))
+
+    def publish(self, addresses):
+        with self.lock:
+            version = self.current[0] + 1
+            self.current = (version, list(addresses))
+        return version
+
 class Client(_pylibmc.client):
     def __init__(self, servers, behaviors=None, binary=False,
-                 username=None, password=None):
+                 username=None, password=None, warm=False):
         """Initialize a memcached client instance.
 
         This connects to the servers in *servers*, which will default to being
@@ -136,13 +169,23 @@ class Client(_pylibmc.client):
         SASL authentication is supported if libmemcached supports it (check
         *pylibmc.support_sasl*). Requires both username and password.
         Note that SASL requires *binary*=True.
+
+        Connections are otherwise opened on first use; with *warm* True, they
+        are opened here, as by :meth:`connect_all`.
         """
         self.binary = binary
         self.addresses = list(servers)
+        # Kept for the clients of single servers made by _server_client.
+        self._username = username
+        self._password = password
+        self._topology = _Topology(self.addresses)
+        self._topology_version = 0
         super().__init__(servers=translate_server_specs(servers),
                          binary=binary,
                          username=username, password=password,
                          behaviors=_behaviors_numeric(behaviors))
+        if warm:
+            self.connect_all()
 
     def __repr__(self):
         return "{}({!r}, binary={!r})".format(self.__class__.__name__,
@@ -202,11 +245,126 @@ class Client(_pylibmc.client):
         raise AttributeError("nobody uses british spellings")
     # }}}
 
-    def clone(self):
+    def _server_client(self, address, **behaviors):
+        """A client for the server *address* alone, with the protocol,
+        credentials and behaviors of this one, *behaviors* taking over."""
+        merged = dict(self.behaviors)
+        merged.update(behaviors)
+        return type(self)([address], binary=self.binary,
+                          username=self._username, password=self._password,
+                          behaviors=merged)
+
+    # {{{ Stats
+    def collect_stats(self, kind=None, timeout=1.0, workers=16):
+        """Gather stats from all servers at once.
+
+        Each server is asked on its own connection, on up to *workers*
+        threads, and given *timeout* seconds to connect and answer. *kind*
+        is a stats subcommand, e.g. "slabs", "items" or "settings".
+
+        Returns ``(stats, failed)``: *stats* maps each server that answered,
+        as given in *addresses*, to its stats, numbers as ints and floats;
+        *failed* maps each one that did not to the error. Slab and item stats
+        are grouped by slab class.
+        """
+        ms = max(int(timeout * 1000), 1)
+        clients = getattr(self, "_stats_clients", None)
+        if clients is None or clients[0] != ms:
+            clients = self._stats_clients = (ms, {
+                address: self._server_client(address, connect_timeout=ms,
+                                             _poll_timeout=ms)
+                for address in self.addresses})
+
+        def server_stats(client):
+            [(_, stats)] = client.get_stats(kind, typed=True)
+            return _nest_stats(stats) if kind in ("slabs", "items") else stats
+
+        stats, failed = {}, {}
+        servers = clients[1]
+        with ThreadPoolExecutor(max(min(workers, len(servers)), 1)) as pool:
+            futures = {address: pool.submit(server_stats, client)
+                       for address, client in servers.items()}
+        for address, future in futures.items():
+            error = future.exception()
+            if error is None:
+                stats[address] = future.result()
+            else:
+                failed[address] = error
+        return stats, failed
+    # }}}
+
+    # {{{ Topology
+    def _apply_servers(self, addresses):
+        old = translate_server_specs(self.addresses)
+        new = translate_server_specs(addresses)
+        if len(new) > len(old) and new[:len(old)] == old:
+            super().update_servers(new[len(old):], append=True)
+        elif new != old:
+            super().update_servers(new)
+        self.addresses = list(addresses)
+        self._stats_clients = None
+
+    def update_servers(self, servers):
+        """Switch to the servers in *servers*, given as to the constructor.
+
+        Servers added to the end of the list keep the connections to the
+        others. On any other change, libmemcached reconnects to all of them,
+        as it can't remove a server or move a connection; servers that stay
+        keep their meta protocol connections, counters and timings. Behaviors
+        stay as they are.
+
+        Clones of this client, and of its clones, switch over on their next
+        :meth:`refresh_servers`, which the pools call as they hand out
+        clients.
+        """
+        addresses = list(servers)
+        self._apply_servers(addresses)
+        self._topology_version = self._topology.publish(addresses)
+
+    def refresh_servers(self):
+        """Switch to the servers last given to :meth:`update_servers` on
+        this client or any of its clones, if not done yet."""
+        version, addresses = self._topology.current
+        if version != self._topology_version:
+            self._apply_servers(addresses)
+            self._topology_version = version
+    # }}}
+
+    # {{{ Connections
+    def connect_all(self, timeout=None):
+        """Connect to every server not yet connected.
+
+        Connections are otherwise opened as requests first need them, so the
+        first requests on a new client or clone wait on them. Each server is
+        given *timeout* seconds, or the ``connect_timeout`` behavior, to
+        connect and answer. Returns the servers, as given in *addresses*,
+        that could not be reached; failing to connect is not an error here,
+        as requests will try again.
+
+        libmemcached connects to the servers one after the other, so this
+        can take up to *timeout* for each server that does not answer. To
+        warm many clients, connect them from several threads, as
+        :meth:`ClientPool.fill` does.
+        """
+        return [self.addresses[i] for i in super().connect_all(timeout)]
+
+    def clone(self, warm=False):
+        """A copy of this client, for use on another thread.
+
+        The copy opens its own connections, on first use or, with *warm*
+        True, right away.
+        """
         obj = super().clone()
         obj.addresses = list(self.addresses)
         obj.binary = self.binary
+        obj._username = self._username
+        obj._password = self._password
+        obj._topology = self._topology
+        obj._topology_version = self._topology_version
+        if warm:
+            obj.connect_all()
         return obj
+    # }}}
 
 if __name__ == "__main__":
     import doctest
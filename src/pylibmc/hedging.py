@@ -0,0 +1,159 @@
+"""Hedged reads"""
+
+import time
+import threading
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor, wait, FIRST_COMPLETED
+
+class HedgedReads(object):
+    """Hedge reads across the replicas libmemcached writes.
+
+    With the ``num_replicas`` behavior set, libmemcached stores each value on
+    the next servers after the key's own, but only reads from them once the
+    key's server has failed. A server that is merely slow, say in a long GC
+    pause, holds up every read of its keys until it answers or times out.
+
+    This helper reads from the key's server as usual, but if no answer has come
+    within *delay*, it asks the replica too and takes whichever answer comes
+    first. The delay follows the *percentile* of the latencies of the last
+    *window* reads, kept within *min_delay* and *max_delay* seconds, so about
+    (100 - *percentile*)% of reads are hedged.
+
+    Reads run on *workers* threads, each with its own clones of the client, so
+    this costs a thread handoff per read; it pays off where the tail matters
+    more than the median. Bear in mind that a replica may answer a miss or an
+    older value while the key's server would not.
+
+    >>> import pylibmc
+    >>> from pylibmc.test import make_test_client
+    >>> mc = make_test_client(binary=True, behaviors={"num_replicas": 1})
+    >>> hedged = HedgedReads(mc)
+    >>> mc.set("hedged", "value")
+    True
+    >>> hedged.get("hedged")
+    'value'
+    >>> hedged.shutdown()
+    """
+
+    def __init__(self, mc, percentile=95, min_delay=0.001, max_delay=0.05,
+                 window=1000, workers=8):
+        self.mc = mc
+        self.percentile = percentile
+        self.min_delay = min_delay
+        self.max_delay = max_delay
+        self.delay = max_delay
+        self.latencies = deque(maxlen=window)
+        self.stats = {"reads": 0, "hedged": 0, "replica_first": 0}
+        self.local = threading.local()
+        self.executor = ThreadPoolExecutor(workers)
+
+        self.hedging = (mc.behaviors.get("num_replicas", 0) > 0
+                        and len(mc.addresses) > 1)
+
+    def shutdown(self, wait=True):
+        self.executor.shutdown(wait=wait)
+
+    def _clients(self):
+        "This thread's clone of the client and its per-server clients"
+        clients = getattr(self.local, "clients", None)
+        if clients is None:
+            # One client per server to read replicas from directly.
+            servers = [self.mc._server_client(address, num_replicas=0)
+                       for address in self.mc.addresses]
+            clients = self.local.clients = (self.mc.clone(), servers)
+        return clients
+
+    def _primary(self, method, *args, **kwds):
+        t0 = time.perf_counter()
+        result = getattr(self._clients()[0], method)(*args, **kwds)
+        self._record(time.perf_counter() - t0)
+        return result
+
+    def _replica(self, server, method, *args, **kwds):
+        return getattr(self._clients()[1][server], method)(*args, **kwds)
+
+    def _record(self, latency):
+        self.latencies.append(latency)
+        if len(self.latencies) % 100 == 0:
+            ordered = sorted(self.latencies)
+            rank = int(self.percentile / 100.0 * len(ordered) + 0.5)
+            delay = ordered[min(max(rank, 1), len(ordered)) - 1]
+            self.delay = min(max(delay, self.min_delay), self.max_delay)
+
+    def _replica_of(self, key):
+        "The position of the first replica of *key*, as libmemcached picks it"
+        return (self.mc.hash(key) + 1) % len(self.mc.addresses)
+
+    def _first(self, primary, replicas):
+        """The result of *primary*, or of *replicas* if they all finish first.
+
+        If either side fails, the other one's result is used instead; if both
+        fail, the primary's error is raised.
+        """
+        pending = {primary} | set(replicas)
+        while True:
+            done, pending = wait(pending, return_when=FIRST_COMPLETED)
+            if primary in done and primary.exception() is None:
+                return primary.result(), False
+            if replicas and all(f.done() for f in replicas):
+                if all(f.exception() is None for f in replicas):
+                    return [f.result() for f in replicas], True
+                replicas = []
+            if primary.done() and not replicas:
+                # Both sides failed; the primary's error is the one to tell.
+                return primary.result(), False
+
+    def get(self, key, default=None):
+        """Get *key* like :meth:`Client.get`, hedging slow reads."""
+        self.stats["reads"] += 1
+        primary = self.executor.submit(self._primary, "get", key, default)
+        if not self.hedging:
+            return primary.result()
+        done, _ = wait([primary], timeout=self.delay)
+        if done:
+            return primary.result()
+
+        self.stats["hedged"] += 1
+        replica = self.executor.submit(self._replica, self._replica_of(key),
+                                       "get", key, default)
+        result, from_replica = self._first(primary, [replica])
+        if from_replica:
+            self.stats["replica_first"] += 1
+            result = result[0]
+        return result
+
+    def get_multi(self, keys, key_prefix=None):
+        """Get *keys* like :meth:`Client.get_multi`, hedging slow reads.
+
+        The whole batch is either answered by the keys' servers or by the
+        replicas, whichever finishes first.
+        """
+        keys = list(keys)
+        self.stats["reads"] += 1
+        kwds = {"key_prefix": key_prefix} if key_prefix else {}
+        primary = self.executor.submit(self._primary, "get_multi", keys, **kwds)
+        if not self.hedging:
+            return primary.result()
+        done, _ = wait([primary], timeout=self.delay)
+        if done:
+            return primary.result()
+
+        self.stats["hedged"] += 1
+        prefix = key_prefix or b""
+        if isinstance(prefix, str):
+            prefix = prefix.encode("utf-8")
+        groups = {}
+        for key in keys:
+            full = key.encode("utf-8") if isinstance(key, str) else key
+            groups.setdefault(self._replica_of(prefix + full), []).append(key)
+        replicas = [self.executor.submit(self._replica, server, "get_multi",
+                                         group, **kwds)
+                    for server, group in groups.items()]
+        result, from_replica = self._first(primary, replicas)
+        if from_replica:
+            self.stats["replica_first"] += 1
+            merged = {}
+            for part in result:
+                merged.update(part)
+            result = merged
+        return result
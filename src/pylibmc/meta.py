@@ -0,0 +1,282 @@
+"""Meta protocol"""
+
+import zlib
+from collections import namedtuple
+
+import _pylibmc
+
+# As in _pylibmcmodule.h
+_FLAG_ZLIB = 1 << 3
+_FLAG_CHUNKED = 1 << 5
+
+MetaValue = namedtuple("MetaValue", "value cas ttl win stale")
+MetaValue.__doc__ = """A value read with :meth:`MetaClient.get_meta`.
+
+*cas* is its CAS token and *ttl* the seconds it has left to live, or -1 if
+it never expires. *win* is true if this caller, and only this one, is to
+compute the value anew, and *stale* if the value was marked stale by an
+invalidating delete or set. *value* is None for a placeholder made by
+*vivify*.
+"""
+
+class MetaClient(object):
+    """Speak memcached's meta protocol to the servers of *mc*.
+
+    libmemcached only speaks the classic text and binary protocols. The meta
+    commands (``mg``, ``ms``, ``md`` and ``ma``, memcached 1.6 and up) do in
+    one round trip what those need several for, or can't do at all: read a
+    value with its TTL and CAS token, hand out a single win token to
+    recompute a value about to expire or just invalidated while others keep
+    reading the stale one, and pipeline quiet batches that only answer for
+    the keys that need it.
+
+    Requests go out through :meth:`Client.meta`, so keys are prefixed,
+    mapped and routed as with *mc*, values are serialized by *mc*, and the
+    connections follow its timeouts, failover behaviors and credentials;
+    the two can be used side by side. Values are not compressed when
+    stored, and values stored in chunks can't be read. Like the client,
+    this is not thread-safe; give each thread its own.
+
+    >>> from pylibmc.test import make_test_client
+    >>> mc = make_test_client()
+    >>> meta = MetaClient(mc)
+    >>> meta.set("meta", "value", time=60)             # doctest: +SKIP
+    True
+    >>> meta.get_meta("meta", recache=30)              # doctest: +SKIP
+    MetaValue(value='value', cas=12, ttl=60, win=False, stale=False)
+    """
+
+    def __init__(self, mc):
+        self.mc = mc
+
+    # {{{ Wire
+    def _single(self, command, key, flags, value=None):
+        "Run *command* with *flags* for *key*, returning the response"
+        values = [value] if command == "ms" else None
+        [response] = self.mc.meta(command, [key], flags, values)
+        if response is None:
+            raise ValueError("invalid key: %r" % (key,))
+        elif isinstance(response, Exception):
+            raise response
+        return response
+
+    def _multi(self, command, keys, key_prefix, flags, values=None,
+               quiet=False):
+        """Run *command* with *flags* for each of *keys*, returning (key,
+        response) pairs; the response is an exception for keys whose server
+        failed, and None for invalid keys and unanswered requests."""
+        keys = list(keys)
+        return list(zip(keys, self.mc.meta(command, keys, flags, values,
+                                           key_prefix, quiet)))
+    # }}}
+
+    # {{{ Values
+    def _decode(self, value, flags):
+        if flags & _FLAG_CHUNKED:
+            raise _pylibmc.NotSupportedError(
+                "values stored in chunks can't be read over the meta protocol")
+        if flags & _FLAG_ZLIB:
+            value = zlib.decompress(value)
+            flags &= ~_FLAG_ZLIB
+        try:
+            return self.mc.deserialize(value, flags)
+        except _pylibmc.CacheMiss:
+            raise KeyError
+
+    def _meta_value(self, response, placeholders):
+        status, flags, value = response
+        if status != b"VA":
+            return None
+        client_flags = int(flags.get(b"f", 0))
+        win, stale = b"W" in flags, b"X" in flags
+        if placeholders and not value and not client_flags \
+                and (win or b"Z" in flags):
+            value = None
+        else:
+            try:
+                value = self._decode(value, client_flags)
+            except KeyError:
+                return None
+        cas = int(flags[b"c"]) if b"c" in flags else None
+        ttl = int(flags[b"t"]) if b"t" in flags else None
+        return MetaValue(value, cas, ttl, win, stale)
+
+    @staticmethod
+    def _get_flags(recache, vivify, touch):
+        extra = b""
+        if recache is not None:
+            extra += b" R%d" % recache
+        if vivify is not None:
+            extra += b" N%d" % vivify
+        if touch is not None:
+            extra += b" T%d" % touch
+        return extra
+    # }}}
+
+    # {{{ Reads
+    def get(self, key, default=None):
+        """Get *key* like :meth:`Client.get`."""
+        result = self.get_meta(key)
+        return default if result is None else result.value
+
+    def get_meta(self, key, recache=None, vivify=None, touch=None):
+        """Get *key* as a :class:`MetaValue`, or None on a miss.
+
+        With *recache*, the first reader to find less than *recache* seconds
+        left on the value wins: it gets *win* set and is expected to store a
+        fresh value, while the others keep reading this one. With *vivify*, a
+        miss creates a placeholder that lives *vivify* seconds, and returns
+        it with *win* set to the first reader only, so that only one computes
+        the value. *touch* sets the value's time to live while reading it.
+        """
+        extra = self._get_flags(recache, vivify, touch)
+        response = self._single("mg", key, b"v f c t" + extra)
+        return self._meta_value(response, vivify is not None)
+
+    def get_multi(self, keys, key_prefix=None):
+        """Get *keys* like :meth:`Client.get_multi`, in one round trip.
+
+        Misses are left unanswered by the servers.
+        """
+        return {key: result.value
+                for key, result in self.get_meta_multi(keys, key_prefix).items()}
+
+    def get_meta_multi(self, keys, key_prefix=None, recache=None, vivify=None,
+                       touch=None):
+        """Get *keys* as :meth:`get_meta` does, in one round trip, returning
+        a dict of the keys found to their :class:`MetaValue`. Keys on
+        servers that could not be reached are left out."""
+        extra = self._get_flags(recache, vivify, touch)
+        results = self._multi("mg", keys, key_prefix, b"v f c t" + extra,
+                              quiet=True)
+        found = {}
+        for key, response in results:
+            if response is None or isinstance(response, Exception):
+                continue
+            result = self._meta_value(response, vivify is not None)
+            if result is not None:
+                found[key] = result
+        return found
+    # }}}
+
+    # {{{ Writes
+    @staticmethod
+    def _store_request(mode, time, cas, invalidate):
+        extra = b"T%d" % time
+        if mode is not None:
+            extra += b" M" + mode
+        if cas is not None:
+            extra += b" C%d" % cas
+        if invalidate:
+            extra += b" I"
+        return extra
+
+    def _store(self, mode, key, val, time, cas, invalidate):
+        extra = self._store_request(mode, time, cas, invalidate)
+        status, _, _ = self._single("ms", key, extra, val)
+        return status == b"HD"
+
+    def set(self, key, val, time=0, cas=None, invalidate=False):
+        """Set *key* to *val*, returning whether it was stored.
+
+        With *cas*, only if the value's CAS token still is *cas*. With
+        *invalidate* as well, a value whose token is newer is kept, but one
+        that is older is marked stale rather than replaced.
+        """
+        return self._store(None, key, val, time, cas, invalidate)
+
+    def add(self, key, val, time=0):
+        """Set *key* to *val* unless it exists, returning whether it was."""
+        return self._store(b"E", key, val, time, None, False)
+
+    def replace(self, key, val, time=0, cas=None):
+        """Set *key* to *val* if it exists, returning whether it was."""
+        return self._store(b"R", key, val, time, cas, False)
+
+    def set_multi(self, mapping, time=0, key_prefix=None):
+        """Set the keys of *mapping* like :meth:`Client.set_multi`, in one
+        round trip, returning the keys that were not stored.
+
+        Stored keys are left unanswered by the servers.
+        """
+        extra = self._store_request(None, time, None, False)
+        results = self._multi("ms", mapping.keys(), key_prefix, extra,
+                              list(mapping.values()), quiet=True)
+        return [key for key, response in results
+                if response is not None and (isinstance(response, Exception)
+                                             or response[0] != b"HD")]
+
+    def delete(self, key, cas=None, invalidate=False, time=None):
+        """Delete *key*, returning whether it existed.
+
+        With *invalidate*, the value is marked stale instead, to live on for
+        *time* seconds if given: readers asking with *recache* or *vivify*
+        get it along with the win token, one of them, to store a fresh one.
+        """
+        extra = self._delete_request(cas, invalidate, time)
+        status, _, _ = self._single("md", key, extra.lstrip())
+        return status == b"HD"
+
+    @staticmethod
+    def _delete_request(cas, invalidate, time):
+        extra = b""
+        if cas is not None:
+            extra += b" C%d" % cas
+        if invalidate:
+            extra += b" I"
+        if time is not None:
+            extra += b" T%d" % time
+        return extra
+
+    def delete_multi(self, keys, key_prefix=None, invalidate=False,
+                     time=None):
+        """Delete *keys* like :meth:`Client.delete_multi`, in one round trip,
+        returning whether all of them existed."""
+        extra = self._delete_request(None, invalidate, time)
+        results = self._multi("md", keys, key_prefix, extra.lstrip())
+        return all(response is not None and not isinstance(response, Exception)
+                   and response[0] == b"HD" for _, response in results)
+    # }}}
+
+    # {{{ Arithmetic
+    @staticmethod
+    def _arith_request(decr, delta, initial, time):
+        extra = b" D%d" % delta
+        if decr:
+            extra += b" MD"
+        if initial is not None:
+            extra += b" N%d J%d" % (time, initial)
+        return extra
+
+    def _arith(self, decr, key, delta, initial, time):
+        extra = self._arith_request(decr, delta, initial, time)
+        status, _, value = self._single("ma", key, b"v" + extra)
+        if status == b"NF":
+            raise _pylibmc.NotFound("%r" % (key,))
+        if status != b"VA":
+            raise _pylibmc.Failure("ma %r: %s" % (key, status.decode("ascii")))
+        return int(value)
+
+    def incr(self, key, delta=1, initial=None, time=0):
+        """Increment *key* by *delta*, returning the new value.
+
+        A missing key is an error, as with :meth:`Client.incr`, unless
+        *initial* is given: then it is created with that value, to live for
+        *time* seconds, in the same round trip.
+        """
+        return self._arith(False, key, delta, initial, time)
+
+    def decr(self, key, delta=1, initial=None, time=0):
+        """Decrement *key* by *delta* as :meth:`incr` increments it."""
+        return self._arith(True, key, delta, initial, time)
+
+    def incr_multi(self, keys, key_prefix=None, delta=1, initial=None, time=0):
+        """Increment *keys* by *delta* in one round trip, returning a dict
+        of the keys that exist, or were created from *initial*, to their
+        new values."""
+        extra = self._arith_request(False, delta, initial, time)
+        results = self._multi("ma", keys, key_prefix, b"v" + extra)
+        return {key: int(response[2]) for key, response in results
+                if response is not None and not isinstance(response, Exception)
+                and response[0] == b"VA"}
+    # }}}
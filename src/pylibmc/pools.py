@@ -2,12 +2,20 @@
 
 from contextlib import contextmanager
 from queue import Queue
+from concurrent.futures import ThreadPoolExecutor
 
 try:
     import threading
 except ImportError:
     import dummy_threading as threading
 
+def _refreshed(mc):
+    "*mc*, switched to the servers its clones were last updated with"
+    refresh = getattr(mc, "refresh_servers", None)
+    if refresh is not None:
+        refresh()
+    return mc
+
 class ClientPool(Queue):
     """Client pooling helper.
 
@@ -29,10 +37,10 @@ class ClientPool(Queue):
     True
     """
 
-    def __init__(self, mc=None, n_slots=0):
+    def __init__(self, mc=None, n_slots=0, warm=False):
         Queue.__init__(self, n_slots)
         if mc and n_slots:
-            self.fill(mc, n_slots)
+            self.fill(mc, n_slots, warm=warm)
 
     @contextmanager
     def reserve(self, block=False):
@@ -41,16 +49,27 @@ class ClientPool(Queue):
         If *block* is given and the pool is exhausted, the pool waits for
         another thread to fill it before returning.
         """
-        mc = self.get(block)
+        mc = _refreshed(self.get(block))
         try:
             yield mc
         finally:
             self.put(mc)
 
-    def fill(self, mc, n_slots):
-        """Fill *n_slots* of the pool with clones of *mc*."""
-        for i in range(n_slots):
-            self.put(mc.clone())
+    def fill(self, mc, n_slots, warm=False, workers=16):
+        """Fill *n_slots* of the pool with clones of *mc*.
+
+        With *warm* True, the clones connect to all servers before going into
+        the pool, up to *workers* of them at once, so that the first requests
+        on them don't pay for it.
+        """
+        # Refreshed first, so that no warm connection is thrown away.
+        clones = [_refreshed(mc.clone()) for i in range(n_slots)]
+        if warm and clones:
+            with ThreadPoolExecutor(max(min(workers, len(clones)), 1)) as pool:
+                for _ in pool.map(lambda clone: clone.connect_all(), clones):
+                    pass
+        for clone in clones:
+            self.put(clone)
 
 class ThreadMappedPool(dict):
     """Much like the *ClientPool*, helps you with pooling.
@@ -77,11 +96,12 @@ class ThreadMappedPool(dict):
     True
     """
 
-    def __new__(cls, master):
+    def __new__(cls, master, warm=False):
         return super().__new__(cls)
 
-    def __init__(self, master):
+    def __init__(self, master, warm=False):
         self.master = master
+        self.warm = warm
 
     @property
     def current_key(self):
@@ -92,12 +112,18 @@ class ThreadMappedPool(dict):
         """Reserve a client.
 
         Creates a new client based on the master client if none exists for the
-        current thread.
+        current thread, connected to all servers up front if the pool was made
+        with *warm* True.
         """
         key = self.current_key
         mc = self.pop(key, None)
         if mc is None:
-            mc = self.master.clone()
+            # Refreshed first, so that no warm connection is thrown away.
+            mc = _refreshed(self.master.clone())
+            if self.warm:
+                mc.connect_all()
+        else:
+            _refreshed(mc)
         try:
             yield mc
         finally:
@@ -0,0 +1,107 @@
+"""Replicated writes"""
+
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
+import _pylibmc
+
+class ReplicatedWrites(object):
+    """Write each key to *copies* servers at once and count the acks.
+
+    libmemcached's ``num_replicas`` writes the replicas one after the other
+    behind the key's own server and keeps quiet about whether they landed. This
+    helper instead sends each key to its server and the *copies* - 1 servers
+    after it, the same ones libmemcached reads replicas from, in parallel on
+    *workers* threads, and reports how many of them stored it. *copies*
+    defaults to ``num_replicas`` + 1.
+
+    A write that landed on fewer than *quorum* servers, by default a majority
+    of *copies*, is listed by :meth:`below_quorum`.
+
+    >>> import pylibmc
+    >>> from pylibmc.test import make_test_client
+    >>> mc = make_test_client(binary=True)
+    >>> writes = ReplicatedWrites(mc)
+    >>> writes.set("replicated", "value")
+    1
+    >>> writes.set_multi({"replicated": "value"})
+    {'replicated': 1}
+    >>> writes.shutdown()
+    """
+
+    def __init__(self, mc, copies=None, quorum=None, workers=8):
+        self.mc = mc
+        if copies is None:
+            copies = mc.behaviors.get("num_replicas", 0) + 1
+        self.copies = min(copies, len(mc.addresses))
+        self.quorum = self.copies // 2 + 1 if quorum is None else quorum
+        self.local = threading.local()
+        self.executor = ThreadPoolExecutor(workers)
+
+    def shutdown(self, wait=True):
+        self.executor.shutdown(wait=wait)
+
+    def _server(self, server):
+        "This thread's client for the *server*th server"
+        servers = getattr(self.local, "servers", None)
+        if servers is None:
+            # The per-server clients must not replicate on their own.
+            servers = self.local.servers = [
+                self.mc._server_client(address, num_replicas=0)
+                for address in self.mc.addresses]
+        return servers[server]
+
+    def _set_multi(self, server, mapping, kwds):
+        "Keys of *mapping* that *server* did not store"
+        try:
+            return self._server(server).set_multi(mapping, **kwds)
+        except _pylibmc.Error:
+            return list(mapping)
+
+    def servers_of(self, key):
+        "Positions of the servers *key* is written to"
+        first = self.mc.hash(key)
+        return [(first + i) % len(self.mc.addresses)
+                for i in range(self.copies)]
+
+    def set(self, key, val, time=0, min_compress_len=0, compress_level=-1):
+        """Set *key* like :meth:`Client.set`, returning the number of acks."""
+        return self.set_multi({key: val}, time=time,
+                              min_compress_len=min_compress_len,
+                              compress_level=compress_level)[key]
+
+    def set_multi(self, mapping, time=0, key_prefix=None, min_compress_len=0,
+                  compress_level=-1):
+        """Set *mapping* like :meth:`Client.set_multi`.
+
+        Returns a dict mapping each key to the number of servers that stored
+        it; one request goes to each server involved.
+        """
+        kwds = {"time": time, "min_compress_len": min_compress_len,
+                "compress_level": compress_level}
+        if key_prefix:
+            kwds["key_prefix"] = key_prefix
+        prefix = key_prefix or b""
+        if isinstance(prefix, str):
+            prefix = prefix.encode("utf-8")
+
+        groups = {}
+        for key, val in mapping.items():
+            full = key.encode("utf-8") if isinstance(key, str) else key
+            for server in self.servers_of(prefix + full):
+                groups.setdefault(server, {})[key] = val
+
+        acks = dict.fromkeys(mapping, 0)
+        futures = [(group, self.executor.submit(self._set_multi, server,
+                                                group, kwds))
+                   for server, group in groups.items()]
+        for group, future in futures:
+            failed = set(future.result())
+            for key in group:
+                if key not in failed:
+                    acks[key] += 1
+        return acks
+
+    def below_quorum(self, acks):
+        """The keys in *acks* that fewer than *quorum* servers stored."""
+        return [key for key, n in acks.items() if n < self.quorum]
@@ -0,0 +1,43 @@
+"""Tracing
+
+Every client reports to the one tracer given to :func:`pylibmc.set_tracer`,
+which is called as ``tracer(operation, key_count, server)`` when an operation
+starts. Whatever it returns is called as ``end(result, bytes_out, bytes_in)``
+when the operation is done, unless it is None. *server* is ``"host:port"``
+for single-key operations and None for batches, *result* libmemcached's
+description of how it went, e.g. ``"SUCCESS"`` or ``"NOT FOUND"``.
+"""
+
+import pylibmc
+
+class OpenTelemetryTracer(object):
+    """Report operations as client spans of an OpenTelemetry tracer.
+
+    >>> from opentelemetry import trace                     # doctest: +SKIP
+    >>> tracer = trace.get_tracer("pylibmc")                # doctest: +SKIP
+    >>> pylibmc.set_tracer(OpenTelemetryTracer(tracer))     # doctest: +SKIP
+    """
+
+    def __init__(self, tracer):
+        from opentelemetry.trace import SpanKind
+        self.tracer = tracer
+        self.kind = SpanKind.CLIENT
+
+    def __call__(self, operation, key_count, server):
+        attributes = {"db.system": "memcached",
+                      "db.operation": operation,
+                      "db.memcached.key_count": key_count}
+        if server is not None:
+            host, _, port = server.rpartition(":")
+            attributes["net.peer.name"] = host
+            attributes["net.peer.port"] = int(port)
+        span = self.tracer.start_span(operation, kind=self.kind,
+                                      attributes=attributes)
+
+        def end(result, bytes_out, bytes_in):
+            span.set_attribute("db.memcached.result", result)
+            span.set_attribute("db.memcached.bytes_out", bytes_out)
+            span.set_attribute("db.memcached.bytes_in", bytes_in)
+            span.end()
+
+        return end
@@ -0,0 +1,169 @@
+"""Allocation regression tests for the C methods.
+
+Each hot method is called many times with the Python allocators and those of
+the client's memcached_st counted, and the calls per operation are held to the
+baseline in allocations.json for the running Python version, since the interpreter's own share of them changes
+between versions. tracemalloc checks that the calls leave nothing behind.
+
+To record a baseline, e.g. for a new Python version or after making a method
+allocate less, run these tests with PYLIBMC_RECORD_ALLOCATIONS=1.
+"""
+
+import os
+import sys
+import json
+import itertools
+import tracemalloc
+
+import pytest
+
+import _pylibmc
+from pylibmc.test import make_test_client
+from tests import PylibmcTestCase
+
+BASELINE = os.path.join(os.path.dirname(__file__), 'allocations.json')
+RECORD = os.environ.get('PYLIBMC_RECORD_ALLOCATIONS')
+N = 1000
+
+C = _pylibmc.client
+
+# name: (method, args), all called on the unbound C methods to leave the
+# Python wrappers out of it.
+operations = {
+    'get': (C.get, ('alloc-key',)),
+    'get_miss': (C.get, ('alloc-missing',)),
+    'gets': (C.gets, ('alloc-key',)),
+    'set': (C.set, ('alloc-key', b'value')),
+    'set_int': (C.set, ('alloc-int', 1234)),
+    'add': (C.add, ('alloc-key', b'value')),
+    'replace': (C.replace, ('alloc-key', b'value')),
+    'append': (C.append, ('alloc-append', b'v')),
+    'prepend': (C.prepend, ('alloc-prepend', b'v')),
+    'cas': (C.cas, ('alloc-key', b'value', 1)),
+    'delete': (C.delete, ('alloc-missing',)),
+    'incr': (C.incr, ('alloc-int',)),
+    'decr': (C.decr, ('alloc-int',)),
+    'touch': (C.touch, ('alloc-key', 100)),
+    'get_multi': (C.get_multi, (['alloc-key', 'alloc-int', 'alloc-missing'],)),
+    'set_multi': (C.set_multi, ({'alloc-key': b'value', 'alloc-key2': 1},)),
+    'add_multi': (C.add_multi, ({'alloc-key': b'value'},)),
+    'delete_multi': (C.delete_multi, (['alloc-missing', 'alloc-missing2'],)),
+    'route_multi': (C.route_multi, (['alloc-key', 'alloc-int', 'alloc-missing'],)),
+    'incr_multi': (C.incr_multi, (['alloc-int'],)),
+    'serialize': (C.serialize, (b'value',)),
+    'deserialize': (C.deserialize, (b'value', 0)),
+}
+
+# Methods that are not on any hot path, and meta, whose allocations depend
+# on the server speaking the meta protocol.
+not_measured = {
+    'clone', 'connect_all', 'disconnect_all', 'flush_all', 'get_behaviors',
+    'get_stats', 'hash', 'hot_keys', 'latency_stats', 'meta',
+    'reset_latency_stats', 'server_counters', 'server_timeouts',
+    'set_behaviors', 'update_servers', 'value_size_distribution',
+}
+
+
+def python_version():
+    return '%d.%d' % sys.version_info[:2]
+
+
+def load_baseline():
+    try:
+        with open(BASELINE) as f:
+            return json.load(f)
+    except FileNotFoundError:
+        return {}
+
+
+class AllocationTests(PylibmcTestCase):
+    def setUp(self):
+        super().setUp()
+        self.mc = make_test_client(behaviors={'cas': True})
+        self.mc.set('alloc-key', b'value')
+        self.mc.set('alloc-int', 1)
+        self.mc.set('alloc-append', b'')
+        self.mc.set('alloc-prepend', b'')
+
+    def tearDown(self):
+        self.mc.delete_multi(['alloc-append', 'alloc-prepend'])
+        super().tearDown()
+
+    def _loop(self, method, args):
+        mc = self.mc
+        def loop():
+            for _ in itertools.repeat(None, N):
+                method(mc, *args)
+        return loop
+
+    def _allocations_per_op(self, method, args):
+        loop = self._loop(method, args)
+        loop()  # warm up caches and free lists
+        _, counts = _pylibmc._count_allocations(loop, self.mc)
+        return {domain: round(n / N) for domain, n in counts.items()}
+
+    def test_all_methods_covered(self):
+        methods = {name for name in dir(C)
+                   if not name.startswith('_')
+                   and callable(getattr(C, name))}
+        measured = {method.__name__ for method, _ in operations.values()}
+        assert methods - measured - not_measured == set()
+
+    def test_allocations_per_op(self):
+        baseline = load_baseline()
+        measured = {name: self._allocations_per_op(*op)
+                    for name, op in operations.items()}
+
+        if RECORD:
+            baseline[python_version()] = measured
+            with open(BASELINE, 'w') as f:
+                json.dump(baseline, f, indent=2, sort_keys=True)
+                f.write('\n')
+            return
+
+        if python_version() not in baseline:
+            pytest.skip('no allocation baseline for Python %s, record one '
+                        'with PYLIBMC_RECORD_ALLOCATIONS=1' % python_version())
+        expected = baseline[python_version()]
+        regressions = {name: (expected[name], counts)
+                       for name, counts in measured.items()
+                       if name in expected
+                       and any(counts[d] > expected[name].get(d, counts[d])
+                               for d in counts)}
+        assert regressions == {}
+
+    def _prefix_allocations(self, method, arg):
+        def call(**kwds):
+            f = lambda: method(self.mc, arg, **kwds)
+            f()
+            return _pylibmc._count_allocations(f, self.mc)[1]
+        plain, prefixed = call(), call(key_prefix=b'prefix-')
+        return {domain: prefixed[domain] - plain[domain] for domain in plain}
+
+    def test_key_prefix_allocations(self):
+        # Prefixed keys are assembled in one scratch buffer per call, so the
+        # prefix costs as many allocations for 100 keys as for 1000. (Not 10:
+        # pymalloc hands blocks over 512 bytes on to the raw domain.)
+        for n in (100, 1000):
+            keys = [b'alloc-%04d' % i for i in range(n)]
+            extra = {method.__name__: self._prefix_allocations(method, arg)
+                     for method, arg in ((C.get_multi, keys),
+                                         (C.set_multi, dict.fromkeys(keys, b'v')),
+                                         (C.delete_multi, keys),
+                                         (C.route_multi, keys))}
+            if n == 100:
+                expected = extra
+            assert extra == expected, n
+
+    def test_no_leaks(self):
+        for name, (method, args) in operations.items():
+            loop = self._loop(method, args)
+            loop()
+            tracemalloc.start()
+            try:
+                before = tracemalloc.get_traced_memory()[0]
+                loop()
+                after = tracemalloc.get_traced_memory()[0]
+            finally:
+                tracemalloc.stop()
+            assert after - before < N, name
@@ -1,3 +1,8 @@
+import time
+import threading
+import socketserver
+
+import pylibmc
 from pytest import raises
 from pylibmc import autoconf
 from tests import PylibmcTestCase
@@ -21,3 +26,105 @@ class AutoConfTests(PylibmcTestCase):
         mc = autoconf.elasticache(address=('%s:%s' % addrtup))
         assert mc.set('a', 'b')
         assert mc.get('a') == 'b'
+
+
+class ConfigServer(socketserver.ThreadingTCPServer):
+    """Stand-in for an ElastiCache configuration endpoint.
+
+    Answers ``config get cluster`` with *config*, and nothing else.
+    """
+    daemon_threads = True
+
+    def __init__(self):
+        super().__init__(("127.0.0.1", 0), ConfigHandler)
+        self.config = b""
+        self.thread = threading.Thread(target=self.serve_forever, daemon=True)
+        self.thread.start()
+
+    @property
+    def address(self):
+        return "%s:%d" % self.server_address
+
+    def set_config(self, version, servers):
+        nodes = " ".join("localhost|%s|%s" % tuple(server.split(":"))
+                         for server in servers)
+        self.config = ("%d\n%s\n" % (version, nodes)).encode("ascii")
+
+    def close(self):
+        self.shutdown()
+        self.server_close()
+
+class ConfigHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        for line in self.rfile:
+            if line.split() != [b"config", b"get", b"cluster"]:
+                self.wfile.write(b"ERROR\r\n")
+                continue
+            config = self.server.config
+            self.wfile.write(b"CONFIG cluster 0 %d\r\n%s\r\nEND\r\n"
+                             % (len(config), config))
+
+class AutoDiscoveryTests(PylibmcTestCase):
+    def setUp(self):
+        super().setUp()
+        self.server = ConfigServer()
+        self.servers = ["%s:%s" % (self.memcached_host, self.memcached_port)]
+        self.server.set_config(1, self.servers)
+
+    def tearDown(self):
+        self.server.close()
+        super().tearDown()
+
+    def test_config_get(self):
+        mc = autoconf.elasticache(address=self.server.address)
+        assert mc.addresses == self.servers
+        assert mc.set('a', 'b')
+
+    def test_poll(self):
+        mc = autoconf.elasticache(address=self.server.address)
+        clone = mc.clone()
+        watcher = autoconf.AutoDiscovery(mc, self.server.address)
+        assert not watcher.poll()
+        assert watcher.version == 1
+
+        # Nothing listens on port 1.
+        servers = self.servers + ["127.0.0.1:1"]
+        self.server.set_config(2, servers)
+        assert watcher.poll()
+        assert watcher.version == 2
+        assert clone.addresses == self.servers
+        clone.refresh_servers()
+        assert clone.addresses == servers
+
+    def test_background(self):
+        mc = autoconf.elasticache(address=self.server.address)
+        pool = pylibmc.ClientPool(mc, 1)
+        watcher = autoconf.AutoDiscovery(mc, self.server.address,
+                                         interval=0.01)
+        servers = self.servers + ["127.0.0.1:1"]
+        self.server.set_config(2, servers)
+        watcher.start()
+        try:
+            deadline = time.monotonic() + 5
+            while watcher.version != 2 and time.monotonic() < deadline:
+                time.sleep(0.01)
+        finally:
+            watcher.stop()
+        assert watcher.last_error is None
+        with pool.reserve() as smc:
+            assert smc.addresses == servers
+
+    def test_poll_failure(self):
+        mc = autoconf.elasticache(address=self.server.address)
+        self.server.close()
+        watcher = autoconf.AutoDiscovery(mc, self.server.address,
+                                         interval=0.01, timeout=0.1)
+        watcher.start()
+        try:
+            deadline = time.monotonic() + 5
+            while watcher.last_error is None and time.monotonic() < deadline:
+                time.sleep(0.01)
+        finally:
+            watcher.stop()
+        assert isinstance(watcher.last_error, OSError)
+        assert mc.addresses == self.servers
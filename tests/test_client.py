@@ -1,3 +1,4 @@
+import os
 import functools
 import time
 
@@ -42,11 +43,14 @@ class ClientTests(PylibmcTestCase):
 
     def testBehaviors(self):
         expected_behaviors = [
-            'auto_eject', 'buffer_requests', 'cas', 'connect_timeout',
-            'distribution', 'failure_limit', 'hash', 'ketama', 'ketama_hash',
-            'ketama_weighted', 'no_block', 'num_replicas', 'pickle_protocol',
-            'receive_timeout', 'retry_timeout', 'send_timeout',
-            'tcp_keepalive', 'tcp_nodelay', 'verify_keys']
+            'adaptive_timeout', 'auto_eject', 'buffer_requests', 'cas', 'chunk_size',
+            'connect_timeout', 'distribution', 'failure_limit', 'hash', 'hash_long_keys',
+            'key_sampling', 'ketama', 'ketama_hash', 'ketama_weighted',
+            'latency_histograms',
+            'no_block', 'num_replicas', 'pickle_protocol', 'receive_timeout',
+            'retry_timeout', 'send_timeout', 'server_counters', 'tcp_keepalive',
+            'tcp_nodelay',
+            'verify_keys']
 
         # Since some parts of pyblibmc's functionality depend on the
         # libmemcached version, programatically check for the expected values
@@ -113,3 +117,416 @@ class ClientTests(PylibmcTestCase):
         # formerly, this would raise a KeyError, which was incorrect
         assert mc['none-test'] is None
         assert 'none-test' in mc
+
+    def test_key_prefix_nul_bytes(self):
+        mc = make_test_client(binary=True)
+        keys = ["a\x00b", "a\x00c"]
+        assert mc.set_multi({keys[0]: 1, keys[1]: 2}, key_prefix="p\x00") == []
+        assert mc.get_multi(keys, key_prefix="p\x00") == {keys[0]: 1, keys[1]: 2}
+        assert mc.get("p\x00a\x00b") == 1
+        mc.incr_multi(keys, key_prefix="p\x00")
+        assert mc.get_multi(keys, key_prefix="p\x00") == {keys[0]: 2, keys[1]: 3}
+
+    def test_multi_verify_keys(self):
+        mc = make_test_client(behaviors={"verify_keys": True})
+        good, bad = "verified-key", "bad key"
+        assert mc.set_multi({good: 1, bad: 2}) == [bad]
+        assert mc.set_multi({good: 1}, key_prefix="bad prefix") == [good]
+        assert mc.get_multi([good]) == {good: 1}
+        with raises(pylibmc.BadKeyProvided):
+            mc.get_multi([good, bad])
+        with raises(pylibmc.Error):
+            mc.incr_multi([good, bad])
+        assert mc.delete_multi([good, bad]) is False
+        assert mc.get(good) is None
+
+    def test_get_multi_returns_given_keys(self):
+        keys = ["given-str", b"given-bytes", "given-é"]
+        self.mc.set_multi(dict.fromkeys(keys, 1))
+        result = self.mc.get_multi(keys)
+        assert result == dict.fromkeys(keys, 1)
+        assert {id(k) for k in result} == {id(k) for k in keys}
+
+    def test_hash_long_keys(self):
+        mc = make_test_client(behaviors={"hash_long_keys": True})
+        # Shares its first 128 bytes with key1, so only the digest differs.
+        key1, key2 = "x" * 300, "x" * 299 + "y"
+        with raises(ValueError):
+            self.mc.set(key1, 1)
+        assert mc.set(key1, 1)
+        assert mc.add(key2, 2)
+        assert mc.get(key1) == 1
+        assert mc.get(key2) == 2
+        # The stored key is the head of the key and its MurmurHash3 digest.
+        assert self.mc.get("x" * 128 + "1d67b72fe3ef345944d81c771d0ba5a0") == 1
+        assert mc.get_multi([key1, key2]) == {key1: 1, key2: 2}
+        assert mc.set_multi({key1: 3, key2: 4}, key_prefix="p:") == []
+        assert mc.get_multi([key1, key2], key_prefix="p:") == {key1: 3, key2: 4}
+        assert mc.incr(key1) == 2
+        mc.incr_multi([key1, key2], key_prefix="p:")
+        assert mc.get_multi([key1, key2], key_prefix="p:") == {key1: 4, key2: 5}
+        # A prefixed key is mapped as a whole, even one that only gets too
+        # long with its prefix.
+        key3 = "z" * 249
+        assert mc.get("p:" + key1) == 4
+        assert mc.set_multi({key3: 6}, key_prefix="p:") == []
+        assert mc.get("p:" + key3) == 6
+        assert mc.get_multi([key3, key1], key_prefix="p:") == {key3: 6, key1: 4}
+        assert mc.get_multi([key3], key_prefix="p:", partial=True) == \
+            ({key3: 6}, {})
+        assert mc.route_multi([key3], key_prefix="p:") == [mc.hash("p:" + key3)]
+        mc.incr_multi([key3], key_prefix="p:")
+        assert mc.get("p:" + key3) == 7
+        assert mc.delete_multi([key3], key_prefix="p:")
+        assert mc.get("p:" + key3) is None
+        with raises(ValueError):
+            self.mc.get_multi([key3], key_prefix="p:")
+        assert mc.delete(key1)
+        assert mc.delete_multi([key2])
+        assert mc.get_multi([key1, key2]) == {}
+        assert mc.clone().set(key1, 5)
+        assert mc.get(key1) == 5
+
+    def test_chunked_values(self):
+        mc = make_test_client(behaviors={"chunk_size": 256 * 1024})
+        blob = bytes(range(256)) * (8 * 1024 + 3)  # a little over 2 MB
+        with raises(pylibmc.Error):
+            self.mc.set("chunked", blob)
+        assert mc.set("chunked", blob)
+        assert mc.get("chunked") == blob
+        assert mc.get_multi(["chunked", "missing"]) == {"chunked": blob}
+        assert mc.set_multi({"chunked": blob[::-1]}, key_prefix="p:") == []
+        assert mc.get("p:chunked") == blob[::-1]
+        assert not mc.add("chunked", blob)
+        assert mc.get("chunked") == blob
+        cas_mc = make_test_client(behaviors={"chunk_size": 256 * 1024,
+                                             "cas": True})
+        value, cas = cas_mc.gets("chunked")
+        assert value == blob and cas
+        # The manifest is only stored once every chunk is.
+        big_mc = make_test_client(behaviors={"chunk_size": len(blob)})
+        with raises(pylibmc.Error):
+            big_mc.set("unchunked", blob * 2)
+        assert self.mc.get("unchunked") is None
+
+    def test_chunked_values_evicted(self):
+        mc = make_test_client(behaviors={"chunk_size": 1024})
+        assert mc.set("chunked", b"x" * 4000)
+        # Chunks are named after the key and the digest of the value.
+        chunk = "chunked:chunk:216b2013644277dc:%d"
+        assert self.mc.get(chunk % 3) == b"x" * (4000 - 3 * 1024)
+        # Losing any one chunk makes the whole value a miss.
+        assert self.mc.delete(chunk % 2)
+        assert mc.get("chunked") is None
+        assert mc.get_multi(["chunked"]) == {}
+
+    def test_latency_stats(self):
+        mc = make_test_client(behaviors={"latency_histograms": True})
+        with raises(ValueError):
+            self.mc.latency_stats()
+        for i in range(100):
+            mc.set("latency", i)
+            mc.get("latency")
+        mc.get_multi(["latency", "missing"])
+        stats = mc.latency_stats(percentiles=[0, 50, 100])
+        assert set(stats) == {"set", "get", "get_multi"}
+        get = stats["get"]
+        assert get["count"] == 100
+        assert 0 < get["min"] <= get["mean"] <= get["max"]
+        pcts = get["percentiles"]
+        assert get["min"] <= pcts[0] <= pcts[50] <= pcts[100] == get["max"]
+        assert set(mc.latency_stats()["set"]["percentiles"]) == {50, 90, 99, 99.9}
+        assert mc.clone().latency_stats() == {}
+        mc.reset_latency_stats()
+        assert mc.latency_stats() == {}
+
+    def test_server_counters(self):
+        mc = make_test_client(behaviors={"server_counters": True})
+        with raises(ValueError):
+            self.mc.server_counters()
+        mc.set("counted", b"abc")
+        assert mc.get("counted") == b"abc"
+        assert mc.get_multi(["counted", "missing"]) == {"counted": b"abc"}
+        counters = mc.server_counters()
+        assert [name for name, _ in counters] == \
+               [name for name, _ in mc.get_stats()]
+        totals = {}
+        for _, server in counters:
+            for stat, value in server.items():
+                totals[stat] = totals.get(stat, 0) + value
+        assert totals["requests"] == 4
+        assert totals["bytes_out"] == 3 * len("counted") + len("missing") + 3
+        assert totals["bytes_in"] == 2 * (len("counted") + 3)
+        assert totals["timeouts"] == 0
+        assert all(v == 0 for _, s in mc.clone().server_counters()
+                          for v in s.values())
+
+    def test_tracer(self):
+        spans = []
+
+        def tracer(operation, key_count, server):
+            span = [operation, key_count, server]
+            spans.append(span)
+            return lambda *end: span.append(end)
+
+        mc = make_test_client()
+        assert pylibmc.get_tracer() is None
+        pylibmc.set_tracer(tracer)
+        try:
+            mc.set("traced", b"abc")
+            assert not mc.add("traced", b"x")
+            mc.get("traced")
+            mc.get_multi(["traced", "missing"])
+            with raises(pylibmc.NotFound):
+                mc.incr("missing")
+            assert pylibmc.get_tracer() is tracer
+        finally:
+            pylibmc.set_tracer(None)
+        mc.get("traced")
+        server = mc.get_stats()[0][0].split()[0].decode()
+        assert spans == [
+            ["set", 1, server, ("SUCCESS", 9, 0)],
+            ["set", 1, server, ("NOT STORED", 7, 0)],
+            ["get", 1, server, ("SUCCESS", 6, 3)],
+            ["get_multi", 2, None, ("SUCCESS", 13, 3)],
+            ["incr", 1, server, ("NOT FOUND", 7, 0)],
+        ]
+
+    def test_key_sampling(self):
+        mc = make_test_client(behaviors={"key_sampling": 1})
+        with raises(ValueError):
+            self.mc.hot_keys()
+        for i in range(100):
+            mc.set("cold-%d" % i, b"x" * i)
+            mc.get("hot")
+        mc.set("big", b"x" * 100000)
+        mc.get_multi(["hot", "big"])
+        # Counts of keys that took the place of others are overestimates.
+        (hot, count), (big, _) = mc.hot_keys(n=2)
+        assert (hot, count, big) == (b"hot", 101, b"big")
+        sizes = mc.value_size_distribution(percentiles=[0, 50, 100])
+        assert sizes["count"] == 102
+        assert sizes["min"] == 0 and sizes["max"] == 100000
+        assert sizes["percentiles"] == {0: 0, 50: 50, 100: 100000}
+        assert sizes["largest"][:2] == [(b"big", 100000), (b"cold-99", 99)]
+        mc.behaviors = {"key_sampling": 1}
+        assert mc.hot_keys() == []
+
+    def test_adaptive_timeout(self):
+        mc = make_test_client(behaviors={"adaptive_timeout": 4,
+                                         "_poll_timeout": 300})
+        with raises(ValueError):
+            self.mc.server_timeouts()
+        [(_, timing)] = mc.server_timeouts()
+        assert timing["samples"] == 0 and timing["timeout"] == 300
+        mc.set("timed", 1)
+        for i in range(20):
+            mc.get("timed")
+        [(_, timing)] = mc.server_timeouts()
+        assert timing["samples"] == 21
+        assert 5 <= timing["timeout"] <= 300
+        # The configured timeout is only the ceiling.
+        assert mc.behaviors["_poll_timeout"] == 300
+
+    def test_get_multi_deadline(self):
+        self.mc.set_multi({"dl-a": 1, "dl-b": 2})
+        assert self.mc.get_multi(["dl-a", "dl-b"], deadline=1.0) == {"dl-a": 1,
+                                                                   "dl-b": 2}
+        # Past the deadline before asking, there is nothing to return.
+        assert self.mc.get_multi(["dl-a", "dl-b"], deadline=0) == {}
+        assert self.mc.get_multi(["dl-a"], deadline=None) == {"dl-a": 1}
+
+    def test_get_stats_typed(self):
+        [(_, stats)] = self.mc.get_stats(typed=True)
+        assert isinstance(stats["pid"], int)
+        assert isinstance(stats["rusage_user"], float)
+        assert isinstance(stats["version"], str)
+        [(_, stats)] = self.mc.get_stats()
+        assert isinstance(stats["pid"], bytes)
+        [(_, settings)] = self.mc.get_stats("settings", typed=True)
+        assert isinstance(settings["maxbytes"], int)
+
+    def test_collect_stats(self):
+        # Nothing listens on port 1.
+        mc = pylibmc.Client(self.mc.addresses + ["127.0.0.1:1"])
+        stats, failed = mc.collect_stats(timeout=0.5)
+        assert list(stats) == self.mc.addresses
+        assert isinstance(stats[self.mc.addresses[0]]["pid"], int)
+        assert list(failed) == ["127.0.0.1:1"]
+        assert isinstance(failed["127.0.0.1:1"], pylibmc.Error)
+        stats, failed = self.mc.collect_stats("slabs")
+        slabs = stats[self.mc.addresses[0]]
+        assert isinstance(slabs["active_slabs"], int)
+        assert all(isinstance(slab["chunk_size"], int)
+                   for cls, slab in slabs.items() if isinstance(cls, int))
+
+    def test_server_clients(self):
+        # The clients of single servers that collect_stats, HedgedReads and
+        # ReplicatedWrites make keep the protocol and behaviors of the client.
+        mc = pylibmc.Client(self.mc.addresses, binary=True,
+                            behaviors={"tcp_nodelay": True,
+                                       "hash_long_keys": True,
+                                       "num_replicas": 1})
+        mc.collect_stats(timeout=0.5)
+        hedged = pylibmc.HedgedReads(mc)
+        writes = pylibmc.ReplicatedWrites(mc)
+        try:
+            [stats_client] = mc._stats_clients[1].values()
+            assert stats_client.behaviors["connect_timeout"] == 500
+            for client in (stats_client, hedged._clients()[1][0],
+                           writes._server(0)):
+                assert client.binary
+                assert client.behaviors["tcp_nodelay"]
+                assert client.behaviors["hash_long_keys"]
+            assert writes._server(0).behaviors["num_replicas"] == 0
+        finally:
+            hedged.shutdown()
+            writes.shutdown()
+
+        if pylibmc.support_sasl:
+            mc = pylibmc.Client(self.mc.addresses, binary=True,
+                                username="user", password="pass")
+            for client in (mc._server_client(mc.addresses[0]),
+                           mc.clone()._server_client(mc.addresses[0])):
+                assert (client._username, client._password) == ("user", "pass")
+
+    def test_get_multi_partial(self):
+        keys = ["%d" % i for i in range(20)]
+        self.mc.set_multi(dict.fromkeys(keys, 1), key_prefix="partial-")
+        values, failed = self.mc.get_multi(keys, key_prefix="partial-",
+                                           partial=True)
+        assert (values, failed) == (dict.fromkeys(keys, 1), {})
+        assert self.mc.get_multi([], partial=True) == ({}, {})
+
+        # Nothing listens on port 1.
+        mc = pylibmc.Client(self.mc.addresses + ["127.0.0.1:1"])
+        with raises(pylibmc.Error):
+            mc.get_multi(keys, key_prefix="partial-")
+        values, failed = mc.get_multi(keys, key_prefix="partial-",
+                                      partial=True)
+        assert list(failed) == ["127.0.0.1:1"]
+        assert values and failed["127.0.0.1:1"]
+        assert sorted(list(values) + failed["127.0.0.1:1"]) == sorted(keys)
+
+    def test_update_servers(self):
+        mc = pylibmc.Client(self.mc.addresses,
+                            behaviors={"server_counters": True})
+        clone = mc.clone()
+        assert mc.set("update", 1)
+        # Nothing listens on port 1.
+        mc.update_servers(self.mc.addresses + ["127.0.0.1:1"])
+        assert mc.addresses == self.mc.addresses + ["127.0.0.1:1"]
+        assert len(mc.server_counters()) == 2
+        with raises(pylibmc.Error):
+            mc.get_stats()
+        assert clone.addresses == self.mc.addresses
+        clone.refresh_servers()
+        assert clone.addresses == mc.addresses
+        requests = mc.server_counters()[0][1]["requests"]
+        assert requests
+        # Servers that stay keep their counters, wherever they end up.
+        mc.update_servers(["127.0.0.1:1"] + self.mc.addresses)
+        counters = mc.server_counters()
+        assert counters[0][1]["requests"] == 0
+        assert counters[1][1]["requests"] == requests
+        mc.update_servers(self.mc.addresses)
+        assert mc.server_counters()[0][1]["requests"] == requests
+        assert mc.get("update") == 1
+        assert mc.get_stats()
+        with raises(pylibmc.Error):
+            mc.update_servers([])
+        assert mc.addresses == self.mc.addresses
+
+    def test_route_multi(self):
+        servers = ["10.0.0.%d:11211" % i for i in range(1, 5)]
+        keys = ["route-%d" % i for i in range(100)]
+        for behaviors in ({}, {"ketama": True}):
+            mc = pylibmc.Client(servers, behaviors=behaviors)
+            routes = mc.route_multi(keys)
+            assert routes == [mc.hash(key) for key in keys]
+            assert set(routes) == set(range(4))
+            assert mc.route_multi(keys, key_prefix="p:") == \
+                   [mc.hash("p:" + key) for key in keys]
+        mc = pylibmc.Client(servers, behaviors={"verify_keys": True})
+        assert mc.route_multi(["a b", "", b"ok"]) == [None, None, mc.hash("ok")]
+        with raises(ValueError):
+            mc.route_multi(["x" * 250], key_prefix="y" * 10)
+
+    def test_jump_distribution(self):
+        servers = ["10.0.0.%d:11211" % i for i in range(1, 5)]
+        mc = pylibmc.Client(servers, behaviors={"distribution": "jump"})
+        assert mc.behaviors["distribution"] == "jump"
+        keys = ["jump-%d" % i for i in range(4000)]
+        routes = mc.route_multi(keys)
+        counts = [routes.count(i) for i in range(4)]
+        assert min(counts) > len(keys) / 4 * 0.8
+        assert mc.clone().route_multi(keys) == routes
+        mc.update_servers(servers + ["10.0.0.5:11211"])
+        moved = sum(r != p for r, p in zip(mc.route_multi(keys), routes))
+        assert 0 < moved < len(keys) / 2
+        mc.behaviors = {"distribution": "modula"}
+        assert mc.behaviors["distribution"] == "modula"
+
+    def test_rendezvous_distribution(self):
+        servers = ["10.0.0.%d:11211:%d" % (i, 2 if i == 1 else 1)
+                   for i in range(1, 5)]
+        mc = pylibmc.Client(servers, behaviors={"distribution": "rendezvous"})
+        assert mc.behaviors["distribution"] == "rendezvous"
+        keys = ["rendezvous-%d" % i for i in range(4000)]
+        addresses = [a.rsplit(":", 1)[0] for a in servers]
+        before = [addresses[r] for r in mc.route_multi(keys)]
+        assert before.count(addresses[0]) > before.count(addresses[1]) * 1.5
+        del servers[2]
+        mc.update_servers(servers)
+        after = [addresses[r if r < 2 else r + 1] for r in mc.route_multi(keys)]
+        assert all(a == b for a, b in zip(after, before) if b != addresses[2])
+
+    def test_bucket_distribution_roundtrip(self):
+        for distribution in ("jump", "rendezvous"):
+            mc = make_test_client(behaviors={"distribution": distribution})
+            assert mc.set("bucketed", distribution)
+            assert mc.get("bucketed") == distribution
+
+    def test_connect_all(self):
+        servers = self.mc.addresses + ["127.0.0.1:1"]
+        mc = pylibmc.Client(servers)
+        assert mc.connect_all(timeout=0.5) == ["127.0.0.1:1"]
+        assert mc.clone(warm=True).connect_all(timeout=0.5) == ["127.0.0.1:1"]
+        assert make_test_client(warm=True).connect_all() == []
+        with raises(ValueError):
+            mc.connect_all(timeout=0)
+
+    def test_clone_shared_config(self):
+        servers = ["10.0.0.%d:11211:%d" % (i, i) for i in range(1, 4)]
+        mc = pylibmc.Client(servers, behaviors={"distribution": "rendezvous"})
+        keys = ["clone-%d" % i for i in range(1000)]
+        routes = mc.route_multi(keys)
+        clones = [mc.clone() for _ in range(3)]
+        assert all(c.route_multi(keys) == routes for c in clones)
+        clones[0].update_servers(servers + ["10.0.0.4:11211:4"])
+        assert clones[0].route_multi(keys) != routes
+        assert mc.route_multi(keys) == clones[1].route_multi(keys) == routes
+        del mc
+        assert clones[1].clone().route_multi(keys) == routes
+
+    def test_fork_safe(self):
+        if not hasattr(os, "fork"):
+            skip("needs os.fork")
+        mc = make_test_client(behaviors={"distribution": "jump"})
+        assert mc.set("forked", "parent")
+        pid = os.fork()
+        if pid == 0:
+            ok = False
+            try:
+                # touch comes first, to be the call that resets the client.
+                ok = (mc.touch("forked", 100)
+                      and mc.get("forked") == "parent"
+                      and mc.clone().get("forked") == "parent")
+                mc.disconnect_all()
+            finally:
+                os._exit(0 if ok else 1)
+        _, status = os.waitpid(pid, 0)
+        assert os.WEXITSTATUS(status) == 0
+        assert mc.get("forked") == "parent"
+        assert mc.set("forked", "still")
+        assert mc.get("forked") == "still"
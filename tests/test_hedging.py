@@ -0,0 +1,76 @@
+import time
+
+import pylibmc
+from pytest import raises
+from pylibmc.test import make_test_client
+from tests import PylibmcTestCase
+
+class HedgedReadsTests(PylibmcTestCase):
+    def make_hedged(self, **kwds):
+        mc = make_test_client(binary=True, behaviors={"num_replicas": 1})
+        # The same server twice is enough to have a replica to read from.
+        mc = pylibmc.Client(mc.addresses * 2, binary=True,
+                            behaviors={"num_replicas": 1})
+        return mc, pylibmc.HedgedReads(mc, **kwds)
+
+    def test_unhedged(self):
+        mc = make_test_client(binary=True)
+        hedged = pylibmc.HedgedReads(mc, min_delay=0, max_delay=0)
+        try:
+            assert mc.set("hedge-a", 1)
+            assert hedged.get("hedge-a") == 1
+            assert hedged.get("hedge-missing", 2) == 2
+            assert hedged.get_multi(["hedge-a", "hedge-missing"]) == {"hedge-a": 1}
+            assert hedged.stats == {"reads": 3, "hedged": 0, "replica_first": 0}
+        finally:
+            hedged.shutdown()
+
+    def test_hedged(self):
+        # With no delay every read is hedged.
+        mc, hedged = self.make_hedged(min_delay=0, max_delay=0)
+        try:
+            assert mc.set_multi({"hedge-a": 1, "hedge-b": 2}, key_prefix="p:") == []
+            for i in range(10):
+                assert hedged.get("p:hedge-a") == 1
+                assert hedged.get("hedge-missing", 3) == 3
+                assert hedged.get_multi(["hedge-a", "hedge-b", "hedge-c"],
+                                        key_prefix="p:") == {"hedge-a": 1,
+                                                             "hedge-b": 2}
+            stats = hedged.stats
+            assert stats["reads"] == 30
+            assert stats["replica_first"] <= stats["hedged"] <= 30
+        finally:
+            hedged.shutdown()
+
+    def test_delay_follows_latency(self):
+        mc, hedged = self.make_hedged(percentile=50, min_delay=0.001,
+                                      max_delay=1.0, window=100)
+        try:
+            for i in range(100):
+                hedged._record(0.002 if i % 2 else 0.5)
+            assert hedged.delay == 0.002
+            for i in range(100):
+                hedged._record(5.0)
+            assert hedged.delay == 1.0
+        finally:
+            hedged.shutdown()
+
+    def test_both_fail(self):
+        mc, hedged = self.make_hedged(min_delay=0, max_delay=0)
+
+        def failing(name, delay):
+            def read(*args, **kwds):
+                time.sleep(delay)
+                raise pylibmc.ServerDown(name)
+            return read
+        try:
+            # Whichever side fails first, the primary's error comes out.
+            for primary_delay, replica_delay in ((0.05, 0), (0.01, 0.05)):
+                hedged._primary = failing("primary", primary_delay)
+                hedged._replica = failing("replica", replica_delay)
+                with raises(pylibmc.ServerDown, match="primary"):
+                    hedged.get("hedge-a")
+                with raises(pylibmc.ServerDown, match="primary"):
+                    hedged.get_multi(["hedge-a", "hedge-b"])
+        finally:
+            hedged.shutdown()
@@ -0,0 +1,300 @@
+import os
+import time
+import uuid
+import socket
+import threading
+import socketserver
+
+import pylibmc
+from pytest import raises
+from pylibmc.meta import MetaClient, MetaValue
+from tests import PylibmcTestCase
+
+def fleet():
+    """The servers bin/with-memcached started, or None."""
+    servers = os.environ.get("MEMCACHED_SERVERS")
+    return servers.split(",") if servers else None
+
+class MetaClientTests(PylibmcTestCase):
+    """Against the test server, which must be memcached 1.6 or later, or
+    the servers in MEMCACHED_SERVERS, as bin/with-memcached starts them, to
+    pipeline to several at once."""
+
+    def setUp(self):
+        if fleet():
+            self.mc = pylibmc.Client(fleet())
+        else:
+            super().setUp()
+        self.meta = MetaClient(self.mc)
+        # Keys of their own, as the server outlives the tests.
+        self.p = "meta:%s:" % uuid.uuid4().hex
+        [probe] = self.mc.meta("mg", [self.p], b"v")
+        if isinstance(probe, pylibmc.ProtocolError):
+            self.skipTest("the test server does not speak the meta protocol")
+        elif isinstance(probe, Exception):
+            raise probe
+
+    def k(self, key):
+        return self.p + key
+
+    def test_get_set(self):
+        meta, k = self.meta, self.k
+        assert meta.get(k("missing")) is None
+        assert meta.get(k("missing"), 1) == 1
+        for val in ("text", b"bytes", 123, 1.5, {"a": [1]}, None):
+            assert meta.set(k("key"), val)
+            assert meta.get(k("key"), "default") == val
+        assert not meta.add(k("key"), 1)
+        assert meta.add(k("new"), 1)
+        assert meta.replace(k("new"), 2)
+        assert not meta.replace(k("missing"), 2)
+        assert meta.get(k("new")) == 2
+
+    def test_get_meta(self):
+        meta, k = self.meta, self.k
+        assert meta.get_meta(k("missing")) is None
+        meta.set(k("key"), "value", time=100)
+        result = meta.get_meta(k("key"))
+        assert isinstance(result, MetaValue)
+        assert result.value == "value"
+        assert result.cas is not None
+        assert 98 <= result.ttl <= 100
+        assert not result.win and not result.stale
+        meta.set(k("forever"), 1)
+        assert meta.get_meta(k("forever")).ttl == -1
+
+    def test_cas(self):
+        meta, k = self.meta, self.k
+        meta.set(k("key"), "a")
+        cas = meta.get_meta(k("key")).cas
+        assert meta.set(k("key"), "b", cas=cas)
+        assert not meta.set(k("key"), "c", cas=cas)
+        assert meta.get(k("key")) == "b"
+        assert not meta.delete(k("key"), cas=cas)
+        assert meta.delete(k("key"), cas=meta.get_meta(k("key")).cas)
+
+    def test_recache(self):
+        meta, k = self.meta, self.k
+        meta.set(k("key"), "value", time=10)
+        assert not meta.get_meta(k("key"), recache=5).win
+        first = meta.get_meta(k("key"), recache=30)
+        second = meta.get_meta(k("key"), recache=30)
+        assert first.win and not second.win
+        assert second.value == "value"
+
+    def test_vivify(self):
+        meta, k = self.meta, self.k
+        first = meta.get_meta(k("key"), vivify=30)
+        second = meta.get_meta(k("key"), vivify=30)
+        assert first == MetaValue(None, first.cas, first.ttl, True, False)
+        assert second.value is None and not second.win
+        assert meta.set(k("key"), "value", cas=first.cas)
+        assert meta.get_meta(k("key"), vivify=30).value == "value"
+
+    def test_invalidate(self):
+        meta, k = self.meta, self.k
+        meta.set(k("key"), "old")
+        assert meta.delete(k("key"), invalidate=True, time=30)
+        first = meta.get_meta(k("key"))
+        second = meta.get_meta(k("key"))
+        assert first.stale and first.win and first.value == "old"
+        assert second.stale and not second.win
+        assert meta.set(k("key"), "new", cas=first.cas)
+        assert not meta.get_meta(k("key")).stale
+
+    def test_get_multi(self):
+        meta = self.meta
+        keys = ["key%d" % i for i in range(20)]
+        assert meta.set_multi({key: i for i, key in enumerate(keys) if i % 2},
+                              key_prefix=self.p) == []
+        result = meta.get_multi(keys + ["missing"], key_prefix=self.p)
+        assert result == {key: i for i, key in enumerate(keys) if i % 2}
+        metas = meta.get_meta_multi(["key1", "key2"], key_prefix=self.p)
+        assert list(metas) == ["key1"] and metas["key1"].value == 1
+
+    def test_delete_multi(self):
+        meta = self.meta
+        meta.set_multi({"a": 1, "b": 2}, key_prefix=self.p)
+        assert meta.delete_multi(["a", "b"], key_prefix=self.p)
+        assert meta.get_multi(["a", "b"], key_prefix=self.p) == {}
+        assert not meta.delete_multi(["a"], key_prefix=self.p)
+
+    def test_arithmetic(self):
+        meta, k = self.meta, self.k
+        with raises(pylibmc.NotFound):
+            meta.incr(k("n"))
+        assert meta.incr(k("n"), initial=10) == 10
+        assert meta.incr(k("n")) == 11
+        assert meta.incr(k("n"), 5) == 16
+        assert meta.decr(k("n"), 20) == 0
+        assert meta.incr_multi(["n", "m"], key_prefix=self.p) == {"n": 1}
+        assert meta.incr_multi(["m"], key_prefix=self.p, initial=3) == {"m": 3}
+        # Created by ma, so with no flags to say it is an int.
+        assert meta.get(k("n")) == b"1"
+
+    def test_shares_values_with_client(self):
+        mc, meta, k = self.mc, self.meta, self.k
+        meta.set(k("key"), {"a": 1})
+        assert mc.get(k("key")) == {"a": 1}
+        mc.set(k("big"), "x" * 10000, min_compress_len=1)
+        assert meta.get(k("big")) == "x" * 10000
+
+    def test_key_encoding(self):
+        meta, k = self.meta, self.k
+        key = k("\x01key")
+        assert meta.set(key, 1)
+        assert meta.get(key) == 1
+        with raises(ValueError):
+            meta.get("")
+        with raises(ValueError):
+            meta.get("x" * 300)
+
+    def test_hash_long_keys(self):
+        mc = pylibmc.Client(self.mc.addresses,
+                            behaviors={"hash_long_keys": True})
+        meta = MetaClient(mc)
+        key = self.k("x" * 300)
+        # Sent under the same mapped key as the client's.
+        assert meta.set(key, 1)
+        assert mc.get(key) == 1
+        mc.set(key, 2)
+        assert meta.get(key) == 2
+        assert meta.get_multi(["x" * 300], key_prefix=self.p) == {"x" * 300: 2}
+
+    def test_update_servers(self):
+        # Meta connections go by server position, which this changes.
+        mc = pylibmc.Client([closed_address()],
+                            behaviors={"failure_limit": 1, "retry_timeout": 60})
+        meta, k = MetaClient(mc), self.k
+        with raises(pylibmc.ConnectionError):
+            meta.get(k("key"))
+        mc.update_servers(self.mc.addresses)
+        assert meta.set(k("key"), 1)
+        mc.update_servers(self.mc.addresses + [closed_address()])
+        keys = ["key%d" % i for i in range(20)]
+        routes = mc.route_multi(keys, key_prefix=self.p)
+        missed = [key for key, server in zip(keys, routes)
+                  if server == len(self.mc.addresses)]
+        assert meta.set_multi(dict.fromkeys(keys, 2),
+                              key_prefix=self.p) == missed
+        mc.update_servers([closed_address()] + self.mc.addresses)
+        found = meta.get_multi(keys, key_prefix=self.p)
+        assert set(found.items()) <= {(key, 2) for key in keys}
+        mc.update_servers(self.mc.addresses)
+        assert meta.set_multi(dict.fromkeys(keys, 3), key_prefix=self.p) == []
+        assert meta.get_multi(keys, key_prefix=self.p) == dict.fromkeys(keys, 3)
+
+    def test_unreachable_server(self):
+        mc = pylibmc.Client(self.mc.addresses + [closed_address()])
+        keys = ["key%d" % i for i in range(20)]
+        routes = mc.route_multi(keys, key_prefix=self.p)
+        missed = [key for key, server in zip(keys, routes)
+                  if server == len(self.mc.addresses)]
+        assert missed
+        assert MetaClient(mc).set_multi(dict.fromkeys(keys, 1),
+                                        key_prefix=self.p) == missed
+
+class FaultServer(socketserver.ThreadingTCPServer):
+    """Stand-in for a memcached server that answers every request line with
+    *reply*, or never at all if it is None."""
+    daemon_threads = True
+
+    def __init__(self, reply):
+        super().__init__(("127.0.0.1", 0), FaultHandler)
+        self.reply = reply
+        self.thread = threading.Thread(target=self.serve_forever, daemon=True)
+        self.thread.start()
+
+    @property
+    def address(self):
+        return "%s:%d" % self.server_address
+
+    def close(self):
+        self.shutdown()
+        self.server_close()
+
+class FaultHandler(socketserver.StreamRequestHandler):
+    def handle(self):
+        for line in self.rfile:
+            if self.server.reply is not None:
+                self.wfile.write(self.server.reply)
+
+def closed_address():
+    sock = socket.socket()
+    sock.bind(("127.0.0.1", 0))
+    address = "127.0.0.1:%d" % sock.getsockname()[1]
+    sock.close()
+    return address
+
+def test_unsupported():
+    server = FaultServer(b"ERROR\r\n")
+    try:
+        meta = MetaClient(pylibmc.Client([server.address]))
+        with raises(pylibmc.ProtocolError):
+            meta.get("key")
+        assert meta.get_multi(["key"]) == {}
+    finally:
+        server.close()
+
+def test_server_error():
+    server = FaultServer(b"SERVER_ERROR out of memory storing object\r\n")
+    try:
+        meta = MetaClient(pylibmc.Client([server.address]))
+        with raises(pylibmc.ServerError):
+            meta.set("key", 1)
+        assert meta.set_multi({"a": 1}) == ["a"]
+    finally:
+        server.close()
+
+def test_timeout():
+    server = FaultServer(None)
+    try:
+        mc = pylibmc.Client([server.address], behaviors={"_poll_timeout": 100})
+        start = time.time()
+        with raises(pylibmc.Error):
+            MetaClient(mc).get("key")
+        assert time.time() - start < 5
+    finally:
+        server.close()
+
+def test_connection_error():
+    mc = pylibmc.Client([closed_address()],
+                        behaviors={"connect_timeout": 500})
+    meta = MetaClient(mc)
+    with raises(pylibmc.ConnectionError):
+        meta.get("key")
+    assert meta.set_multi({"a": 1}) == ["a"]
+
+def test_failure_limit():
+    mc = pylibmc.Client([closed_address()],
+                        behaviors={"failure_limit": 2, "retry_timeout": 60})
+    meta = MetaClient(mc)
+    for _ in range(2):
+        with raises(pylibmc.ConnectionError):
+            meta.get("key")
+    # Given up on for retry_timeout, without trying to connect.
+    with raises(pylibmc.ServerDead):
+        meta.get("key")
+    assert meta.get_multi(["key"]) == {}
+
+def test_udp():
+    with raises(pylibmc.NotSupportedError):
+        MetaClient(pylibmc.Client(["udp:127.0.0.1"])).get("key")
+
+def test_bad_requests():
+    mc = pylibmc.Client(["127.0.0.1"])
+    with raises(ValueError):
+        mc.meta("mn", ["key"])
+    with raises(ValueError):
+        mc.meta("mg", ["key"], b"v\r\nflush_all")
+    # Set by the engine, which goes by them.
+    for flags in (b"v O1", b"q", b"v b", b"Oabc v"):
+        with raises(ValueError):
+            mc.meta("mg", ["key"], flags)
+    with raises(ValueError):
+        mc.meta("ms", ["key"], b"F1", values=[1])
+    assert mc.meta("mg", ["key"], b"v f t", quiet=True) is not None
+    with raises(TypeError):
+        mc.meta("ms", ["key"])
+    with raises(ValueError):
+        mc.meta("ms", ["key"], values=[1, 2])
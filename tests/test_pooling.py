@@ -4,8 +4,25 @@ import pylibmc
 from tests import PylibmcTestCase
 from pytest import raises
 
+class WarmingClient(pylibmc.Client):
+    "Notes the servers its clones were warmed up with"
+    warmed = []
+
+    def connect_all(self, timeout=None):
+        self.warmed.append(self.addresses)
+        return super().connect_all(timeout)
+
 class PoolTestCase(PylibmcTestCase):
-    pass
+    def warm_after_update(self, make_pool):
+        # Nothing listens on port 1; putting it first drops all connections.
+        servers = ["127.0.0.1:1"] + self.mc.addresses
+        master = WarmingClient(self.mc.addresses)
+        master.clone().update_servers(servers)
+        WarmingClient.warmed = []
+        with make_pool(master).reserve() as mc:
+            assert mc.addresses == servers
+        assert WarmingClient.warmed and \
+            all(addresses == servers for addresses in WarmingClient.warmed)
 
 class ClientPoolTests(PoolTestCase):
     def test_simple(self):
@@ -28,6 +45,24 @@ class ClientPoolTests(PoolTestCase):
                     with p.reserve():
                         pass
 
+    def test_update_servers(self):
+        p = pylibmc.ClientPool(self.mc, 2)
+        servers = self.mc.addresses + ["127.0.0.1:1"]
+        self.mc.update_servers(servers)
+        with p.reserve() as mc1:
+            with p.reserve() as mc2:
+                assert mc1.addresses == mc2.addresses == servers
+
+    def test_warm(self):
+        p = pylibmc.ClientPool(self.mc, 4, warm=True)
+        assert p.qsize() == 4
+        with p.reserve() as mc:
+            assert mc.connect_all() == []
+            assert mc.set("warm", 1)
+
+    def test_warm_after_update(self):
+        self.warm_after_update(lambda mc: pylibmc.ClientPool(mc, 2, warm=True))
+
 class ThreadMappedPoolTests(PoolTestCase):
     def test_simple(self):
         a_str = "a"
@@ -36,3 +71,24 @@ class ThreadMappedPoolTests(PoolTestCase):
             assert smc
             assert smc.set(a_str, 1)
             assert smc[a_str] == 1
+
+    def test_update_servers(self):
+        p = pylibmc.ThreadMappedPool(self.mc)
+        with p.reserve() as smc:
+            servers = smc.addresses + ["127.0.0.1:1"]
+            smc.update_servers(servers)
+        assert self.mc.addresses != servers
+        with p.reserve() as smc:
+            assert smc.addresses == servers
+        self.mc.refresh_servers()
+        assert self.mc.addresses == servers
+
+    def test_warm(self):
+        p = pylibmc.ThreadMappedPool(self.mc, warm=True)
+        with p.reserve() as smc:
+            assert smc.connect_all() == []
+            assert smc.set("warm", 1)
+
+    def test_warm_after_update(self):
+        self.warm_after_update(
+            lambda mc: pylibmc.ThreadMappedPool(mc, warm=True))
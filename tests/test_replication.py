@@ -0,0 +1,41 @@
+import pylibmc
+from pylibmc.test import make_test_client
+from tests import PylibmcTestCase
+
+class FailingClient(pylibmc.Client):
+    "A client whose second server refuses every write"
+    def set_multi(self, mapping, **kwds):
+        if self.addresses == ["127.0.0.1:1"]:
+            raise pylibmc.ServerDown("down")
+        return super().set_multi(mapping, **kwds)
+
+class ReplicatedWritesTests(PylibmcTestCase):
+    def test_acks(self):
+        mc = make_test_client(binary=True)
+        # The same server three times stands in for three servers.
+        mc = pylibmc.Client(mc.addresses * 3, binary=True,
+                            behaviors={"num_replicas": 2})
+        writes = pylibmc.ReplicatedWrites(mc)
+        try:
+            assert writes.copies == 3
+            assert writes.quorum == 2
+            assert writes.set("repl-a", 1) == 3
+            acks = writes.set_multi({"a": 1, "b": 2}, key_prefix="repl-")
+            assert acks == {"a": 3, "b": 3}
+            assert writes.below_quorum(acks) == []
+            assert mc.get_multi(["repl-a", "repl-b"]) == {"repl-a": 1,
+                                                          "repl-b": 2}
+        finally:
+            writes.shutdown()
+
+    def test_failed_server(self):
+        mc = make_test_client(binary=True)
+        mc = FailingClient(mc.addresses + ["127.0.0.1:1"], binary=True)
+        writes = pylibmc.ReplicatedWrites(mc, copies=2)
+        try:
+            acks = writes.set_multi({"repl-%d" % i: i for i in range(10)})
+            assert set(acks.values()) == {1}
+            assert sorted(writes.below_quorum(acks)) == sorted(acks)
+            assert writes.set("repl-a", 1, time=10) == 1
+        finally:
+            writes.shutdown()